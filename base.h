@@ -29,6 +29,21 @@ typedef int8_t s8;
 #include <unistd.h>
 #define msleep(x) usleep(x * 1000)
 
+#include <time.h>
+
+#define NSEC_PER_USEC	1000L
+#define NSEC_PER_MSEC	1000000L
+#define NSEC_PER_SEC	1000000000L
+
+static inline u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
 #define KERN_EMERG      0    /* system is unusable */
 #define KERN_ALERT      1    /* action must be taken immediately */
 #define KERN_CRIT       2    /* critical conditions */
@@ -62,6 +77,8 @@ int printk(int level, const char *fmt, ...);
 
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+
 #define min(x, y) ({                            \
 	typeof(x) _min1 = (x);                  \
 	typeof(y) _min2 = (y);                  \
@@ -84,6 +101,8 @@ int printk(int level, const char *fmt, ...);
 	type __max2 = (y);                      \
 	__max1 > __max2 ? __max1: __max2; })
 
+#define clamp_t(type, val, lo, hi) min_t(type, max_t(type, val, lo), hi)
+
 #define swab16(x) ((__u16)(                     \
 	(((__u16)(x) & (__u16)0x00ffU) << 8) |  \
 	(((__u16)(x) & (__u16)0xff00U) >> 8)))
@@ -95,6 +114,9 @@ int printk(int level, const char *fmt, ...);
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 
+#define S64_MAX		((s64)(~0ULL >> 1))
+#define S64_MIN		(-S64_MAX - 1)
+
 #define MAX_ERRNO       4095
 
 #define IS_ERR_VALUE(x) ((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
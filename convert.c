@@ -0,0 +1,974 @@
+/*
+ * Pixel conversion
+ *
+ * XRGB8888 is packed to RGB565 and optionally byte swapped for the big
+ * endian wire in one pass, RGB565 can be byte swapped on its own. There are
+ * NEON (arm/arm64) and SSE2/AVX2 (x86) kernels, the SSE2 and NEON ones are
+ * used when the compiler targets them (-mfpu=neon on 32-bit arm), AVX2 is
+ * picked at runtime. The scalar version does the tail of each line and
+ * everything on other machines.
+ *
+ * XRGB8888 can also be packed to RGB666, 3 bytes per pixel (R, G, B with
+ * the two low bits unused) for controllers taking 18-bit color. There's no
+ * byte shuffle in SSE2, so that one is scalar unless the CPU has AVX2.
+ *
+ * The conversion to RGB565 can dither in the same pass: a 4x4 ordered (Bayer) pattern
+ * anchored to the screen so partial updates line up, or Floyd-Steinberg
+ * error diffusion vectorised across the color channels.
+ *
+ * Panels that can't be rotated or mirrored by the controller get the pixels
+ * in panel order from the transform stage before they are converted. 90 and
+ * 270 degrees transpose the framebuffer in 8x8 tiles (4x4 for 32-bit SSE2
+ * and NEON), the source lines of a tile stay in the cache while it's written.
+ */
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONVERT_NEON
+#endif
+
+#include "convert.h"
+#include "udrm.h"
+
+static inline u16 convert_pixel_rgb565(u32 pix)
+{
+	return ((pix >> 8) & 0xf800) | ((pix >> 5) & 0x07e0) | ((pix >> 3) & 0x001f);
+}
+
+static void convert_xrgb8888_to_rgb565_scalar(u16 *dst, const u32 *src, size_t pixels, bool swap)
+{
+	size_t i;
+
+	if (swap) {
+		for (i = 0; i < pixels; i++)
+			dst[i] = swab16(convert_pixel_rgb565(src[i]));
+	} else {
+		for (i = 0; i < pixels; i++)
+			dst[i] = convert_pixel_rgb565(src[i]);
+	}
+}
+
+static void convert_swab16_scalar(u16 *dst, const u16 *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		dst[i] = swab16(src[i]);
+}
+
+static void convert_xrgb8888_to_rgb666_scalar(u8 *dst, const u32 *src, size_t pixels)
+{
+	size_t i;
+
+	for (i = 0; i < pixels; i++, dst += 3) {
+		dst[0] = (src[i] >> 16) & 0xfc;
+		dst[1] = (src[i] >> 8) & 0xfc;
+		dst[2] = src[i] & 0xfc;
+	}
+}
+
+#define CONVERT_TILE	8
+
+static void convert_transpose16_scalar(u16 *dst, ptrdiff_t dst_stride, const u16 *src, ptrdiff_t src_stride,
+				       unsigned int w, unsigned int h)
+{
+	unsigned int tx, ty, x, y;
+
+	for (ty = 0; ty < h; ty += CONVERT_TILE)
+		for (tx = 0; tx < w; tx += CONVERT_TILE)
+			for (y = ty; y < min(ty + CONVERT_TILE, h); y++)
+				for (x = tx; x < min(tx + CONVERT_TILE, w); x++)
+					dst[(ptrdiff_t)x * dst_stride + y] = src[(ptrdiff_t)y * src_stride + x];
+}
+
+static void convert_transpose32_scalar(u32 *dst, ptrdiff_t dst_stride, const u32 *src, ptrdiff_t src_stride,
+				       unsigned int w, unsigned int h)
+{
+	unsigned int tx, ty, x, y;
+
+	for (ty = 0; ty < h; ty += CONVERT_TILE)
+		for (tx = 0; tx < w; tx += CONVERT_TILE)
+			for (y = ty; y < min(ty + CONVERT_TILE, h); y++)
+				for (x = tx; x < min(tx + CONVERT_TILE, w); x++)
+					dst[(ptrdiff_t)x * dst_stride + y] = src[(ptrdiff_t)y * src_stride + x];
+}
+
+static void convert_reverse16_scalar(u16 *dst, const u16 *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		dst[i] = src[num - 1 - i];
+}
+
+static void convert_reverse32_scalar(u32 *dst, const u32 *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		dst[i] = src[num - 1 - i];
+}
+
+/*
+ * Transpose whole @tile x @tile blocks with @fn and the right and bottom
+ * edges with @edge.
+ */
+#define CONVERT_TRANSPOSE_TILED(fn, edge, tile, dst, dst_stride, src, src_stride, w, h)		\
+do {												\
+	unsigned int _w = (w) & ~((tile) - 1), _h = (h) & ~((tile) - 1);			\
+	unsigned int _x, _y;									\
+												\
+	for (_y = 0; _y < _h; _y += (tile))							\
+		for (_x = 0; _x < _w; _x += (tile))						\
+			fn((dst) + (ptrdiff_t)_x * (dst_stride) + _y, dst_stride,		\
+			   (src) + (ptrdiff_t)_y * (src_stride) + _x, src_stride);		\
+	edge((dst) + (ptrdiff_t)_w * (dst_stride), dst_stride, (src) + _w, src_stride,	\
+	     (w) - _w, _h);									\
+	edge((dst) + _h, dst_stride, (src) + (ptrdiff_t)_h * (src_stride), src_stride,	\
+	     w, (h) - _h);									\
+} while (0)
+
+static const u8 convert_bayer[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 },
+};
+
+/* Added to the pixel at (@x, @y) before the bits RGB565 drops are cut off */
+static inline u32 convert_bayer_threshold(unsigned int x, unsigned int y)
+{
+	unsigned int m = convert_bayer[y & 3][x & 3];
+	u32 rb = (2 * m + 1) / 4;
+	u32 g = (2 * m + 1) / 8;
+
+	return rb << 16 | g << 8 | rb;
+}
+
+static inline u16 convert_pixel_rgb565_ordered(u32 pix, u32 threshold)
+{
+	u32 r = min_t(u32, ((pix >> 16) & 0xff) + (threshold >> 16), 0xff);
+	u32 g = min_t(u32, ((pix >> 8) & 0xff) + ((threshold >> 8) & 0xff), 0xff);
+	u32 b = min_t(u32, (pix & 0xff) + (threshold & 0xff), 0xff);
+
+	return ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+}
+
+static void convert_xrgb8888_to_rgb565_ordered_scalar(u16 *dst, const u32 *src, size_t pixels, bool swap,
+						      unsigned int x, unsigned int y)
+{
+	size_t i;
+	u16 val;
+
+	for (i = 0; i < pixels; i++) {
+		val = convert_pixel_rgb565_ordered(src[i], convert_bayer_threshold(x + i, y));
+		dst[i] = swap ? swab16(val) : val;
+	}
+}
+
+/*
+ * Floyd-Steinberg error diffusion, the errors are kept in 1/16ths. The
+ * pixel to the left of the one being converted gets its share of the next
+ * line's error when the one to the right of it is known.
+ */
+static void convert_xrgb8888_to_rgb565_fs_scalar(u16 *dst, const u32 *src, size_t pixels, bool swap, s16 *err)
+{
+	static const int mask[3] = { 0xf8 << 4, 0xfc << 4, 0xf8 << 4 };
+	int right[3] = { 0 }, below[3] = { 0 }, prev[3] = { 0 };
+	int v, q[3], e;
+	unsigned int c;
+	size_t i;
+	u16 val;
+
+	for (i = 0; i < pixels; i++) {
+		for (c = 0; c < 3; c++) {
+			v = (((src[i] >> (8 * c)) & 0xff) << 4) + err[4 * i + c] + right[c];
+			v = clamp_t(int, v, 0, 0xff << 4);
+			q[c] = v & mask[c];
+			e = v - q[c];
+
+			right[c] = (e * 7) >> 4;
+			if (i)
+				err[4 * (i - 1) + c] = below[c] + ((e * 3) >> 4);
+			below[c] = (prev[c] >> 4) + ((e * 5) >> 4);
+			prev[c] = e;
+		}
+
+		val = (q[2] << 4) | (q[1] >> 1) | (q[0] >> 7);
+		dst[i] = swap ? swab16(val) : val;
+	}
+
+	if (pixels) {
+		for (c = 0; c < 3; c++)
+			err[4 * (pixels - 1) + c] = below[c];
+	}
+}
+
+static const struct convert_funcs convert_scalar = {
+	.name = "scalar",
+	.xrgb8888_to_rgb565 = convert_xrgb8888_to_rgb565_scalar,
+	.xrgb8888_to_rgb565_ordered = convert_xrgb8888_to_rgb565_ordered_scalar,
+	.xrgb8888_to_rgb565_fs = convert_xrgb8888_to_rgb565_fs_scalar,
+	.xrgb8888_to_rgb666 = convert_xrgb8888_to_rgb666_scalar,
+	.swab16_buf = convert_swab16_scalar,
+	.transpose16 = convert_transpose16_scalar,
+	.transpose32 = convert_transpose32_scalar,
+	.reverse16 = convert_reverse16_scalar,
+	.reverse32 = convert_reverse32_scalar,
+};
+
+#if defined(__SSE2__)
+
+/* 4 pixels to RGB565 in the low half of each 32-bit lane, sign extended for packing */
+static inline __m128i convert_sse2_rgb565(__m128i pix)
+{
+	__m128i r = _mm_and_si128(_mm_srli_epi32(pix, 8), _mm_set1_epi32(0xf800));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(pix, 5), _mm_set1_epi32(0x07e0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(pix, 3), _mm_set1_epi32(0x001f));
+	__m128i rgb = _mm_or_si128(_mm_or_si128(r, g), b);
+
+	/* packs saturates signed values */
+	return _mm_srai_epi32(_mm_slli_epi32(rgb, 16), 16);
+}
+
+static void convert_xrgb8888_to_rgb565_sse2(u16 *dst, const u32 *src, size_t pixels, bool swap)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= pixels; i += 8) {
+		__m128i lo = convert_sse2_rgb565(_mm_loadu_si128((const __m128i *)(src + i)));
+		__m128i hi = convert_sse2_rgb565(_mm_loadu_si128((const __m128i *)(src + i + 4)));
+		__m128i out = _mm_packs_epi32(lo, hi);
+
+		if (swap)
+			out = _mm_or_si128(_mm_slli_epi16(out, 8), _mm_srli_epi16(out, 8));
+		_mm_storeu_si128((__m128i *)(dst + i), out);
+	}
+
+	convert_xrgb8888_to_rgb565_scalar(dst + i, src + i, pixels - i, swap);
+}
+
+/* The pattern repeats every 4 pixels, one register's worth */
+static void convert_xrgb8888_to_rgb565_ordered_sse2(u16 *dst, const u32 *src, size_t pixels, bool swap,
+						    unsigned int x, unsigned int y)
+{
+	__m128i threshold = _mm_setr_epi32(convert_bayer_threshold(x, y), convert_bayer_threshold(x + 1, y),
+					   convert_bayer_threshold(x + 2, y), convert_bayer_threshold(x + 3, y));
+	size_t i;
+
+	for (i = 0; i + 8 <= pixels; i += 8) {
+		__m128i lo = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(src + i)), threshold);
+		__m128i hi = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(src + i + 4)), threshold);
+		__m128i out = _mm_packs_epi32(convert_sse2_rgb565(lo), convert_sse2_rgb565(hi));
+
+		if (swap)
+			out = _mm_or_si128(_mm_slli_epi16(out, 8), _mm_srli_epi16(out, 8));
+		_mm_storeu_si128((__m128i *)(dst + i), out);
+	}
+
+	convert_xrgb8888_to_rgb565_ordered_scalar(dst + i, src + i, pixels - i, swap, x + i, y);
+}
+
+/* One pixel at a time with B, G, R and X in the lanes, see the scalar version */
+static void convert_xrgb8888_to_rgb565_fs_sse2(u16 *dst, const u32 *src, size_t pixels, bool swap, s16 *err)
+{
+	const __m128i mask = _mm_setr_epi16(0xf8 << 4, 0xfc << 4, 0xf8 << 4, 0, 0, 0, 0, 0);
+	/* B >> 7 and G >> 1 in the high half, R << 4 in the low half */
+	const __m128i pack_hi = _mm_setr_epi16(1 << 9, 1 << 15, 0, 0, 0, 0, 0, 0);
+	const __m128i pack_lo = _mm_setr_epi16(0, 0, 1 << 4, 0, 0, 0, 0, 0);
+	const __m128i max = _mm_set1_epi16(0xff << 4);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i right = zero, below = zero, prev = zero;
+	__m128i v, q, e, rgb;
+	size_t i;
+	u16 val;
+
+	for (i = 0; i < pixels; i++) {
+		v = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(src[i]), zero), 4);
+		v = _mm_add_epi16(v, _mm_add_epi16(_mm_loadl_epi64((const __m128i *)(err + 4 * i)), right));
+		v = _mm_min_epi16(_mm_max_epi16(v, zero), max);
+		q = _mm_and_si128(v, mask);
+		e = _mm_sub_epi16(v, q);
+
+		right = _mm_srli_epi16(_mm_mullo_epi16(e, _mm_set1_epi16(7)), 4);
+		if (i)
+			_mm_storel_epi64((__m128i *)(err + 4 * (i - 1)),
+					 _mm_add_epi16(below, _mm_srli_epi16(_mm_mullo_epi16(e, _mm_set1_epi16(3)), 4)));
+		below = _mm_add_epi16(_mm_srli_epi16(prev, 4), _mm_srli_epi16(_mm_mullo_epi16(e, _mm_set1_epi16(5)), 4));
+		prev = e;
+
+		rgb = _mm_or_si128(_mm_mulhi_epu16(q, pack_hi), _mm_mullo_epi16(q, pack_lo));
+		rgb = _mm_or_si128(rgb, _mm_or_si128(_mm_srli_si128(rgb, 2), _mm_srli_si128(rgb, 4)));
+		val = _mm_cvtsi128_si32(rgb);
+		dst[i] = swap ? swab16(val) : val;
+	}
+
+	if (pixels)
+		_mm_storel_epi64((__m128i *)(err + 4 * (pixels - 1)), below);
+}
+
+/* pshufb needs SSSE3, shifting does the same in SSE2 */
+static void convert_swab16_sse2(u16 *dst, const u16 *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= num; i += 8) {
+		__m128i val = _mm_loadu_si128((const __m128i *)(src + i));
+
+		val = _mm_or_si128(_mm_slli_epi16(val, 8), _mm_srli_epi16(val, 8));
+		_mm_storeu_si128((__m128i *)(dst + i), val);
+	}
+
+	convert_swab16_scalar(dst + i, src + i, num - i);
+}
+
+static void convert_sse2_transpose16_8x8(u16 *dst, ptrdiff_t dst_stride, const u16 *src, ptrdiff_t src_stride)
+{
+	__m128i r[8], a[8], b[8];
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm_loadu_si128((const __m128i *)(src + i * src_stride));
+
+	for (i = 0; i < 4; i++) {
+		a[2 * i] = _mm_unpacklo_epi16(r[2 * i], r[2 * i + 1]);
+		a[2 * i + 1] = _mm_unpackhi_epi16(r[2 * i], r[2 * i + 1]);
+	}
+
+	/* columns 0-1, 2-3, 4-5 and 6-7 of lines 0-3, then of lines 4-7 */
+	for (i = 0; i < 2; i++) {
+		b[4 * i] = _mm_unpacklo_epi32(a[4 * i], a[4 * i + 2]);
+		b[4 * i + 1] = _mm_unpackhi_epi32(a[4 * i], a[4 * i + 2]);
+		b[4 * i + 2] = _mm_unpacklo_epi32(a[4 * i + 1], a[4 * i + 3]);
+		b[4 * i + 3] = _mm_unpackhi_epi32(a[4 * i + 1], a[4 * i + 3]);
+	}
+
+	for (i = 0; i < 4; i++) {
+		_mm_storeu_si128((__m128i *)(dst + 2 * i * dst_stride), _mm_unpacklo_epi64(b[i], b[i + 4]));
+		_mm_storeu_si128((__m128i *)(dst + (2 * i + 1) * dst_stride), _mm_unpackhi_epi64(b[i], b[i + 4]));
+	}
+}
+
+static void convert_transpose16_sse2(u16 *dst, ptrdiff_t dst_stride, const u16 *src, ptrdiff_t src_stride,
+				     unsigned int w, unsigned int h)
+{
+	CONVERT_TRANSPOSE_TILED(convert_sse2_transpose16_8x8, convert_transpose16_scalar, 8,
+				dst, dst_stride, src, src_stride, w, h);
+}
+
+static void convert_sse2_transpose32_4x4(u32 *dst, ptrdiff_t dst_stride, const u32 *src, ptrdiff_t src_stride)
+{
+	__m128i r0 = _mm_loadu_si128((const __m128i *)src);
+	__m128i r1 = _mm_loadu_si128((const __m128i *)(src + src_stride));
+	__m128i r2 = _mm_loadu_si128((const __m128i *)(src + 2 * src_stride));
+	__m128i r3 = _mm_loadu_si128((const __m128i *)(src + 3 * src_stride));
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+	__m128i t1 = _mm_unpackhi_epi32(r0, r1);
+	__m128i t2 = _mm_unpacklo_epi32(r2, r3);
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi64(t0, t2));
+	_mm_storeu_si128((__m128i *)(dst + dst_stride), _mm_unpackhi_epi64(t0, t2));
+	_mm_storeu_si128((__m128i *)(dst + 2 * dst_stride), _mm_unpacklo_epi64(t1, t3));
+	_mm_storeu_si128((__m128i *)(dst + 3 * dst_stride), _mm_unpackhi_epi64(t1, t3));
+}
+
+static void convert_transpose32_sse2(u32 *dst, ptrdiff_t dst_stride, const u32 *src, ptrdiff_t src_stride,
+				     unsigned int w, unsigned int h)
+{
+	CONVERT_TRANSPOSE_TILED(convert_sse2_transpose32_4x4, convert_transpose32_scalar, 4,
+				dst, dst_stride, src, src_stride, w, h);
+}
+
+static void convert_reverse16_sse2(u16 *dst, const u16 *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= num; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + num - 8 - i));
+
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	}
+
+	convert_reverse16_scalar(dst + i, src, num - i);
+}
+
+static void convert_reverse32_sse2(u32 *dst, const u32 *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= num; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + num - 4 - i));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+	}
+
+	convert_reverse32_scalar(dst + i, src, num - i);
+}
+
+static const struct convert_funcs convert_sse2 = {
+	.name = "sse2",
+	.xrgb8888_to_rgb565 = convert_xrgb8888_to_rgb565_sse2,
+	.xrgb8888_to_rgb565_ordered = convert_xrgb8888_to_rgb565_ordered_sse2,
+	.xrgb8888_to_rgb565_fs = convert_xrgb8888_to_rgb565_fs_sse2,
+	.xrgb8888_to_rgb666 = convert_xrgb8888_to_rgb666_scalar,
+	.swab16_buf = convert_swab16_sse2,
+	.transpose16 = convert_transpose16_sse2,
+	.transpose32 = convert_transpose32_sse2,
+	.reverse16 = convert_reverse16_sse2,
+	.reverse32 = convert_reverse32_sse2,
+};
+
+/*
+ * The AVX2 versions leave the tail to the SSE2 ones, clearing the upper
+ * halves first avoids the penalty for mixing them.
+ */
+__attribute__((target("avx2")))
+static inline __m256i convert_avx2_rgb565(__m256i pix)
+{
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(pix, 8), _mm256_set1_epi32(0xf800));
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(pix, 5), _mm256_set1_epi32(0x07e0));
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(pix, 3), _mm256_set1_epi32(0x001f));
+	__m256i rgb = _mm256_or_si256(_mm256_or_si256(r, g), b);
+
+	return _mm256_srai_epi32(_mm256_slli_epi32(rgb, 16), 16);
+}
+
+__attribute__((target("avx2")))
+static void convert_xrgb8888_to_rgb565_avx2(u16 *dst, const u32 *src, size_t pixels, bool swap)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		__m256i lo = convert_avx2_rgb565(_mm256_loadu_si256((const __m256i *)(src + i)));
+		__m256i hi = convert_avx2_rgb565(_mm256_loadu_si256((const __m256i *)(src + i + 8)));
+		/* packs works per 128-bit lane, put the quadwords back in order */
+		__m256i out = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+
+		if (swap)
+			out = _mm256_or_si256(_mm256_slli_epi16(out, 8), _mm256_srli_epi16(out, 8));
+		_mm256_storeu_si256((__m256i *)(dst + i), out);
+	}
+
+	_mm256_zeroupper();
+	convert_xrgb8888_to_rgb565_sse2(dst + i, src + i, pixels - i, swap);
+}
+
+__attribute__((target("avx2")))
+static void convert_xrgb8888_to_rgb565_ordered_avx2(u16 *dst, const u32 *src, size_t pixels, bool swap,
+						    unsigned int x, unsigned int y)
+{
+	__m256i threshold = _mm256_setr_epi32(convert_bayer_threshold(x, y), convert_bayer_threshold(x + 1, y),
+					      convert_bayer_threshold(x + 2, y), convert_bayer_threshold(x + 3, y),
+					      convert_bayer_threshold(x, y), convert_bayer_threshold(x + 1, y),
+					      convert_bayer_threshold(x + 2, y), convert_bayer_threshold(x + 3, y));
+	size_t i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		__m256i lo = _mm256_adds_epu8(_mm256_loadu_si256((const __m256i *)(src + i)), threshold);
+		__m256i hi = _mm256_adds_epu8(_mm256_loadu_si256((const __m256i *)(src + i + 8)), threshold);
+		__m256i out = _mm256_permute4x64_epi64(_mm256_packs_epi32(convert_avx2_rgb565(lo),
+									  convert_avx2_rgb565(hi)), 0xd8);
+
+		if (swap)
+			out = _mm256_or_si256(_mm256_slli_epi16(out, 8), _mm256_srli_epi16(out, 8));
+		_mm256_storeu_si256((__m256i *)(dst + i), out);
+	}
+
+	_mm256_zeroupper();
+	convert_xrgb8888_to_rgb565_ordered_sse2(dst + i, src + i, pixels - i, swap, x + i, y);
+}
+
+/* 12 bytes from the low end of @val */
+__attribute__((target("avx2")))
+static inline void convert_avx2_store_rgb666(u8 *dst, __m128i val)
+{
+	u32 last = _mm_cvtsi128_si32(_mm_srli_si128(val, 8));
+
+	_mm_storel_epi64((__m128i *)dst, val);
+	memcpy(dst + 8, &last, 4);
+}
+
+__attribute__((target("avx2")))
+static void convert_xrgb8888_to_rgb666_avx2(u8 *dst, const u32 *src, size_t pixels)
+{
+	/* R, G and B of the 4 pixels in each lane packed at the start of it */
+	const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+						 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i mask = _mm256_set1_epi8(0xfc);
+	size_t i;
+
+	for (i = 0; i + 8 <= pixels; i += 8, dst += 24) {
+		__m256i pix = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		pix = _mm256_shuffle_epi8(_mm256_and_si256(pix, mask), shuffle);
+		convert_avx2_store_rgb666(dst, _mm256_castsi256_si128(pix));
+		convert_avx2_store_rgb666(dst + 12, _mm256_extracti128_si256(pix, 1));
+	}
+
+	_mm256_zeroupper();
+	convert_xrgb8888_to_rgb666_scalar(dst, src + i, pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_swab16_avx2(u16 *dst, const u16 *src, size_t num)
+{
+	const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+					      1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i;
+
+	for (i = 0; i + 32 <= num; i += 32) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(lo, mask));
+		_mm256_storeu_si256((__m256i *)(dst + i + 16), _mm256_shuffle_epi8(hi, mask));
+	}
+
+	_mm256_zeroupper();
+	convert_swab16_sse2(dst + i, src + i, num - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_avx2_transpose32_8x8(u32 *dst, ptrdiff_t dst_stride, const u32 *src, ptrdiff_t src_stride)
+{
+	__m256i r[8], t[8], u[8];
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm256_loadu_si256((const __m256i *)(src + i * src_stride));
+
+	for (i = 0; i < 4; i++) {
+		t[2 * i] = _mm256_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+		t[2 * i + 1] = _mm256_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+	}
+
+	/* columns 0|4, 1|5, 2|6 and 3|7 of lines 0-3, then of lines 4-7 */
+	for (i = 0; i < 2; i++) {
+		u[4 * i] = _mm256_unpacklo_epi64(t[4 * i], t[4 * i + 2]);
+		u[4 * i + 1] = _mm256_unpackhi_epi64(t[4 * i], t[4 * i + 2]);
+		u[4 * i + 2] = _mm256_unpacklo_epi64(t[4 * i + 1], t[4 * i + 3]);
+		u[4 * i + 3] = _mm256_unpackhi_epi64(t[4 * i + 1], t[4 * i + 3]);
+	}
+
+	for (i = 0; i < 4; i++) {
+		_mm256_storeu_si256((__m256i *)(dst + i * dst_stride), _mm256_permute2x128_si256(u[i], u[i + 4], 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + (i + 4) * dst_stride), _mm256_permute2x128_si256(u[i], u[i + 4], 0x31));
+	}
+}
+
+__attribute__((target("avx2")))
+static void convert_transpose32_avx2(u32 *dst, ptrdiff_t dst_stride, const u32 *src, ptrdiff_t src_stride,
+				     unsigned int w, unsigned int h)
+{
+	unsigned int w8 = w & ~7, h8 = h & ~7;
+	unsigned int x, y;
+
+	for (y = 0; y < h8; y += 8)
+		for (x = 0; x < w8; x += 8)
+			convert_avx2_transpose32_8x8(dst + (ptrdiff_t)x * dst_stride + y, dst_stride,
+						     src + (ptrdiff_t)y * src_stride + x, src_stride);
+
+	_mm256_zeroupper();
+	convert_transpose32_sse2(dst + (ptrdiff_t)w8 * dst_stride, dst_stride, src + w8, src_stride, w - w8, h8);
+	convert_transpose32_sse2(dst + h8, dst_stride, src + (ptrdiff_t)h8 * src_stride, src_stride, w, h - h8);
+}
+
+static const struct convert_funcs convert_avx2 = {
+	.name = "avx2",
+	.xrgb8888_to_rgb565 = convert_xrgb8888_to_rgb565_avx2,
+	.xrgb8888_to_rgb565_ordered = convert_xrgb8888_to_rgb565_ordered_avx2,
+	/* error diffusion goes one pixel at a time, wider registers don't help */
+	.xrgb8888_to_rgb565_fs = convert_xrgb8888_to_rgb565_fs_sse2,
+	.xrgb8888_to_rgb666 = convert_xrgb8888_to_rgb666_avx2,
+	.swab16_buf = convert_swab16_avx2,
+	.transpose16 = convert_transpose16_sse2,
+	.transpose32 = convert_transpose32_avx2,
+	.reverse16 = convert_reverse16_sse2,
+	.reverse32 = convert_reverse32_sse2,
+};
+
+#endif /* __SSE2__ */
+
+#ifdef CONVERT_NEON
+
+/*
+ * The loads split the pixels into B, G, R and X planes (little endian). The
+ * two bytes of each RGB565 pixel are built separately and stored
+ * interleaved in the order the wire or the CPU wants them.
+ */
+static void convert_xrgb8888_to_rgb565_neon(u16 *dst, const u32 *src, size_t pixels, bool swap)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		uint8x16x4_t pix = vld4q_u8((const u8 *)(src + i));
+		uint8x16_t b = pix.val[0], g = pix.val[1], r = pix.val[2];
+		uint8x16x2_t out;
+		uint8x16_t hi, lo;
+
+		hi = vorrq_u8(vandq_u8(r, vdupq_n_u8(0xf8)), vshrq_n_u8(g, 5));
+		lo = vorrq_u8(vshlq_n_u8(vandq_u8(g, vdupq_n_u8(0x1c)), 3), vshrq_n_u8(b, 3));
+
+		out.val[0] = swap ? hi : lo;
+		out.val[1] = swap ? lo : hi;
+		vst2q_u8((u8 *)(dst + i), out);
+	}
+
+	convert_xrgb8888_to_rgb565_scalar(dst + i, src + i, pixels - i, swap);
+}
+
+static void convert_xrgb8888_to_rgb565_ordered_neon(u16 *dst, const u32 *src, size_t pixels, bool swap,
+						    unsigned int x, unsigned int y)
+{
+	uint8x16_t threshold_rb, threshold_g;
+	u8 rb_lanes[16], g_lanes[16];
+	unsigned int k;
+	size_t i;
+
+	for (k = 0; k < 16; k++) {
+		u32 threshold = convert_bayer_threshold(x + k, y);
+
+		rb_lanes[k] = threshold & 0xff;
+		g_lanes[k] = (threshold >> 8) & 0xff;
+	}
+	threshold_rb = vld1q_u8(rb_lanes);
+	threshold_g = vld1q_u8(g_lanes);
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		uint8x16x4_t pix = vld4q_u8((const u8 *)(src + i));
+		uint8x16_t b = vqaddq_u8(pix.val[0], threshold_rb);
+		uint8x16_t g = vqaddq_u8(pix.val[1], threshold_g);
+		uint8x16_t r = vqaddq_u8(pix.val[2], threshold_rb);
+		uint8x16x2_t out;
+		uint8x16_t hi, lo;
+
+		hi = vorrq_u8(vandq_u8(r, vdupq_n_u8(0xf8)), vshrq_n_u8(g, 5));
+		lo = vorrq_u8(vshlq_n_u8(vandq_u8(g, vdupq_n_u8(0x1c)), 3), vshrq_n_u8(b, 3));
+
+		out.val[0] = swap ? hi : lo;
+		out.val[1] = swap ? lo : hi;
+		vst2q_u8((u8 *)(dst + i), out);
+	}
+
+	convert_xrgb8888_to_rgb565_ordered_scalar(dst + i, src + i, pixels - i, swap, x + i, y);
+}
+
+static void convert_xrgb8888_to_rgb565_fs_neon(u16 *dst, const u32 *src, size_t pixels, bool swap, s16 *err)
+{
+	const int16x4_t mask = { 0xf8 << 4, 0xfc << 4, 0xf8 << 4, 0 };
+	const int16x4_t zero = vdup_n_s16(0);
+	const int16x4_t max = vdup_n_s16(0xff << 4);
+	int16x4_t right = zero, below = zero, prev = zero;
+	int16x4_t v, q, e;
+	size_t i;
+	u16 val;
+
+	for (i = 0; i < pixels; i++) {
+		v = vreinterpret_s16_u16(vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(src[i])))));
+		v = vadd_s16(vshl_n_s16(v, 4), vadd_s16(vld1_s16(err + 4 * i), right));
+		v = vmin_s16(vmax_s16(v, zero), max);
+		q = vand_s16(v, mask);
+		e = vsub_s16(v, q);
+
+		right = vshr_n_s16(vmul_n_s16(e, 7), 4);
+		if (i)
+			vst1_s16(err + 4 * (i - 1), vadd_s16(below, vshr_n_s16(vmul_n_s16(e, 3), 4)));
+		below = vadd_s16(vshr_n_s16(prev, 4), vshr_n_s16(vmul_n_s16(e, 5), 4));
+		prev = e;
+
+		val = (vget_lane_s16(q, 2) << 4) | (vget_lane_s16(q, 1) >> 1) | (vget_lane_s16(q, 0) >> 7);
+		dst[i] = swap ? swab16(val) : val;
+	}
+
+	if (pixels)
+		vst1_s16(err + 4 * (pixels - 1), below);
+}
+
+static void convert_xrgb8888_to_rgb666_neon(u8 *dst, const u32 *src, size_t pixels)
+{
+	const uint8x16_t mask = vdupq_n_u8(0xfc);
+	size_t i;
+
+	for (i = 0; i + 16 <= pixels; i += 16, dst += 48) {
+		uint8x16x4_t pix = vld4q_u8((const u8 *)(src + i));
+		uint8x16x3_t out;
+
+		out.val[0] = vandq_u8(pix.val[2], mask);
+		out.val[1] = vandq_u8(pix.val[1], mask);
+		out.val[2] = vandq_u8(pix.val[0], mask);
+		vst3q_u8(dst, out);
+	}
+
+	convert_xrgb8888_to_rgb666_scalar(dst, src + i, pixels - i);
+}
+
+static void convert_swab16_neon(u16 *dst, const u16 *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= num; i += 16) {
+		uint8x16_t lo = vld1q_u8((const u8 *)(src + i));
+		uint8x16_t hi = vld1q_u8((const u8 *)(src + i + 8));
+
+		vst1q_u8((u8 *)(dst + i), vrev16q_u8(lo));
+		vst1q_u8((u8 *)(dst + i + 8), vrev16q_u8(hi));
+	}
+
+	convert_swab16_scalar(dst + i, src + i, num - i);
+}
+
+static void convert_neon_transpose16_4x4(u16 *dst, ptrdiff_t dst_stride, const u16 *src, ptrdiff_t src_stride)
+{
+	uint16x4x2_t p0 = vtrn_u16(vld1_u16(src), vld1_u16(src + src_stride));
+	uint16x4x2_t p1 = vtrn_u16(vld1_u16(src + 2 * src_stride), vld1_u16(src + 3 * src_stride));
+	uint32x2x2_t q0 = vtrn_u32(vreinterpret_u32_u16(p0.val[0]), vreinterpret_u32_u16(p1.val[0]));
+	uint32x2x2_t q1 = vtrn_u32(vreinterpret_u32_u16(p0.val[1]), vreinterpret_u32_u16(p1.val[1]));
+
+	vst1_u16(dst, vreinterpret_u16_u32(q0.val[0]));
+	vst1_u16(dst + dst_stride, vreinterpret_u16_u32(q1.val[0]));
+	vst1_u16(dst + 2 * dst_stride, vreinterpret_u16_u32(q0.val[1]));
+	vst1_u16(dst + 3 * dst_stride, vreinterpret_u16_u32(q1.val[1]));
+}
+
+static void convert_transpose16_neon(u16 *dst, ptrdiff_t dst_stride, const u16 *src, ptrdiff_t src_stride,
+				     unsigned int w, unsigned int h)
+{
+	CONVERT_TRANSPOSE_TILED(convert_neon_transpose16_4x4, convert_transpose16_scalar, 4,
+				dst, dst_stride, src, src_stride, w, h);
+}
+
+static void convert_neon_transpose32_4x4(u32 *dst, ptrdiff_t dst_stride, const u32 *src, ptrdiff_t src_stride)
+{
+	uint32x4x2_t p0 = vtrnq_u32(vld1q_u32(src), vld1q_u32(src + src_stride));
+	uint32x4x2_t p1 = vtrnq_u32(vld1q_u32(src + 2 * src_stride), vld1q_u32(src + 3 * src_stride));
+
+	vst1q_u32(dst, vcombine_u32(vget_low_u32(p0.val[0]), vget_low_u32(p1.val[0])));
+	vst1q_u32(dst + dst_stride, vcombine_u32(vget_low_u32(p0.val[1]), vget_low_u32(p1.val[1])));
+	vst1q_u32(dst + 2 * dst_stride, vcombine_u32(vget_high_u32(p0.val[0]), vget_high_u32(p1.val[0])));
+	vst1q_u32(dst + 3 * dst_stride, vcombine_u32(vget_high_u32(p0.val[1]), vget_high_u32(p1.val[1])));
+}
+
+static void convert_transpose32_neon(u32 *dst, ptrdiff_t dst_stride, const u32 *src, ptrdiff_t src_stride,
+				     unsigned int w, unsigned int h)
+{
+	CONVERT_TRANSPOSE_TILED(convert_neon_transpose32_4x4, convert_transpose32_scalar, 4,
+				dst, dst_stride, src, src_stride, w, h);
+}
+
+static void convert_reverse16_neon(u16 *dst, const u16 *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= num; i += 8) {
+		uint16x8_t v = vrev64q_u16(vld1q_u16(src + num - 8 - i));
+
+		vst1q_u16(dst + i, vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+	}
+
+	convert_reverse16_scalar(dst + i, src, num - i);
+}
+
+static void convert_reverse32_neon(u32 *dst, const u32 *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= num; i += 4) {
+		uint32x4_t v = vrev64q_u32(vld1q_u32(src + num - 4 - i));
+
+		vst1q_u32(dst + i, vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+	}
+
+	convert_reverse32_scalar(dst + i, src, num - i);
+}
+
+static const struct convert_funcs convert_neon = {
+	.name = "neon",
+	.xrgb8888_to_rgb565 = convert_xrgb8888_to_rgb565_neon,
+	.xrgb8888_to_rgb565_ordered = convert_xrgb8888_to_rgb565_ordered_neon,
+	.xrgb8888_to_rgb565_fs = convert_xrgb8888_to_rgb565_fs_neon,
+	.xrgb8888_to_rgb666 = convert_xrgb8888_to_rgb666_neon,
+	.swab16_buf = convert_swab16_neon,
+	.transpose16 = convert_transpose16_neon,
+	.transpose32 = convert_transpose32_neon,
+	.reverse16 = convert_reverse16_neon,
+	.reverse32 = convert_reverse32_neon,
+};
+
+#endif /* CONVERT_NEON */
+
+static const struct convert_funcs *convert_funcs;
+static bool convert_no_simd;
+
+static const struct convert_funcs *convert_select(void)
+{
+	if (convert_no_simd)
+		return &convert_scalar;
+
+#if defined(__SSE2__)
+	if (__builtin_cpu_supports("avx2"))
+		return &convert_avx2;
+
+	return &convert_sse2;
+#elif defined(CONVERT_NEON)
+	return &convert_neon;
+#else
+	return &convert_scalar;
+#endif
+}
+
+/**
+ * convert_get - Get the conversion kernels
+ *
+ * The fastest implementation the CPU supports is picked the first time.
+ */
+const struct convert_funcs *convert_get(void)
+{
+	if (!convert_funcs) {
+		convert_funcs = convert_select();
+		DRM_DEBUG_DRIVER("Pixel conversion: %s\n", convert_funcs->name);
+	}
+
+	return convert_funcs;
+}
+
+static const char * const convert_dither_names[] = {
+	[CONVERT_DITHER_NONE] = "none",
+	[CONVERT_DITHER_ORDERED] = "ordered",
+	[CONVERT_DITHER_FLOYD_STEINBERG] = "floyd-steinberg",
+};
+
+/**
+ * convert_dither_parse - Look up a dithering mode
+ * @name: none, ordered or floyd-steinberg
+ *
+ * Returns:
+ * The mode or -EINVAL if it's unknown.
+ */
+int convert_dither_parse(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(convert_dither_names); i++) {
+		if (!strcmp(name, convert_dither_names[i]))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+/* Use the scalar versions, for comparison */
+void convert_set_simd(bool enable)
+{
+	convert_no_simd = !enable;
+	convert_funcs = NULL;
+}
+
+/**
+ * convert_transform_init - Set up a software rotation
+ * @t: Transform
+ * @rotation: Counter clockwise rotation in degrees, same as the drivers do with
+ *            the controller's address mode
+ * @reflect_x: Mirror the framebuffer left to right
+ * @reflect_y: Mirror the framebuffer top to bottom
+ */
+void convert_transform_init(struct convert_transform *t, unsigned int rotation, bool reflect_x, bool reflect_y)
+{
+	t->swap_xy = rotation == 90 || rotation == 270;
+	t->flip_x = (rotation == 90 || rotation == 180) != reflect_x;
+	t->flip_y = (rotation == 180 || rotation == 270) != reflect_y;
+}
+
+/**
+ * convert_transform_clip - Map a framebuffer rectangle onto the panel
+ * @t: Transform
+ * @clip: Rectangle in the framebuffer, panel rectangle on return
+ * @width: Framebuffer width
+ * @height: Framebuffer height
+ */
+void convert_transform_clip(const struct convert_transform *t, struct drm_clip_rect *clip,
+			    unsigned int width, unsigned int height)
+{
+	struct drm_clip_rect in = *clip;
+
+	if (t->flip_x) {
+		clip->x1 = width - in.x2;
+		clip->x2 = width - in.x1;
+	}
+	if (t->flip_y) {
+		clip->y1 = height - in.y2;
+		clip->y2 = height - in.y1;
+	}
+	if (t->swap_xy) {
+		swap(clip->x1, clip->y1);
+		swap(clip->x2, clip->y2);
+	}
+}
+
+/**
+ * convert_transform_lines - Get panel lines from the framebuffer
+ * @t: Transform
+ * @dst: Buffer for @lines lines of @pixels pixels
+ * @src: Framebuffer
+ * @pitch: Framebuffer line length in bytes
+ * @cpp: Bytes per pixel, 2 or 4
+ * @width: Framebuffer width
+ * @height: Framebuffer height
+ * @x: Panel x of the first pixel
+ * @y: Panel y of the first line
+ * @pixels: Pixels per line
+ * @lines: Number of lines
+ *
+ * The pixels are copied as they are, in panel order.
+ */
+void convert_transform_lines(const struct convert_transform *t, void *dst, const void *src,
+			     unsigned int pitch, unsigned int cpp, unsigned int width, unsigned int height,
+			     unsigned int x, unsigned int y, unsigned int pixels, unsigned int lines)
+{
+	const struct convert_funcs *funcs = convert_get();
+	ptrdiff_t src_stride = pitch / cpp, dst_stride = pixels;
+	unsigned int fx, fy, i;
+	const void *line;
+
+	if (!t->swap_xy) {
+		fx = t->flip_x ? width - x - pixels : x;
+		for (i = 0; i < lines; i++, dst += pixels * cpp) {
+			fy = t->flip_y ? height - 1 - (y + i) : y + i;
+			line = src + fy * pitch + fx * cpp;
+			if (!t->flip_x)
+				memcpy(dst, line, pixels * cpp);
+			else if (cpp == 4)
+				funcs->reverse32(dst, line, pixels);
+			else
+				funcs->reverse16(dst, line, pixels);
+		}
+		return;
+	}
+
+	/*
+	 * The panel lines are framebuffer columns, the block starts with the
+	 * leftmost one and goes down or up the framebuffer lines. Panel lines
+	 * that are right to left in the framebuffer are written bottom up.
+	 */
+	fx = t->flip_x ? width - y - lines : y;
+	fy = t->flip_y ? height - 1 - x : x;
+	src += fy * pitch + fx * cpp;
+	if (t->flip_y)
+		src_stride = -src_stride;
+	if (t->flip_x) {
+		dst += (lines - 1) * pixels * cpp;
+		dst_stride = -dst_stride;
+	}
+
+	if (cpp == 4)
+		funcs->transpose32(dst, dst_stride, src, src_stride, lines, pixels);
+	else
+		funcs->transpose16(dst, dst_stride, src, src_stride, lines, pixels);
+}
@@ -0,0 +1,109 @@
+#ifndef _CONVERT_H
+#define _CONVERT_H
+
+#include "base.h"
+
+struct drm_clip_rect;
+
+/**
+ * struct convert_funcs - Pixel conversion kernels
+ * @name: Name of the implementation
+ * @xrgb8888_to_rgb565: Convert a line of @pixels pixels, byte swapped for
+ *                      the big endian wire if @swap is set
+ * @xrgb8888_to_rgb565_ordered: Same with ordered dithering, the line starts
+ *                              at (@x, @y) on the screen
+ * @xrgb8888_to_rgb565_fs: Same with Floyd-Steinberg dithering, @err holds 4
+ *                         values per pixel with the error the line above
+ *                         left and gets the error for the line below, zero
+ *                         it for the first line
+ * @xrgb8888_to_rgb666: Pack a line to RGB666, 3 bytes per pixel in wire order
+ * @swab16_buf: Byte swap @num 16-bit values, @dst and @src can be the same
+ * @transpose16: Transpose a block of @h lines of @w pixels,
+ *               dst[x * @dst_stride + y] = src[y * @src_stride + x], the
+ *               strides are in pixels and can be negative
+ * @transpose32: Same for 32-bit pixels
+ * @reverse16: Copy @num pixels in reverse order, the buffers can't overlap
+ * @reverse32: Same for 32-bit pixels
+ *
+ * The buffers need no particular alignment.
+ */
+struct convert_funcs {
+	const char *name;
+	void (*xrgb8888_to_rgb565)(u16 *dst, const u32 *src, size_t pixels, bool swap);
+	void (*xrgb8888_to_rgb565_ordered)(u16 *dst, const u32 *src, size_t pixels, bool swap,
+					   unsigned int x, unsigned int y);
+	void (*xrgb8888_to_rgb565_fs)(u16 *dst, const u32 *src, size_t pixels, bool swap, s16 *err);
+	void (*xrgb8888_to_rgb666)(u8 *dst, const u32 *src, size_t pixels);
+	void (*swab16_buf)(u16 *dst, const u16 *src, size_t num);
+	void (*transpose16)(u16 *dst, ptrdiff_t dst_stride, const u16 *src, ptrdiff_t src_stride,
+			    unsigned int w, unsigned int h);
+	void (*transpose32)(u32 *dst, ptrdiff_t dst_stride, const u32 *src, ptrdiff_t src_stride,
+			    unsigned int w, unsigned int h);
+	void (*reverse16)(u16 *dst, const u16 *src, size_t num);
+	void (*reverse32)(u32 *dst, const u32 *src, size_t num);
+};
+
+/* Dithering when reducing XRGB8888 to RGB565 */
+enum convert_dither {
+	CONVERT_DITHER_NONE,
+	CONVERT_DITHER_ORDERED,
+	CONVERT_DITHER_FLOYD_STEINBERG,
+};
+
+/**
+ * struct convert_transform - Where the panel pixels are in the framebuffer
+ * @swap_xy: Panel lines are framebuffer columns (rotated 90 or 270 degrees)
+ * @flip_x: Framebuffer x runs the other way
+ * @flip_y: Framebuffer y runs the other way
+ *
+ * Panel pixel (x, y) is framebuffer pixel (x, y), or (y, x) if @swap_xy is
+ * set, before flipping.
+ */
+struct convert_transform {
+	bool swap_xy;
+	bool flip_x;
+	bool flip_y;
+};
+
+const struct convert_funcs *convert_get(void);
+int convert_dither_parse(const char *name);
+void convert_set_simd(bool enable);
+void convert_transform_init(struct convert_transform *t, unsigned int rotation, bool reflect_x, bool reflect_y);
+void convert_transform_clip(const struct convert_transform *t, struct drm_clip_rect *clip,
+			    unsigned int width, unsigned int height);
+void convert_transform_lines(const struct convert_transform *t, void *dst, const void *src,
+			     unsigned int pitch, unsigned int cpp, unsigned int width, unsigned int height,
+			     unsigned int x, unsigned int y, unsigned int pixels, unsigned int lines);
+
+static inline bool convert_transform_identity(const struct convert_transform *t)
+{
+	return !t->swap_xy && !t->flip_x && !t->flip_y;
+}
+
+static inline void convert_xrgb8888_to_rgb565(u16 *dst, const u32 *src, size_t pixels, bool swap)
+{
+	convert_get()->xrgb8888_to_rgb565(dst, src, pixels, swap);
+}
+
+static inline void convert_xrgb8888_to_rgb565_ordered(u16 *dst, const u32 *src, size_t pixels, bool swap,
+						      unsigned int x, unsigned int y)
+{
+	convert_get()->xrgb8888_to_rgb565_ordered(dst, src, pixels, swap, x, y);
+}
+
+static inline void convert_xrgb8888_to_rgb565_fs(u16 *dst, const u32 *src, size_t pixels, bool swap, s16 *err)
+{
+	convert_get()->xrgb8888_to_rgb565_fs(dst, src, pixels, swap, err);
+}
+
+static inline void convert_xrgb8888_to_rgb666(u8 *dst, const u32 *src, size_t pixels)
+{
+	convert_get()->xrgb8888_to_rgb666(dst, src, pixels);
+}
+
+static inline void convert_swab16(u16 *dst, const u16 *src, size_t num)
+{
+	convert_get()->swab16_buf(dst, src, num);
+}
+
+#endif
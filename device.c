@@ -96,6 +96,45 @@ pr_info("%s: name='%s', data=%p, len=%zu\n", __func__, prop->name, prop->data, p
 	return 0;
 }
 
+/* Properties set by the driver core, the values are stored big endian like the ones from DT */
+int device_property_set_u32(struct device *dev, const char *propname, u32 val)
+{
+	u32 *data;
+	int ret;
+
+	data = malloc(sizeof(*data));
+	if (!data)
+		return -ENOMEM;
+
+	*data = htonl(val);
+	ret = device_set_property(dev, propname, data, sizeof(*data));
+	if (ret)
+		free(data);
+
+	return ret;
+}
+
+int device_property_set_bool(struct device *dev, const char *propname)
+{
+	return device_set_property(dev, propname, NULL, 0);
+}
+
+int device_property_set_string(struct device *dev, const char *propname, const char *val)
+{
+	char *data;
+	int ret;
+
+	data = strdup(val);
+	if (!data)
+		return -ENOMEM;
+
+	ret = device_set_property(dev, propname, data, strlen(data) + 1);
+	if (ret)
+		free(data);
+
+	return ret;
+}
+
 /* big endian */
 static void *device_read_property_file(const char *fname, size_t len)
 {
@@ -189,5 +228,18 @@ int device_property_read_u32_array(struct device *dev, const char *propname, u32
 
 int device_property_read_string(struct device *dev, const char *propname, const char **val)
 {
-	return -EOPNOTSUPP;
+	struct prop *prop;
+	const char *str;
+
+	prop = device_find_property(dev, propname);
+	if (!prop)
+		return -EINVAL;
+
+	str = prop->data;
+	if (!str || !prop->len || str[prop->len - 1])
+		return -EILSEQ;
+
+	*val = str;
+
+	return 0;
 }
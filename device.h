@@ -42,6 +42,9 @@ static inline void dev_set_drvdata(struct device *dev, void *data)
 struct prop *device_find_property(struct device *dev, const char *propname);
 int device_property_read_u32_array(struct device *dev, const char *propname, u32 *val, size_t nval);
 int device_property_read_string(struct device *dev, const char *propname, const char **val);
+int device_property_set_u32(struct device *dev, const char *propname, u32 val);
+int device_property_set_bool(struct device *dev, const char *propname);
+int device_property_set_string(struct device *dev, const char *propname, const char *val);
 
 static inline bool device_property_present(struct device *dev, const char *propname)
 {
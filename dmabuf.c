@@ -1,3 +1,6 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
@@ -6,14 +9,23 @@
 
 #define DMABUF_MAGIC 0xB00FB00F
 
+/* Takes ownership of @fd, it's closed by dma_buf_put() */
 struct dma_buf *dma_buf_get(int fd)
 {
 	struct dma_buf *dmabuf;
+	off_t size;
 
 	dmabuf = calloc(1, sizeof(*dmabuf));
 	if (!dmabuf)
 		return ERR_PTR(-ENOMEM);
 
+	/* dma-buf supports seeking to the end to get the size */
+	size = lseek(fd, 0, SEEK_END);
+	if (size > 0) {
+		dmabuf->size = size;
+		lseek(fd, 0, SEEK_SET);
+	}
+
 	dmabuf->fd = fd;
 	dmabuf->magic = DMABUF_MAGIC;
 
@@ -24,6 +36,7 @@ void dma_buf_put(struct dma_buf *dmabuf)
 {
 	if (dmabuf->vaddr)
 		dma_buf_vunmap(dmabuf, dmabuf->vaddr);
+	close(dmabuf->fd);
 	dmabuf->magic = 0xDEADBEEF;
 	free(dmabuf);
 }
@@ -37,11 +50,16 @@ bool dma_buf_check(void *addr)
 
 void *dma_buf_vmap(struct dma_buf *dmabuf)
 {
+	int prot = PROT_READ;
 	void *vaddr;
 
-	vaddr = mmap(NULL, dmabuf->size, PROT_READ, MAP_SHARED, dmabuf->fd, 0);
+	/* Exported framebuffers are read-only */
+	if ((fcntl(dmabuf->fd, F_GETFL) & O_ACCMODE) == O_RDWR)
+		prot |= PROT_WRITE;
+
+	vaddr = mmap(NULL, dmabuf->size, prot, MAP_SHARED, dmabuf->fd, 0);
 	if (vaddr == MAP_FAILED) {
-		pr_err("%s: Failed to mmap %d\n", -errno);
+		pr_err("%s: Failed to mmap: %s\n", __func__, strerror(errno));
 		return NULL;
 	}
 
@@ -53,12 +71,12 @@ void *dma_buf_vmap(struct dma_buf *dmabuf)
 void dma_buf_vunmap(struct dma_buf *dmabuf, void *vaddr)
 {
 	if (vaddr != dmabuf->vaddr) {
-		pr_err("%s: Failed to munmap, pointer mismatch: %p != %p\n", vaddr, dmabuf->vaddr);
+		pr_err("%s: Failed to munmap, pointer mismatch: %p != %p\n", __func__, vaddr, dmabuf->vaddr);
 		return;
 	}
 
 	if (munmap(dmabuf->vaddr, dmabuf->size) < 0)
-		pr_err("%s: Failed to munmap %d\n", -errno);
+		pr_err("%s: Failed to munmap: %s\n", __func__, strerror(errno));
 
 	dmabuf->vaddr = NULL;
 }
@@ -4,10 +4,22 @@
 #include <linux/dma-buf.h>
 #include <sys/types.h>
 
+/*
+ * A pointer to this can be passed as a buffer to regmap_raw_write() and
+ * spi_transfer() to send the contents without copying. @offset is where
+ * the transfer starts, use a copy of the structure to send part of a buffer.
+ * Map the buffer before copying it if the receiver might need @vaddr, a
+ * mapping made on the copy is never unmapped.
+ * If @line_len is set on the copy, the data is lines of @line_len bytes
+ * @pitch bytes apart, like a rectangle narrower than the framebuffer.
+ */
 struct dma_buf {
 	size_t size;
 	int fd;
 	void *vaddr;
+	size_t offset;
+	size_t line_len;
+	size_t pitch;
 	u32 magic;
 };
 
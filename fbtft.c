@@ -221,6 +221,7 @@ static const struct udrm_funcs fbtft_pipe_funcs = {
 	.enable = fbtft_enable,
 	.disable = mipi_dbi_disable,
 	.dirtyfb = mipi_dbi_dirtyfb,
+	.print_stats = mipi_dbi_print_stats,
 };
 
 int fbtft_mipi_probe(const char *name, struct fbtft_display *display, struct spi_device *spi)
@@ -251,12 +252,16 @@ udrm_debug = 0;
 	display->regwidth = fbtft_of_value(dev, "regwidth") ? : display->regwidth;
 	display->buswidth = fbtft_of_value(dev, "buswidth") ? : display->buswidth;
 	display->backlight = fbtft_of_value(dev, "backlight") ? : display->backlight;
-	//fbtft_of_value(node, "fps");
+	display->fps = fbtft_of_value(dev, "fps") ? : display->fps;
 	//fbtft_of_value(node, "txbuflen");
 
 	/* defaults */
 	if (!display->fps)
 		display->fps = 20;
+
+	/* udrm paces the flushing from the property */
+	if (!device_property_present(dev, "fps"))
+		device_property_set_u32(dev, "fps", display->fps);
 	if (!display->bpp)
 		display->bpp = 16;
 
@@ -304,7 +309,6 @@ udrm_debug = 0;
 	par->gamma.num_curves = display->gamma_num;
 	par->gamma.num_values = display->gamma_len;
 
-	/* FIXME not supported */
 	device_property_read_string(dev, "gamma", (const char **)&gamma);
 
 	if (par->gamma.curves && gamma) {
@@ -346,18 +350,25 @@ spi->max_dma_len = 65536 - 4096; // master restriction 65535
 	par->gpio.dc = dc;
 
 	mipi->enable_delay_ms = 50;
+	mipi->bus_speed_hz = spi->max_speed_hz;
 	mipi->backlight = backlight_get(dev);
 	if (IS_ERR(mipi->backlight))
 		return PTR_ERR(mipi->backlight);
 
-	mipi->reg = mipi_dbi_spi_init(spi, dc, false);
-	if (IS_ERR(mipi->reg))
-		return PTR_ERR(mipi->reg);
+	ret = mipi_dbi_spi_init(spi, mipi, dc, false);
+	if (ret)
+		return ret;
+
+	/* set_var() programs the rotation, without it the panel is rotated in software */
+	if (par->fbtftops.set_var)
+		mipi->hw_rotations = MIPI_DBI_ROTATIONS_ALL;
 
 	ret = mipi_dbi_register(dev, mipi, name, &fbtft_pipe_funcs, &fbtft_mode, info->var.rotate);
 	if (ret)
 		return ret;
 
+	info->var.rotate = mipi->rotation;
+
 	info->var.xres = fbtft_mode.hdisplay;
 	info->var.yres = fbtft_mode.vdisplay;
 	info->var.xres_virtual = info->var.xres;
@@ -381,7 +392,7 @@ int fbtft_mipi_remove(struct spi_device *spi)
 
 	fbtft_par_dbg(DEBUG_DRIVER_INIT_FUNCTIONS, par, "%s()\n", __func__);
 
-	udrm_unregister(udev);
+	mipi_dbi_unregister(mipi);
 
 	//if (mipi->dc)
 	//	gpiod_put(mipi->dc);
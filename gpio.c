@@ -1,5 +1,7 @@
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/timerfd.h>
 
 // PATH_MAX
 #include <linux/limits.h>
@@ -34,6 +36,62 @@ static int file_write_string(const char *pathname, const char *buf)
 	return 0;
 }
 
+static struct gpio_desc *gpiod_get_mock(const char *con_id, u32 hz)
+{
+	u64 period_ns = NSEC_PER_SEC / hz ? : 1;
+	struct itimerspec its = { };
+	struct gpio_desc *desc;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		printf("%s: Failed to create timer: %s\n", __func__, strerror(errno));
+		return ERR_PTR(-errno);
+	}
+
+	/* tv_nsec must stay below a second */
+	its.it_interval.tv_sec = period_ns / NSEC_PER_SEC;
+	its.it_interval.tv_nsec = period_ns % NSEC_PER_SEC;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+		printf("%s: Failed to start timer: %s\n", __func__, strerror(errno));
+		close(fd);
+		return ERR_PTR(-errno);
+	}
+
+	desc = calloc(1, sizeof(*desc));
+	if (!desc) {
+		close(fd);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	desc->fd = fd;
+	desc->name = con_id;
+	desc->mock = true;
+
+	pr_info("%s: Mock %s gpio at %uHz\n", __func__, con_id, hz);
+
+	return desc;
+}
+
+static struct gpio_desc *gpiod_get_mock_output(const char *con_id, unsigned int flags)
+{
+	struct gpio_desc *desc;
+
+	desc = calloc(1, sizeof(*desc));
+	if (!desc)
+		return ERR_PTR(-ENOMEM);
+
+	desc->fd = -1;
+	desc->name = con_id;
+	desc->mock = true;
+	desc->value = flags == GPIOD_OUT_HIGH;
+
+	pr_info("%s: Mock %s gpio\n", __func__, con_id);
+
+	return desc;
+}
+
 struct gpio_desc *gpiod_get_optional(struct device *dev, const char *con_id, unsigned int flags)
 {
 	struct gpio_desc *desc;
@@ -41,6 +99,15 @@ struct gpio_desc *gpiod_get_optional(struct device *dev, const char *con_id, uns
 	int ret, fd, gpio;
 	char buf[32];
 	u32 data[2];
+	u32 hz;
+
+	snprintf(buf, sizeof(buf), "%s-mock-hz", con_id);
+	if (flags == GPIOD_IN && !device_property_read_u32(dev, buf, &hz) && hz)
+		return gpiod_get_mock(con_id, hz);
+
+	snprintf(buf, sizeof(buf), "%s-mock", con_id);
+	if (flags != GPIOD_IN && device_property_read_bool(dev, buf))
+		return gpiod_get_mock_output(con_id, flags);
 
 	snprintf(buf, sizeof(buf), "%s-gpios", con_id);
 
@@ -60,12 +127,21 @@ struct gpio_desc *gpiod_get_optional(struct device *dev, const char *con_id, uns
 			return ERR_PTR(ret);
 
 		snprintf(fname2, sizeof(fname2), "/sys/class/gpio/gpio%d/direction", gpio);
-		ret = file_write_string(fname2, "out");
+		ret = file_write_string(fname2, flags == GPIOD_IN ? "in" : "out");
 		if (ret)
 			return ERR_PTR(ret);
 	}
 
-	fd = open(fname, O_WRONLY);
+	if (flags == GPIOD_IN) {
+		char fname2[PATH_MAX];
+
+		snprintf(fname2, sizeof(fname2), "/sys/class/gpio/gpio%d/edge", gpio);
+		ret = file_write_string(fname2, "rising");
+		if (ret)
+			return ERR_PTR(ret);
+	}
+
+	fd = open(fname, flags == GPIOD_IN ? O_RDONLY : O_WRONLY);
 	if (fd == -1) {
 		printf("%s: Failed to open '%s': %s\n", __func__, fname, strerror(errno));
 		return ERR_PTR(-errno);
@@ -90,7 +166,8 @@ struct gpio_desc *gpiod_get_optional(struct device *dev, const char *con_id, uns
 void gpiod_put(struct gpio_desc *desc)
 {
 	pr_debug("%s(%s, %d)\n", __func__, desc->name, desc->gpio);
-	close(desc->fd);
+	if (desc->fd >= 0)
+		close(desc->fd);
 	free(desc);
 }
 
@@ -100,8 +177,63 @@ void gpiod_set_value(struct gpio_desc *desc, int value)
 
 	pr_debug("%s(gpio=%d, value=%d)\n", __func__, desc->gpio, value);
 
+	desc->value = !!value;
+	if (desc->mock)
+		return;
+
 	snprintf(buf, sizeof(buf), "%d", value ? 1 : 0);
 	if (write(desc->fd, buf, strlen(buf)) == -1)
 		printf("%s(%d, %d): Failed to write gpio: %s\n",
 		       __func__, desc->gpio, value, strerror(errno));
 }
+
+/* Throw away edges that happened before now */
+static void gpiod_clear_edge(struct gpio_desc *desc)
+{
+	char buf[8];
+	u64 expirations;
+
+	if (desc->mock) {
+		if (read(desc->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+			pr_debug("%s: Failed to read timer: %s\n", __func__, strerror(errno));
+		return;
+	}
+
+	lseek(desc->fd, 0, SEEK_SET);
+	if (read(desc->fd, buf, sizeof(buf)) < 0)
+		pr_debug("%s(%d): Failed to read gpio: %s\n", __func__, desc->gpio, strerror(errno));
+}
+
+/**
+ * gpiod_wait_edge - Wait for the next rising edge
+ * @desc: Input gpio
+ * @timeout_ms: Timeout in milliseconds
+ * @timestamp_ns: Time of the edge (when it was seen)
+ *
+ * Edges that happened before the call are ignored.
+ *
+ * Returns:
+ * Zero on success, -ETIMEDOUT or negative error code on failure.
+ */
+int gpiod_wait_edge(struct gpio_desc *desc, int timeout_ms, u64 *timestamp_ns)
+{
+	struct pollfd pfd = {
+		.fd = desc->fd,
+		/* sysfs signals edges with POLLPRI */
+		.events = desc->mock ? POLLIN : POLLPRI | POLLERR,
+	};
+	int ret;
+
+	gpiod_clear_edge(desc);
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0)
+		return -errno;
+	if (!ret)
+		return -ETIMEDOUT;
+
+	*timestamp_ns = ktime_get_ns();
+	gpiod_clear_edge(desc);
+
+	return 0;
+}
@@ -7,11 +7,21 @@ struct device;
 
 #define GPIOD_OUT_LOW	0
 #define GPIOD_OUT_HIGH	1
-
+#define GPIOD_IN	2	/* rising edges can be waited on */
+
+/*
+ * @mock: The gpio is a periodic timer standing in for an input, set with the
+ *        <con_id>-mock-hz property, or an output that only keeps its value,
+ *        set with the <con_id>-mock property. Makes it possible to run edge
+ *        driven code and the bus code without the hardware.
+ * @value: Last value set on an output
+ */
 struct gpio_desc {
 	unsigned int gpio;
 	const char *name;
 	int fd;
+	bool mock;
+	int value;
 };
 
 struct gpio_desc *gpiod_get_optional(struct device *dev, const char *con_id, unsigned int flags);
@@ -30,5 +40,6 @@ static inline struct gpio_desc *gpiod_get(struct device *dev, const char *con_id
 void gpiod_put(struct gpio_desc *desc);
 
 void gpiod_set_value(struct gpio_desc *desc, int value);
+int gpiod_wait_edge(struct gpio_desc *desc, int timeout_ms, u64 *timestamp_ns);
 
 #endif
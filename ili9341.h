@@ -44,6 +44,9 @@
 #define ILI9341_IFCTRL     0xf6
 #define ILI9341_PUMPCTRL   0xf7
 
+#define ILI9341_IFCTRL_WEMODE  BIT(0)
+#define ILI9341_IFCTRL_ENDIAN  BIT(5)
+
 #define ILI9341_MADCTL_MH  BIT(2)
 #define ILI9341_MADCTL_BGR BIT(3)
 #define ILI9341_MADCTL_ML  BIT(4)
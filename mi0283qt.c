@@ -31,6 +31,33 @@
 //#include <linux/regulator/consumer.h>
 #include "spi.h"
 
+/*
+ * Have the controller take RGB565 little endian so the framebuffers can be
+ * sent as they are. The datasheet only promises it for the parallel
+ * interfaces, so fall back to swapping the bytes unless a red pixel reads
+ * back as red. Write-only panels always swap.
+ */
+static void mi0283qt_set_little_endian(struct mipi_dbi *mipi)
+{
+	struct regmap *reg = mipi->reg;
+	int ret;
+
+	mipi_dbi_write(reg, ILI9341_IFCTRL, ILI9341_IFCTRL_WEMODE, 0x00, ILI9341_IFCTRL_ENDIAN);
+	mipi->swap_bytes = false;
+
+	ret = mipi_dbi_check_byte_order(mipi);
+	if (!ret)
+		return;
+
+	if (ret == -EIO)
+		DRM_INFO("Little endian not supported, swapping bytes\n");
+	else
+		DRM_DEBUG_DRIVER("Can't check the byte order (%d), swapping bytes\n", ret);
+
+	mipi_dbi_write(reg, ILI9341_IFCTRL, ILI9341_IFCTRL_WEMODE, 0x00, 0x00);
+	mipi->swap_bytes = true;
+}
+
 static void mi0283qt_enable(struct udrm_device *udev)
 {
 	struct mipi_dbi *mipi = mipi_dbi_from_tinydrm(udev);
@@ -79,6 +106,8 @@ static void mi0283qt_enable(struct udrm_device *udev)
 
 	/* Memory Access Control */
 	mipi_dbi_write(reg, MIPI_DCS_SET_PIXEL_FORMAT, 0x55);
+	if (mipi->little_endian)
+		mi0283qt_set_little_endian(mipi);
 
 	DRM_DEBUG_KMS("Rotation=%u\n", mipi->rotation);
 	switch (mipi->rotation) {
@@ -132,6 +161,8 @@ static const struct udrm_funcs mi0283qt_pipe_funcs = {
 	.enable = mi0283qt_enable,
 	.disable = mipi_dbi_disable,
 	.dirtyfb = mipi_dbi_dirtyfb,
+	.print_stats = mipi_dbi_print_stats,
+	.idle = mipi_dbi_idle,
 };
 
 static const struct drm_mode_modeinfo mi0283qt_mode = {
@@ -205,16 +236,20 @@ udrm_debug = 0;
 	}
 
 	mipi->enable_delay_ms = 50;
+	mipi->bus_speed_hz = spi->max_speed_hz;
 	mipi->backlight = backlight_get(dev);
 	if (IS_ERR(mipi->backlight))
 		return PTR_ERR(mipi->backlight);
 
 	writeonly = device_property_read_bool(dev, "write-only");
+	mipi->little_endian = !device_property_read_bool(dev, "big-endian");
 	device_property_read_u32(dev, "rotation", &rotation);
+	/* MADCTL does all of them */
+	mipi->hw_rotations = MIPI_DBI_ROTATIONS_ALL;
 
-	mipi->reg = mipi_dbi_spi_init(spi, dc, writeonly);
-	if (IS_ERR(mipi->reg))
-		return PTR_ERR(mipi->reg);
+	ret = mipi_dbi_spi_init(spi, mipi, dc, writeonly);
+	if (ret)
+		return ret;
 
 	ret = mipi_dbi_register(dev, mipi, "mi0283qt", &mi0283qt_pipe_funcs, &mi0283qt_mode, rotation);
 	if (ret)
@@ -233,7 +268,7 @@ static int mi0283qt_remove(struct spi_device *spi)
 	struct udrm_device *udev = spi_get_drvdata(spi);
 	struct mipi_dbi *mipi = mipi_dbi_from_tinydrm(udev);
 
-	udrm_unregister(udev);
+	mipi_dbi_unregister(mipi);
 
 	//if (mipi->dc)
 	//	gpiod_put(mipi->dc);
@@ -5,11 +5,12 @@
 #include "regmap.h"
 
 #define MIPI_DBI_DEFAULT_SPI_READ_SPEED 2000000 /* 2MHz */
+#define MIPI_DBI_SPI_TX_BUF_ALIGN	64 /* cache line */
 
 struct mipi_dbi_spi {
 	struct spi_device *spi;
 	struct regmap *map;
-	unsigned int ram_reg;
+	struct regmap *map16;
 	struct gpio_desc *dc;
 	bool write_only;
 	u16 *tx_buf;
@@ -23,23 +24,17 @@ struct mipi_dbi_spi {
 
 /* MIPI DBI Type C Option 3 */
 
-static int mipi_dbi_spi3_gather_write(void *context, const void *reg,
-				      size_t reg_len, const void *val,
-				      size_t val_len)
+static int mipi_dbi_spi3_gather_write_width(void *context, const void *reg,
+					    size_t reg_len, const void *val,
+					    size_t val_len, u8 val_width)
 {
 	struct mipi_dbi_spi *mspi = context;
 	struct spi_device *spi = mspi->spi;
-	size_t val_width;
 	int ret;
 
-	if (reg_len != 1)
+	if (reg_len != 1 || (val_width == 16 && val_len % 2))
 		return -EINVAL;
 
-	/* FIXME */
-	if (1)
-		val_width = 8;
-	else
-		val_width = (*(u8 *)reg == mspi->ram_reg) ? 16 : 8;
 	TINYDRM_DEBUG_REG_WRITE(reg, reg_len, val, val_len, val_width);
 
 	gpiod_set_value(mspi->dc, 0);
@@ -55,12 +50,37 @@ static int mipi_dbi_spi3_gather_write(void *context, const void *reg,
 	return ret;
 }
 
+static int mipi_dbi_spi3_gather_write(void *context, const void *reg,
+				      size_t reg_len, const void *val,
+				      size_t val_len)
+{
+	return mipi_dbi_spi3_gather_write_width(context, reg, reg_len, val, val_len, 8);
+}
+
 static int mipi_dbi_spi3_write(void *context, const void *data, size_t count)
 {
 	return mipi_dbi_spi3_gather_write(context, data, 1,
 					  data + 1, count - 1);
 }
 
+/*
+ * The values are 16-bit words in machine order, they go out big endian:
+ * the SPI controller does that with 16 bits per word, otherwise
+ * spi_transfer() swaps them on Little Endian.
+ */
+static int mipi_dbi_spi3_gather_write16(void *context, const void *reg,
+					size_t reg_len, const void *val,
+					size_t val_len)
+{
+	return mipi_dbi_spi3_gather_write_width(context, reg, reg_len, val, val_len, 16);
+}
+
+static int mipi_dbi_spi3_write16(void *context, const void *data, size_t count)
+{
+	return mipi_dbi_spi3_gather_write16(context, data, 1,
+					    data + 1, count - 1);
+}
+
 static int mipi_dbi_spi3_read(void *context, const void *reg, size_t reg_len,
 			      void *val, size_t val_len)
 {
@@ -138,7 +158,26 @@ static const struct regmap_bus mipi_dbi_regmap_bus3 = {
 	.val_format_endian_default = REGMAP_ENDIAN_DEFAULT,
 };
 
-struct regmap *mipi_dbi_spi_init(struct spi_device *spi, struct gpio_desc *dc, bool write_only)
+/* MIPI DBI Type C Option 3, 16-bit values */
+static const struct regmap_bus mipi_dbi_regmap_bus3_16 = {
+	.write = mipi_dbi_spi3_write16,
+	.gather_write = mipi_dbi_spi3_gather_write16,
+	.read = mipi_dbi_spi3_read,
+	.reg_format_endian_default = REGMAP_ENDIAN_DEFAULT,
+	.val_format_endian_default = REGMAP_ENDIAN_DEFAULT,
+};
+
+/**
+ * mipi_dbi_spi_init - Set up the register maps for a SPI bus
+ * @spi: SPI device
+ * @mipi: &mipi_dbi structure, @reg and @reg16 are set up
+ * @dc: D/C gpio (optional)
+ * @write_only: The controller can't be read from
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int mipi_dbi_spi_init(struct spi_device *spi, struct mipi_dbi *mipi, struct gpio_desc *dc, bool write_only)
 {
 	struct regmap_config config = {
 		.reg_bits = 8,
@@ -146,28 +185,56 @@ struct regmap *mipi_dbi_spi_init(struct spi_device *spi, struct gpio_desc *dc, b
 		.cache_type = REGCACHE_NONE,
 	};
 	struct mipi_dbi_spi *mspi;
+	int ret;
+
+	/* Option 1 (9-bit) isn't supported */
+	if (!dc)
+		return -ENODEV;
 
 	mspi = calloc(1, sizeof(*mspi));
 	if (!mspi)
-		return ERR_PTR(-ENOMEM);
+		return -ENOMEM;
 
+	/* whole RGB565 and RGB666 pixels in each transfer */
 	mspi->chunk_size = spi_max_transfer_size(spi, 0);
-	mspi->ram_reg = MIPI_DCS_WRITE_MEMORY_START;
+	mspi->chunk_size -= mspi->chunk_size % 12;
 	mspi->write_only = write_only;
 	mspi->spi = spi;
 	mspi->dc = dc;
 
-//	if (regmap_get_machine_endian() == REGMAP_ENDIAN_LITTLE &&
-//	    dc && !spi_bpw_supported(spi, 16)) {
-//		mspi->tx_buf = calloc(1, mspi->chunk_size);
-//		if (!mspi->tx_buf)
-//			return ERR_PTR(-ENOMEM);
-//	}
+	/* 16-bit pixels are swapped a message at a time, aligned for the SIMD loads and stores */
+	if (regmap_get_machine_endian() == REGMAP_ENDIAN_LITTLE &&
+	    !spi_bpw_supported(spi, 16)) {
+		mspi->tx_buf = aligned_alloc(MIPI_DBI_SPI_TX_BUF_ALIGN,
+					     ALIGN(spi->max_len, MIPI_DBI_SPI_TX_BUF_ALIGN));
+		if (!mspi->tx_buf) {
+			ret = -ENOMEM;
+			goto err_free;
+		}
+	}
 
-	if (dc)
-		mspi->map = regmap_init(&mipi_dbi_regmap_bus3, mspi, &config);
-//	else
-//		mspi->map = regmap_init(&mipi_dbi_regmap_bus1, mspi, &config);
+	mspi->map = regmap_init(&mipi_dbi_regmap_bus3, mspi, &config);
+	if (IS_ERR(mspi->map)) {
+		ret = PTR_ERR(mspi->map);
+		goto err_free;
+	}
+
+	mspi->map16 = regmap_init(&mipi_dbi_regmap_bus3_16, mspi, &config);
+	if (IS_ERR(mspi->map16)) {
+		ret = PTR_ERR(mspi->map16);
+		goto err_regmap_exit;
+	}
+
+	mipi->reg = mspi->map;
+	mipi->reg16 = mspi->map16;
 
-	return mspi->map;
+	return 0;
+
+err_regmap_exit:
+	regmap_exit(mspi->map);
+err_free:
+	free(mspi->tx_buf);
+	free(mspi);
+
+	return ret;
 }
@@ -4,6 +4,6 @@
 #include "mipi-dbi.h"
 #include "spi.h"
 
-struct regmap *mipi_dbi_spi_init(struct spi_device *spi, struct gpio_desc *dc, bool write_only);
+int mipi_dbi_spi_init(struct spi_device *spi, struct mipi_dbi *mipi, struct gpio_desc *dc, bool write_only);
 
 #endif
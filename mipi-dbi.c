@@ -3,9 +3,11 @@
 #include <string.h>
 
 #include "backlight.h"
+#include "gpio.h"
 #include "mipi-dbi.h"
 #include "mipi_display.h"
 #include "regmap.h"
+#include "udrm-pipe.h"
 
 #define DCS_POWER_MODE_DISPLAY			BIT(2)
 #define DCS_POWER_MODE_DISPLAY_NORMAL_MODE	BIT(3)
@@ -20,17 +22,121 @@ static const uint32_t mipi_dbi_formats[] = {
 	DRM_FORMAT_XRGB8888,
 };
 
+/* Starting points until the command overhead has been measured */
+#define MIPI_DBI_DEFAULT_BUS_SPEED	32000000
+#define MIPI_DBI_DEFAULT_CMD_NS		20000
+#define MIPI_DBI_DEFAULT_DC_NS		5000
+
+/* Upper bound on the number of address windows per flush */
+#define MIPI_DBI_MAX_WINDOWS		32
+
+/* Preemptible flushes are sent in slices of about this duration */
+#define MIPI_DBI_PREEMPT_SLICE_NS	(2 * NSEC_PER_MSEC)
+
+/* Pixels that need converting or swapping are staged in chunks of about this size */
+#define MIPI_DBI_TX_CHUNK_SIZE		(16 * 1024)
+
+/*
+ * Windows narrower than the framebuffer are sent straight from the dma-buf,
+ * a transfer per line, when the lines are long enough that copying them
+ * costs more than an extra transfer and there are few enough for the lines
+ * to go in a single SPI message. Others are gathered into tx_buf.
+ */
+#define MIPI_DBI_DMA_LINE_MIN		512
+#define MIPI_DBI_DMA_LINES_MAX		480
+
+/* Staging buffers in the pipeline when there's more than one CPU to run it */
+#define MIPI_DBI_DEFAULT_PIPE_BUFS	2
+
+/* How long a framebuffer has to be still before it's sent as RGB666 (wire-format=auto) */
+#define MIPI_DBI_DEFAULT_IDLE_MS	500
+
+static const char * const mipi_dbi_wire_formats[] = {
+	[MIPI_DBI_WIRE_RGB565] = "rgb565",
+	[MIPI_DBI_WIRE_RGB666] = "rgb666",
+	[MIPI_DBI_WIRE_AUTO] = "auto",
+};
+
+/**
+ * mipi_dbi_cost_init - Set up the cost model
+ * @cost: Flush cost model
+ * @speed_hz: Bus speed, zero for the default
+ *
+ * The command overhead starts out as a guess and is measured while flushing.
+ */
+void mipi_dbi_cost_init(struct mipi_dbi_cost *cost, u32 speed_hz)
+{
+	if (!speed_hz)
+		speed_hz = MIPI_DBI_DEFAULT_BUS_SPEED;
+
+	cost->byte_ps = 8ULL * 1000000000000ULL / speed_hz;
+	cost->cmd_ns = MIPI_DBI_DEFAULT_CMD_NS;
+	cost->dc_ns = MIPI_DBI_DEFAULT_DC_NS;
+	cost->cpp = 2;
+}
+
+/* GET_SCANLINE returns the line being scanned, msb first */
+static int mipi_dbi_get_scanline(void *data, unsigned int *scanline)
+{
+	struct mipi_dbi *mipi = data;
+	u8 val[2];
+	int ret;
+
+	ret = regmap_raw_read(mipi->reg, MIPI_DCS_GET_SCANLINE, val, 2);
+	if (ret)
+		return ret;
+
+	*scanline = (val[0] << 8) | val[1];
+
+	return 0;
+}
+
+/* Called from the pipeline thread, nothing else touches the bus during a run */
+static int mipi_dbi_pipe_submit(void *context, unsigned int cmd, const void *buf, size_t len)
+{
+	struct mipi_dbi *mipi = context;
+
+	return regmap_raw_write(mipi->reg, cmd, buf, len);
+}
+
 int mipi_dbi_register(struct device *dev, struct mipi_dbi *mipi, const char *name, const struct udrm_funcs *funcs,
 		      struct drm_mode_modeinfo *mode, unsigned int rotation)
 {
 	struct udrm_device *udev = &mipi->udev;
 	u32 buf_mode = UDRM_BUF_MODE_EMUL_XRGB8888;
+	u32 resync_ms = 100;
+	u32 pipe_bufs = 0;
+	const char *dither, *wire_format;
+	bool reflect_x = false, reflect_y = false;
+	unsigned int i, scan_lines;
+	struct gpio_desc *te;
 	int ret;
 
 	udev->dev = dev;
 	udev->funcs = funcs;
-	/* FIXME: support 90 and 270 as well */
-	mipi->rotation = rotation;
+	mipi_dbi_cost_init(&mipi->cost, mipi->bus_speed_hz);
+
+	if (rotation % 90 || rotation >= 360) {
+		DRM_ERROR("Unsupported rotation %u\n", rotation);
+		return -EINVAL;
+	}
+
+	if (dev) {
+		reflect_x = device_property_read_bool(dev, "reflect-x");
+		reflect_y = device_property_read_bool(dev, "reflect-y");
+	}
+
+	/*
+	 * Rotations the controller can't do and mirroring are done in
+	 * software, the controller is then left unrotated.
+	 */
+	if (!rotation || (mipi->hw_rotations & MIPI_DBI_ROTATION(rotation)))
+		mipi->rotation = rotation;
+	convert_transform_init(&mipi->transform, rotation - mipi->rotation, reflect_x, reflect_y);
+	if (!convert_transform_identity(&mipi->transform))
+		DRM_DEBUG_DRIVER("Software rotation=%u, reflect-x=%d, reflect-y=%d\n",
+				 rotation - mipi->rotation, reflect_x, reflect_y);
+
 	if (rotation == 90 || rotation == 270) {
 		swap(mode->hdisplay, mode->vdisplay);
 		swap(mode->hsync_start, mode->vsync_start);
@@ -38,59 +144,656 @@ int mipi_dbi_register(struct device *dev, struct mipi_dbi *mipi, const char *nam
 		swap(mode->htotal, mode->vtotal);
 	}
 
-	// FIXME if (mipi->)
-	buf_mode |= UDRM_BUF_MODE_SWAP_BYTES;
+	/* The driver switches the controller to little endian when enabling */
+	mipi->swap_bytes = !mipi->little_endian;
+
+	te = gpiod_get_optional(dev, "te", GPIOD_IN);
+	if (IS_ERR(te)) {
+		DRM_ERROR("Failed to get gpio 'te'\n");
+		return PTR_ERR(te);
+	}
+
+	/*
+	 * The scan only follows the window lines when the controller isn't
+	 * rotated. Without a TE pin the scan position can be estimated from
+	 * the scanline the controller reports, if it supports reading.
+	 */
+	if (mipi->rotation)
+		scan_lines = 0;
+	else
+		scan_lines = mipi->transform.swap_xy ? mode->hdisplay : mode->vdisplay;
+
+	if (!te && dev && device_property_read_bool(dev, "scanline-sync")) {
+		device_property_read_u32(dev, "scanline-resync-ms", &resync_ms);
+		te_sync_init_scanline(&mipi->te, mipi_dbi_get_scanline, mipi, scan_lines, resync_ms);
+	} else {
+		te_sync_init(&mipi->te, te, scan_lines);
+	}
+
+	/* XRGB8888 framebuffers read directly can be dithered down to RGB565 */
+	if (dev && !device_property_read_string(dev, "dither", &dither)) {
+		ret = convert_dither_parse(dither);
+		if (ret < 0) {
+			DRM_ERROR("Unknown dither mode '%s'\n", dither);
+			return ret;
+		}
+		mipi->dither = ret;
+	}
+
+	/*
+	 * RGB666 needs the conversion, so it only applies to XRGB8888
+	 * framebuffers read directly. The auto policy sends them as RGB565
+	 * and again as RGB666 once they've been still for idle-ms.
+	 */
+	if (dev && !device_property_read_string(dev, "wire-format", &wire_format)) {
+		for (i = 0; i < ARRAY_SIZE(mipi_dbi_wire_formats); i++) {
+			if (!strcmp(wire_format, mipi_dbi_wire_formats[i]))
+				break;
+		}
+		if (i == ARRAY_SIZE(mipi_dbi_wire_formats)) {
+			DRM_ERROR("Unknown wire format '%s'\n", wire_format);
+			return -EINVAL;
+		}
+		mipi->wire_format = i;
+		if (mipi->wire_format == MIPI_DBI_WIRE_AUTO && !device_property_present(dev, "idle-ms"))
+			device_property_set_u32(dev, "idle-ms", MIPI_DBI_DEFAULT_IDLE_MS);
+	}
+
+	/*
+	 * Flush straight from the framebuffers instead of having the kernel
+	 * copy the damage into the shared buffer. XRGB8888 is converted while
+	 * staging the pixels for the bus.
+	 */
+	if (dev && device_property_read_bool(dev, "prime-import")) {
+		buf_mode = UDRM_BUF_MODE_NONE;
+	} else if (mipi->swap_bytes) {
+		buf_mode |= UDRM_BUF_MODE_SWAP_BYTES;
+		mipi->swapped_copy = true;
+	} else {
+		buf_mode |= UDRM_BUF_MODE_PLAIN_COPY;
+	}
+
+	/*
+	 * Convert the next chunk while the bus is busy with the last one. On a
+	 * single CPU the two would only take turns.
+	 */
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		pipe_bufs = MIPI_DBI_DEFAULT_PIPE_BUFS;
+	if (dev)
+		device_property_read_u32(dev, "pipeline-buffers", &pipe_bufs);
+	if (pipe_bufs > 1) {
+		mipi->pipe = udrm_pipe_create(pipe_bufs, mipi_dbi_pipe_submit, mipi);
+		if (IS_ERR(mipi->pipe)) {
+			ret = PTR_ERR(mipi->pipe);
+			mipi->pipe = NULL;
+			DRM_ERROR("Failed to start pipeline %d\n", ret);
+			return ret;
+		}
+	}
 
-	ret = udrm_register(udev, name, mode, mipi_dbi_formats, ARRAY_SIZE(mipi_dbi_formats), buf_mode);
+	ret = udrm_register(udev, name, mode, mipi_dbi_formats,
+			    ARRAY_SIZE(mipi_dbi_formats), buf_mode);
+	if (ret) {
+		udrm_pipe_destroy(mipi->pipe);
+		mipi->pipe = NULL;
+	}
 
 	return ret;
 }
 
-int mipi_dbi_dirtyfb(struct udrm_framebuffer *ufb, unsigned int flags, unsigned int color, struct drm_clip_rect *clips, unsigned int num_clips)
+/**
+ * mipi_dbi_unregister - Unregister and free the buffers
+ * @mipi: MIPI DBI controller
+ */
+void mipi_dbi_unregister(struct mipi_dbi *mipi)
 {
-	struct udrm_device *udev = ufb->udev;
-	struct mipi_dbi *mipi = mipi_dbi_from_tinydrm(udev);
-	struct regmap *reg = mipi->reg;
-	int ret;
+	udrm_unregister(&mipi->udev);
+	udrm_pipe_destroy(mipi->pipe);
+	mipi->pipe = NULL;
+	free(mipi->tx_buf);
+	free(mipi->rot_buf);
+	free(mipi->dither_err);
+}
 
-	if (num_clips != 1)
-		return -EINVAL;
+static size_t mipi_dbi_clip_bytes(const struct drm_clip_rect *clip, unsigned int cpp)
+{
+	return (clip->x2 - clip->x1) * (clip->y2 - clip->y1) * cpp;
+}
 
-	DRM_DEBUG("Flushing [FB:%d] x1=%u, x2=%u, y1=%u, y2=%u\n", ufb->id,
-		  clips->x1, clips->x2, clips->y1, clips->y2);
+/**
+ * mipi_dbi_window_cost - Time it takes to send an address window
+ * @cost: Flush cost model
+ * @clip: Window
+ *
+ * Returns:
+ * Estimated time in nanoseconds, the commands setting up the window included.
+ */
+u64 mipi_dbi_window_cost(const struct mipi_dbi_cost *cost, const struct drm_clip_rect *clip)
+{
+	size_t bytes = MIPI_DBI_WINDOW_CMD_BYTES + mipi_dbi_clip_bytes(clip, cost->cpp);
+
+	return MIPI_DBI_WINDOW_CMDS * cost->cmd_ns +
+	       MIPI_DBI_WINDOW_DC_TOGGLES * cost->dc_ns +
+	       bytes * cost->byte_ps / 1000;
+}
+
+/* Fold the time it took to send CASET and PASET into the command overhead */
+static void mipi_dbi_cost_update(struct mipi_dbi_cost *cost, u64 elapsed_ns)
+{
+	u64 fixed = 4 * cost->dc_ns + 10 * cost->byte_ps / 1000;
+	u64 cmd_ns = elapsed_ns > fixed ? (elapsed_ns - fixed) / 2 : 0;
+
+	cost->cmd_ns = (7 * cost->cmd_ns + cmd_ns) / 8;
+}
+
+static void mipi_dbi_clip_union(struct drm_clip_rect *dst, const struct drm_clip_rect *src)
+{
+	dst->x1 = min(dst->x1, src->x1);
+	dst->y1 = min(dst->y1, src->y1);
+	dst->x2 = max(dst->x2, src->x2);
+	dst->y2 = max(dst->y2, src->y2);
+}
+
+static int mipi_dbi_clip_cmp(const void *a, const void *b)
+{
+	const struct drm_clip_rect *ca = a, *cb = b;
+
+	return ca->y1 != cb->y1 ? ca->y1 - cb->y1 : ca->x1 - cb->x1;
+}
+
+static s64 mipi_dbi_merge_saving(const struct mipi_dbi_cost *cost,
+				  const struct drm_clip_rect *a, const struct drm_clip_rect *b)
+{
+	struct drm_clip_rect merged = *a;
+
+	mipi_dbi_clip_union(&merged, b);
+
+	return mipi_dbi_window_cost(cost, a) + mipi_dbi_window_cost(cost, b) -
+	       mipi_dbi_window_cost(cost, &merged);
+}
+
+/**
+ * mipi_dbi_merge_clips - Group clips into address windows
+ * @cost: Flush cost model
+ * @clips: Non-overlapping clips, replaced by the windows
+ * @num_clips: Number of clips
+ *
+ * A first pass over the clips sorted top to bottom merges neighbours when
+ * that's cheaper. If there are still too many windows, the neighbours that
+ * are cheapest to merge are merged. Finally the pair with the biggest saving
+ * is merged until no merge saves time.
+ *
+ * Returns:
+ * The number of windows written to @clips.
+ */
+unsigned int mipi_dbi_merge_clips(const struct mipi_dbi_cost *cost,
+				  struct drm_clip_rect *clips, unsigned int num_clips)
+{
+	unsigned int i, j, n, best_i, best_j;
+	s64 saving, best;
+
+	qsort(clips, num_clips, sizeof(*clips), mipi_dbi_clip_cmp);
+
+	for (n = 0, i = 1; i < num_clips; i++) {
+		if (mipi_dbi_merge_saving(cost, &clips[n], &clips[i]) >= 0)
+			mipi_dbi_clip_union(&clips[n], &clips[i]);
+		else
+			clips[++n] = clips[i];
+	}
+	num_clips = n + 1;
+
+	while (num_clips > MIPI_DBI_MAX_WINDOWS) {
+		best = S64_MIN;
+		best_i = 0;
+		for (i = 0; i + 1 < num_clips; i++) {
+			saving = mipi_dbi_merge_saving(cost, &clips[i], &clips[i + 1]);
+			if (saving > best) {
+				best = saving;
+				best_i = i;
+			}
+		}
+
+		mipi_dbi_clip_union(&clips[best_i], &clips[best_i + 1]);
+		num_clips--;
+		memmove(&clips[best_i + 1], &clips[best_i + 2],
+			(num_clips - best_i - 1) * sizeof(*clips));
+	}
 
+	while (num_clips > 1) {
+		best = 0;
+		best_i = best_j = 0;
+		for (i = 0; i < num_clips; i++) {
+			for (j = i + 1; j < num_clips; j++) {
+				saving = mipi_dbi_merge_saving(cost, &clips[i], &clips[j]);
+				if (saving > best) {
+					best = saving;
+					best_i = i;
+					best_j = j;
+				}
+			}
+		}
+		if (!best)
+			break;
+
+		mipi_dbi_clip_union(&clips[best_i], &clips[best_j]);
+		clips[best_j] = clips[--num_clips];
+	}
+
+	return num_clips;
+}
+
+static void *mipi_dbi_buf(void **buf, size_t *size, size_t len)
+{
+	void *new;
+
+	if (len <= *size)
+		return *buf;
+
+	new = realloc(*buf, len);
+	if (!new)
+		return NULL;
+
+	*buf = new;
+	*size = len;
+
+	return new;
+}
+
+static void mipi_dbi_set_window(struct mipi_dbi *mipi, const struct drm_clip_rect *clip)
+{
+	struct regmap *reg = mipi->reg;
+	u64 start;
+
+	start = ktime_get_ns();
 	mipi_dbi_write(reg, MIPI_DCS_SET_COLUMN_ADDRESS,
-		       (clips->x1 >> 8) & 0xFF, clips->x1 & 0xFF,
-		       (clips->x2 >> 8) & 0xFF, (clips->x2 - 1) & 0xFF);
+		       (clip->x1 >> 8) & 0xFF, clip->x1 & 0xFF,
+		       ((clip->x2 - 1) >> 8) & 0xFF, (clip->x2 - 1) & 0xFF);
 	mipi_dbi_write(reg, MIPI_DCS_SET_PAGE_ADDRESS,
-		       (clips->y1 >> 8) & 0xFF, clips->y1 & 0xFF,
-		       (clips->y2 >> 8) & 0xFF, (clips->y2 - 1) & 0xFF);
+		       (clip->y1 >> 8) & 0xFF, clip->y1 & 0xFF,
+		       ((clip->y2 - 1) >> 8) & 0xFF, (clip->y2 - 1) & 0xFF);
+	mipi_dbi_cost_update(&mipi->cost, ktime_get_ns() - start);
+}
 
+/* Zeroed error line for Floyd-Steinberg, the errors start over for each window */
+static s16 *mipi_dbi_dither_err(struct mipi_dbi *mipi, size_t pixels)
+{
+	size_t num = pixels * 4;
+	s16 *err;
 
-	if (ufb->dmabuf) {
-		DRM_ERROR("ufb->dmabuf not supported\n");
-		return -EINVAL;
-	} else if (udev->dmabuf) {
-		size_t len = (clips->x2 - clips->x1) * (clips->y2 - clips->y1) * 2;
+	if (num > mipi->dither_err_size) {
+		err = realloc(mipi->dither_err, num * sizeof(*err));
+		if (!err)
+			return NULL;
+
+		mipi->dither_err = err;
+		mipi->dither_err_size = num;
+	}
+
+	memset(mipi->dither_err, 0, num * sizeof(*mipi->dither_err));
 
-		DRM_DEBUG("BBBUFFER\n");
+	return mipi->dither_err;
+}
+
+/*
+ * Put a line starting at (@x, @y) on the wire format: RGB666 or RGB565,
+ * byte swapped if @swap is set. XRGB8888 going out as RGB565 is dithered in
+ * the same pass.
+ */
+static void mipi_dbi_tx_line(struct mipi_dbi *mipi, void *dst, const void *src, unsigned int x, unsigned int y,
+			     size_t pixels, bool xrgb8888, bool swap)
+{
+	if (mipi->cost.cpp == 3)
+		convert_xrgb8888_to_rgb666(dst, src, pixels);
+	else if (xrgb8888 && mipi->dither == CONVERT_DITHER_ORDERED)
+		convert_xrgb8888_to_rgb565_ordered(dst, src, pixels, swap, x, y);
+	else if (xrgb8888 && mipi->dither == CONVERT_DITHER_FLOYD_STEINBERG)
+		convert_xrgb8888_to_rgb565_fs(dst, src, pixels, swap, mipi->dither_err);
+	else if (xrgb8888)
+		convert_xrgb8888_to_rgb565(dst, src, pixels, swap);
+	else if (swap)
+		convert_swab16(dst, src, pixels);
+	else
+		memcpy(dst, src, pixels * 2);
+}
+
+/*
+ * Send the pixels of @clip with @cmd, the window must be set up.
+ *
+ * Pixels that can't go out as they are, are converted a chunk at a time
+ * into the staging buffer while the previous chunk is still in the cache,
+ * and each chunk continues where the last one stopped. Chunks hold whole
+ * lines so an RGB666 pixel is never split. With a pipeline the chunk is
+ * converted while the one before it is being sent, and the window is done
+ * when the last chunk has gone out.
+ *
+ * With a software transform @clip is on the panel and the lines are first
+ * gathered from the framebuffer in panel order.
+ *
+ * Full width RGB565 that only needs its bytes swapped is left in machine
+ * order and written through reg16, so the SPI controller or spi_transfer()
+ * does the swapping on the way out.
+ */
+static int mipi_dbi_write_pixels(struct mipi_dbi *mipi, struct udrm_framebuffer *ufb,
+				 const struct drm_clip_rect *clip, unsigned int cmd)
+{
+	struct dma_buf *dmabuf = udrm_fb_dma_buf(ufb);
+	unsigned int pitch = udrm_buf_pitch(ufb);
+	unsigned int cpp = udrm_buf_cpp(ufb);
+	unsigned int width = clip->x2 - clip->x1;
+	size_t line_len = width * mipi->cost.cpp;
+	size_t len = mipi_dbi_clip_bytes(clip, mipi->cost.cpp);
+	/* The kernel copy is already RGB565 and maybe swapped */
+	bool xrgb8888 = ufb->dmabuf && ufb->pixel_format == DRM_FORMAT_XRGB8888;
+	bool swap = mipi->swap_bytes && (ufb->dmabuf || !mipi->swapped_copy);
+	bool transform = !convert_transform_identity(&mipi->transform);
+	bool words = swap && !xrgb8888 && !transform && mipi->reg16 && line_len == pitch;
+	/* Transformed lines that need nothing else are gathered straight into tx_buf */
+	bool convert = xrgb8888 || swap || !transform;
+	size_t src_pitch = transform ? width * cpp : pitch;
+	struct regmap *reg = words ? mipi->reg16 : mipi->reg;
+	struct udrm_pipe *pipe = NULL;
+	unsigned int y, i, lines, chunk_lines;
+	const void *fb, *src;
+	void *dst, *tx;
+	size_t tx_len;
+	u64 start;
+	int ret = 0, err;
+
+	if (words)
+		swap = false;
+
+	/*
+	 * Send the pixels straight from the dma-buf, in one go when the
+	 * lines are contiguous in the buffer.
+	 */
+	if (!ufb->vaddr && !swap && !xrgb8888 && !transform &&
+	    (line_len == pitch ||
+	     (line_len >= MIPI_DBI_DMA_LINE_MIN && clip->y2 - clip->y1 <= MIPI_DBI_DMA_LINES_MAX))) {
+		struct dma_buf slice = *dmabuf;
+
+		/*
+		 * spi_transfer() maps the buffer to swap words the controller
+		 * can't send, do it here so the mapping isn't lost with the copy.
+		 */
+		if (words && !dmabuf->vaddr) {
+			if (!dma_buf_vmap(dmabuf))
+				return -ENOMEM;
+			slice.vaddr = dmabuf->vaddr;
+		}
 
-		ret = regmap_raw_write(reg, MIPI_DCS_WRITE_MEMORY_START, udev->dmabuf, len);
+		slice.offset = clip->y1 * pitch + clip->x1 * cpp;
+		if (line_len != pitch) {
+			slice.line_len = line_len;
+			slice.pitch = pitch;
+		}
+
+		return regmap_raw_write(reg, cmd, &slice, len);
+	}
+
+	if (ufb->vaddr) {
+		fb = ufb->vaddr;
+	} else {
+		fb = dmabuf->vaddr;
+		if (!fb)
+			fb = dma_buf_vmap(dmabuf);
+		if (!fb)
+			return -ENOMEM;
+	}
+
+	src = fb + clip->y1 * pitch + clip->x1 * cpp;
+
+	if (line_len == pitch && !swap && !xrgb8888 && !transform)
+		return regmap_raw_write(reg, cmd, src, len);
+
+	chunk_lines = max_t(unsigned int, 1, MIPI_DBI_TX_CHUNK_SIZE / line_len);
+	tx_len = min_t(size_t, chunk_lines * line_len, len);
+
+	/* A single chunk has nothing to overlap with */
+	if (mipi->pipe && tx_len < len)
+		pipe = mipi->pipe;
+
+	if (pipe ? !udrm_pipe_reserve(pipe, tx_len) :
+		   !mipi_dbi_buf(&mipi->tx_buf, &mipi->tx_buf_size, tx_len))
+		return -ENOMEM;
+
+	if (transform && convert &&
+	    !mipi_dbi_buf(&mipi->rot_buf, &mipi->rot_buf_size, chunk_lines * src_pitch))
+		return -ENOMEM;
+
+	if (xrgb8888 && mipi->cost.cpp == 2 && mipi->dither == CONVERT_DITHER_FLOYD_STEINBERG &&
+	    !mipi_dbi_dither_err(mipi, width))
+		return -ENOMEM;
+
+	if (!ufb->vaddr)
+		dma_buf_begin_cpu_access(dmabuf);
+
+	for (y = clip->y1; y < clip->y2; y += lines) {
+		lines = min(chunk_lines, clip->y2 - y);
+		tx = pipe ? udrm_pipe_get(pipe) : mipi->tx_buf;
+
+		start = udrm_latency_now();
+		if (transform) {
+			dst = convert ? mipi->rot_buf : tx;
+			convert_transform_lines(&mipi->transform, dst, fb, pitch, cpp,
+						ufb->width, ufb->height, clip->x1, y, width, lines);
+			src = dst;
+		}
+		dst = tx;
+		for (i = 0; convert && i < lines; i++, src += src_pitch, dst += line_len)
+			mipi_dbi_tx_line(mipi, dst, src, clip->x1, y + i, width, xrgb8888, swap);
+		udrm_latency_add(udrm_latency_current, UDRM_LATENCY_CONVERT, start);
+
+		if (pipe)
+			ret = udrm_pipe_push(pipe, cmd, lines * line_len);
+		else
+			ret = regmap_raw_write(reg, cmd, tx, lines * line_len);
+		if (ret)
+			break;
+
+		cmd = MIPI_DCS_WRITE_MEMORY_CONTINUE;
+	}
+
+	if (pipe) {
+		err = udrm_pipe_wait(pipe);
+		if (!ret)
+			ret = err;
+	}
+
+	if (!ufb->vaddr)
+		dma_buf_end_cpu_access(dmabuf);
+
+	return ret;
+}
+
+/*
+ * Big windows are sent in slices when the flush can be preempted, each
+ * slice continuing where the last one stopped (WRITE_MEMORY_CONTINUE). If
+ * urgent damage was flushed in between, the window is set up again for the
+ * rows that are left.
+ */
+static int mipi_dbi_flush_window(struct mipi_dbi *mipi, struct udrm_framebuffer *ufb,
+				 struct drm_clip_rect *clip)
+{
+	struct udrm_device *udev = ufb->udev;
+	unsigned int cmd = MIPI_DCS_WRITE_MEMORY_START;
+	unsigned int lines = clip->y2 - clip->y1;
+	struct drm_clip_rect slice = *clip;
+	u64 cost;
+	int ret;
+
+	DRM_DEBUG("Flushing [FB:%d] x1=%u, x2=%u, y1=%u, y2=%u\n", ufb->id,
+		  clip->x1, clip->x2, clip->y1, clip->y2);
+
+	if (udev->preemptible) {
+		cost = mipi_dbi_window_cost(&mipi->cost, clip);
+		if (cost > MIPI_DBI_PREEMPT_SLICE_NS)
+			lines = max_t(unsigned int, 1, lines * MIPI_DBI_PREEMPT_SLICE_NS / cost);
+	}
+
+	mipi_dbi_set_window(mipi, clip);
+
+	for (slice.y1 = clip->y1; slice.y1 < clip->y2; slice.y1 = slice.y2) {
+		slice.y2 = min_t(unsigned int, slice.y1 + lines, clip->y2);
+		ret = mipi_dbi_write_pixels(mipi, ufb, &slice, cmd);
 		if (ret)
 			return ret;
 
+		cmd = MIPI_DCS_WRITE_MEMORY_CONTINUE;
+		if (slice.y2 < clip->y2 && udrm_preempt(udev)) {
+			struct drm_clip_rect rest = *clip;
 
-	} else {
+			rest.y1 = slice.y2;
+			mipi_dbi_set_window(mipi, &rest);
+			cmd = MIPI_DCS_WRITE_MEMORY_START;
+			mipi->preemptions++;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Start with the first window the scan hasn't reached yet, the ones above
+ * it go last when the scan has wrapped around to the top. The windows are
+ * sorted top to bottom.
+ */
+static void mipi_dbi_windows_from_scan(struct te_sync *te, struct drm_clip_rect *windows,
+				       unsigned int num_windows)
+{
+	struct drm_clip_rect tmp[MIPI_DBI_MAX_WINDOWS];
+	int line = te_sync_scan_line(te);
+	unsigned int first;
+
+	if (line < 0 || num_windows > MIPI_DBI_MAX_WINDOWS)
+		return;
+
+	for (first = 0; first < num_windows; first++)
+		if (windows[first].y1 >= line)
+			break;
+
+	if (!first || first == num_windows)
+		return;
+
+	memcpy(tmp, windows, first * sizeof(*windows));
+	memmove(windows, windows + first, (num_windows - first) * sizeof(*windows));
+	memcpy(windows + num_windows - first, tmp, first * sizeof(*windows));
+}
+
+/* Split the window into bands that are sent behind the scan, if there's TE */
+static int mipi_dbi_flush_synced(struct mipi_dbi *mipi, struct udrm_framebuffer *ufb,
+				 struct drm_clip_rect *clip)
+{
+	struct drm_clip_rect band = *clip;
+	unsigned int lines;
+	int ret;
+
+	lines = te_sync_band_lines(&mipi->te, clip->y2 - clip->y1,
+				   mipi_dbi_window_cost(&mipi->cost, clip));
+
+	for (band.y1 = clip->y1; band.y1 < clip->y2; band.y1 = band.y2) {
+		band.y2 = min_t(unsigned int, band.y1 + lines, clip->y2);
+		te_sync_band(&mipi->te, band.y1, band.y2, mipi_dbi_window_cost(&mipi->cost, &band));
+		ret = mipi_dbi_flush_window(mipi, ufb, &band);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Pick RGB666 or RGB565 for this flush and program the controller if that
+ * changes. The driver has set up RGB565 when the policy is RGB565 only.
+ */
+static void mipi_dbi_set_wire_format(struct mipi_dbi *mipi, struct udrm_framebuffer *ufb)
+{
+	bool rgb666 = ufb->dmabuf && ufb->pixel_format == DRM_FORMAT_XRGB8888 &&
+		      (mipi->wire_format == MIPI_DBI_WIRE_RGB666 ||
+		       (mipi->wire_format == MIPI_DBI_WIRE_AUTO && mipi->idle_refresh));
+	u8 fmt = rgb666 ? MIPI_DCS_PIXEL_FMT_18BIT : MIPI_DCS_PIXEL_FMT_16BIT;
+	u8 colmod = fmt << 4 | fmt;
+
+	mipi->cost.cpp = rgb666 ? 3 : 2;
+
+	if (mipi->wire_format == MIPI_DBI_WIRE_RGB565 || mipi->colmod == colmod)
+		return;
+
+	DRM_DEBUG_DRIVER("Pixel format: %s\n", rgb666 ? "RGB666" : "RGB565");
+	mipi_dbi_write(mipi->reg, MIPI_DCS_SET_PIXEL_FORMAT, colmod);
+	mipi->colmod = colmod;
+}
+
+int mipi_dbi_dirtyfb(struct udrm_framebuffer *ufb, unsigned int flags, unsigned int color, struct drm_clip_rect *clips, unsigned int num_clips)
+{
+	struct udrm_device *udev = ufb->udev;
+	struct mipi_dbi *mipi = mipi_dbi_from_tinydrm(udev);
+	struct drm_clip_rect full = {
+		.x2 = ufb->width,
+		.y2 = ufb->height,
+	};
+	struct drm_clip_rect *windows;
+	unsigned int i, num_windows;
+	struct region damage;
+	size_t bytes = 0;
+	int ret = 0;
+
+	if (ufb->dmabuf && ufb->pixel_format != DRM_FORMAT_RGB565 &&
+	    ufb->pixel_format != DRM_FORMAT_XRGB8888) {
+		DRM_ERROR("[FB:%u] Format not supported: %.4s\n", ufb->id, (char *)&ufb->pixel_format);
+		return -EINVAL;
+	} else if (!ufb->vaddr && !udrm_fb_dma_buf(ufb)) {
 		DRM_ERROR("No buffer\n");
 		return -EINVAL;
 	}
 
+	/* Overlapping clips would send the same pixels more than once */
+	region_init(&damage);
+	if (!num_clips) {
+		ret = region_union_rect(&damage, &damage, &full);
+	} else {
+		for (i = 0; i < num_clips && !ret; i++)
+			ret = region_union_rect(&damage, &damage, &clips[i]);
+		if (!ret)
+			ret = region_intersect_rect(&damage, &damage, &full);
+	}
+	if (ret || region_empty(&damage))
+		goto out_fini;
 
+	mipi_dbi_set_wire_format(mipi, ufb);
+
+	/* The windows are built in place, the region is not used after this */
+	windows = damage.rects;
+	if (!convert_transform_identity(&mipi->transform)) {
+		for (i = 0; i < damage.num_rects; i++)
+			convert_transform_clip(&mipi->transform, &windows[i], ufb->width, ufb->height);
+	}
+	num_windows = mipi_dbi_merge_clips(&mipi->cost, windows, damage.num_rects);
 
-//	ret = tinydrm_regmap_flush_rgb565(reg, MIPI_DCS_WRITE_MEMORY_START,
-//					  fb, cma_obj->vaddr, &clip);
-//	if (ret)
-//		return ret;
+	for (i = 0; i < num_windows; i++)
+		bytes += mipi_dbi_clip_bytes(&windows[i], mipi->cost.cpp);
+
+	DRM_DEBUG("[FB:%u] clips=%u, rects=%u, windows=%u, commands=%u, bytes=%zu (bounding box %zu), cmd_ns=%llu\n",
+		  ufb->id, num_clips, damage.num_rects, num_windows, num_windows * MIPI_DBI_WINDOW_CMDS,
+		  bytes, mipi_dbi_clip_bytes(region_extents(&damage), mipi->cost.cpp),
+		  (unsigned long long)mipi->cost.cmd_ns);
+
+	if (te_sync_active(&mipi->te)) {
+		if (mipi->te.gpio && !mipi->te_on) {
+			/* V-Blanking information only */
+			mipi_dbi_write(mipi->reg, MIPI_DCS_SET_TEAR_ON, 0x00);
+			mipi->te_on = true;
+		}
+		/* top to bottom like the scan */
+		qsort(windows, num_windows, sizeof(*windows), mipi_dbi_clip_cmp);
+		te_sync_begin(&mipi->te);
+		mipi_dbi_windows_from_scan(&mipi->te, windows, num_windows);
+	}
+
+	for (i = 0; i < num_windows; i++) {
+		ret = mipi_dbi_flush_synced(mipi, ufb, &windows[i]);
+		if (ret)
+			goto out_fini;
+	}
 
 	if (!udev->enabled) {
 		if (mipi->enable_delay_ms)
@@ -98,12 +801,15 @@ int mipi_dbi_dirtyfb(struct udrm_framebuffer *ufb, unsigned int flags, unsigned
 		ret = backlight_enable(mipi->backlight);
 		if (ret) {
 			DRM_ERROR("Failed to enable backlight %d\n", ret);
-			return ret;
+			goto out_fini;
 		}
 		udev->enabled = true;
 	}
 
-	return 0;
+out_fini:
+	region_fini(&damage);
+
+	return ret;
 }
 
 void mipi_dbi_disable(struct udrm_device *udev)
@@ -119,6 +825,50 @@ void mipi_dbi_disable(struct udrm_device *udev)
 //			mipi_dbi_blank(mipi);
 	}
 	udev->enabled = false;
+	/* the controller can be reset before it's enabled again */
+	mipi->te_on = false;
+	mipi->colmod = 0;
+}
+
+/**
+ * mipi_dbi_idle - Send a still framebuffer again in 18-bit color
+ * @udev: udrm device
+ * @ufb: Framebuffer flushed last
+ *
+ * With wire-format=auto XRGB8888 goes out as RGB565 while it's changing and
+ * udrm calls this when it has been still for idle-ms.
+ */
+void mipi_dbi_idle(struct udrm_device *udev, struct udrm_framebuffer *ufb)
+{
+	struct mipi_dbi *mipi = mipi_dbi_from_tinydrm(udev);
+	int ret;
+
+	if (mipi->wire_format != MIPI_DBI_WIRE_AUTO || !udev->enabled ||
+	    !ufb->dmabuf || ufb->pixel_format != DRM_FORMAT_XRGB8888)
+		return;
+
+	mipi->idle_refresh = true;
+	ret = mipi_dbi_dirtyfb(ufb, 0, 0, NULL, 0);
+	mipi->idle_refresh = false;
+	if (ret) {
+		DRM_ERROR("[FB:%u] Failed to send as RGB666: %d\n", ufb->id, ret);
+		return;
+	}
+
+	mipi->idle_refreshes++;
+}
+
+void mipi_dbi_print_stats(struct udrm_device *udev)
+{
+	struct mipi_dbi *mipi = mipi_dbi_from_tinydrm(udev);
+
+	te_sync_print_stats(&mipi->te, udev->name);
+	if (mipi->preemptions)
+		DRM_INFO("%s: windows resumed after preemption=%lu\n", udev->name, mipi->preemptions);
+	if (mipi->idle_refreshes)
+		DRM_INFO("%s: still framebuffers sent as RGB666=%lu\n", udev->name, mipi->idle_refreshes);
+	if (mipi->pipe)
+		udrm_pipe_print_stats(mipi->pipe, udev->name);
 }
 
 void mipi_dbi_hw_reset(struct mipi_dbi *mipi)
@@ -150,6 +900,49 @@ bool mipi_dbi_display_is_on(struct regmap *reg)
 	return true;
 }
 
+/**
+ * mipi_dbi_check_byte_order - Check that the controller takes the pixel byte order
+ * @mipi: MIPI DBI structure
+ *
+ * Writes a red pixel in the top left corner the way flushes send pixels and
+ * reads it back as RGB666 after a dummy byte. With the bytes swapped red
+ * comes back as green and blue. The pixel is cleared afterwards.
+ *
+ * Returns:
+ * Zero if the pixel came back red, -EIO if it didn't or a negative error
+ * code if it can't be read back.
+ */
+int mipi_dbi_check_byte_order(struct mipi_dbi *mipi)
+{
+	struct drm_clip_rect corner = {
+		.x2 = 1,
+		.y2 = 1,
+	};
+	u16 red = mipi->swap_bytes ? swab16(0xf800) : 0xf800;
+	u16 black = 0;
+	u8 val[4];
+	int ret;
+
+	mipi_dbi_set_window(mipi, &corner);
+	ret = regmap_raw_write(mipi->reg, MIPI_DCS_WRITE_MEMORY_START, &red, 2);
+	if (ret)
+		return ret;
+
+	ret = regmap_raw_read(mipi->reg, MIPI_DCS_READ_MEMORY_START, val, 4);
+	regmap_raw_write(mipi->reg, MIPI_DCS_WRITE_MEMORY_START, &black, 2);
+	if (ret)
+		return ret;
+
+	DRM_DEBUG_DRIVER("Read back red as %02x %02x %02x\n", val[1], val[2], val[3]);
+
+	/* BGR panels keep red where blue would be */
+	if (val[2] < 0x10 && ((val[1] >= 0xf0 && val[3] < 0x10) ||
+			      (val[1] < 0x10 && val[3] >= 0xf0)))
+		return 0;
+
+	return -EIO;
+}
+
 int mipi_dbi_write_buf(struct regmap *reg, unsigned int cmd,
 		       const u8 *parameters, size_t num)
 {
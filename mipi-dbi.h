@@ -12,31 +12,129 @@
 #ifndef __MIPI_DBI_H
 #define __MIPI_DBI_H
 
+#include "convert.h"
 #include "mipi_display.h"
+#include "te.h"
 #include "udrm.h"
 
 struct udrm_framebuffer;
+struct udrm_pipe;
 struct drm_clip_rect;
 struct spi_device;
 struct gpio_desc;
 struct device;
 
+/**
+ * mipi_dbi_cost - Flush cost model
+ * @byte_ps: Time to clock out one byte in picoseconds
+ * @cmd_ns: Overhead per command, measured when setting the address window
+ * @dc_ns: Time to toggle the D/C gpio
+ * @cpp: Bytes per pixel on the wire
+ *
+ * Used to decide whether damage clips are sent as separate address windows
+ * or merged into their bounding box.
+ */
+struct mipi_dbi_cost {
+	u64 byte_ps;
+	u64 cmd_ns;
+	u64 dc_ns;
+	unsigned int cpp;
+};
+
+/*
+ * Setting up an address window takes 3 commands (CASET, PASET, RAMWR) with
+ * 11 bytes on the wire. D/C is pulled low for each command byte and high
+ * for the parameters/pixels.
+ */
+#define MIPI_DBI_WINDOW_CMDS		3
+#define MIPI_DBI_WINDOW_CMD_BYTES	11
+#define MIPI_DBI_WINDOW_DC_TOGGLES	6
+
+/**
+ * enum mipi_dbi_wire_format - Pixel format sent to the controller
+ * @MIPI_DBI_WIRE_RGB565: 16-bit
+ * @MIPI_DBI_WIRE_RGB666: 18-bit for XRGB8888 framebuffers read directly
+ * @MIPI_DBI_WIRE_AUTO: RGB565 while updating, RGB666 when still
+ */
+enum mipi_dbi_wire_format {
+	MIPI_DBI_WIRE_RGB565,
+	MIPI_DBI_WIRE_RGB666,
+	MIPI_DBI_WIRE_AUTO,
+};
+
+/* Rotation in degrees the driver can do in hardware (@hw_rotations) */
+#define MIPI_DBI_ROTATION(deg)		BIT((deg) / 90)
+#define MIPI_DBI_ROTATIONS_ALL		(MIPI_DBI_ROTATION(0) | MIPI_DBI_ROTATION(90) | \
+					 MIPI_DBI_ROTATION(180) | MIPI_DBI_ROTATION(270))
+
 /**
  * mipi_dbi - MIPI DBI controller
 
  * @reg: register map
+ * @reg16: register map sending the values as 16-bit words in machine order,
+ *         they go out big endian (optional)
  * @reset: Optional reset gpio
- * @rotation: initial rotation in degress Counter Clock Wise
+ * @rotation: initial rotation in degress Counter Clock Wise, the one the driver
+ *            sets up in the controller, zero if it's done in software
+ * @hw_rotations: Rotations the driver can set up in the controller,
+ *                MIPI_DBI_ROTATION() flags, set before registering
+ * @transform: Software rotation and reflection (reflect-x, reflect-y)
+ * @rot_buf: Panel lines staged by @transform
+ * @rot_buf_size: Size of @rot_buf
  * @backlight: backlight device (optional)
  * @enable_delay_ms: Optional delay in milliseconds before turning on backlight
+ * @bus_speed_hz: Bus speed used by the cost model (optional)
+ * @cost: Flush cost model
+ * @tx_buf: Buffer used to gather clips that don't span the framebuffer width
+ * @tx_buf_size: Size of @tx_buf
+ * @pipe: Stages the pixels in turns while the previous chunk is being sent
+ *        (pipeline-buffers, optional)
+ * @little_endian: The controller can be switched to take RGB565 little
+ *                 endian, set by the driver before registering
+ * @swap_bytes: The controller expects RGB565 big endian on the 8-bit bus,
+ *              framebuffers read directly need their bytes swapped
+ * @swapped_copy: The kernel swaps the bytes when copying the damage
+ * @dither: Dithering when sending XRGB8888 framebuffers (dither)
+ * @dither_err: Floyd-Steinberg error line
+ * @dither_err_size: Number of values in @dither_err
+ * @wire_format: Pixel format policy (wire-format)
+ * @colmod: Pixel format programmed by mipi_dbi, zero if unknown
+ * @idle_refresh: The framebuffer is being sent again because it's still
+ * @idle_refreshes: Number of framebuffers sent again as RGB666
+ * @te: Tearing effect synchronisation (te-gpios, optional)
+ * @te_on: TE output has been enabled on the controller
+ * @preemptions: Number of windows resumed after a preemption
  */
 struct mipi_dbi {
 	struct udrm_device udev;
 	struct regmap *reg;
+	struct regmap *reg16;
 	struct gpio_desc *reset;
 	unsigned int rotation;
+	unsigned int hw_rotations;
+	struct convert_transform transform;
+	void *rot_buf;
+	size_t rot_buf_size;
 	struct backlight_device *backlight;
 	unsigned int enable_delay_ms;
+	u32 bus_speed_hz;
+	struct mipi_dbi_cost cost;
+	void *tx_buf;
+	size_t tx_buf_size;
+	struct udrm_pipe *pipe;
+	bool little_endian;
+	bool swap_bytes;
+	bool swapped_copy;
+	enum convert_dither dither;
+	s16 *dither_err;
+	size_t dither_err_size;
+	enum mipi_dbi_wire_format wire_format;
+	u8 colmod;
+	bool idle_refresh;
+	unsigned long idle_refreshes;
+	struct te_sync te;
+	bool te_on;
+	unsigned long preemptions;
 };
 
 static inline struct mipi_dbi *
@@ -47,10 +145,19 @@ mipi_dbi_from_tinydrm(struct udrm_device *udev)
 
 int mipi_dbi_register(struct device *dev, struct mipi_dbi *mipi, const char *name, const struct udrm_funcs *funcs,
 		      struct drm_mode_modeinfo *mode, unsigned int rotation);
+void mipi_dbi_unregister(struct mipi_dbi *mipi);
 int mipi_dbi_dirtyfb(struct udrm_framebuffer *ufb, unsigned int flags, unsigned int color, struct drm_clip_rect *clips, unsigned int num_clips);
 void mipi_dbi_disable(struct udrm_device *udev);
+void mipi_dbi_print_stats(struct udrm_device *udev);
+void mipi_dbi_idle(struct udrm_device *udev, struct udrm_framebuffer *ufb);
 void mipi_dbi_hw_reset(struct mipi_dbi *mipi);
 bool mipi_dbi_display_is_on(struct regmap *reg);
+int mipi_dbi_check_byte_order(struct mipi_dbi *mipi);
+
+void mipi_dbi_cost_init(struct mipi_dbi_cost *cost, u32 speed_hz);
+u64 mipi_dbi_window_cost(const struct mipi_dbi_cost *cost, const struct drm_clip_rect *clip);
+unsigned int mipi_dbi_merge_clips(const struct mipi_dbi_cost *cost,
+				  struct drm_clip_rect *clips, unsigned int num_clips);
 
 /**
  * mipi_dbi_write - Write command and optional parameter(s)
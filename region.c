@@ -0,0 +1,535 @@
+// memcpy
+#include <string.h>
+
+// USHRT_MAX
+#include <limits.h>
+
+#include "region.h"
+
+enum region_op {
+	REGION_OP_UNION,
+	REGION_OP_INTERSECT,
+	REGION_OP_SUBTRACT,
+};
+
+/* Used while building the result of an operation */
+struct region_builder {
+	struct region *reg;
+	unsigned int prev_band;
+	unsigned int cur_band;
+	int err;
+};
+
+void region_init(struct region *reg)
+{
+	memset(&reg->extents, 0, sizeof(reg->extents));
+	reg->num_rects = 0;
+	reg->size = REGION_INLINE_RECTS;
+	reg->rects = reg->inline_rects;
+}
+
+void region_init_rect(struct region *reg, const struct drm_clip_rect *rect)
+{
+	region_init(reg);
+
+	if (rect->x1 >= rect->x2 || rect->y1 >= rect->y2)
+		return;
+
+	reg->rects[0] = *rect;
+	reg->num_rects = 1;
+	reg->extents = *rect;
+}
+
+void region_fini(struct region *reg)
+{
+	if (reg->rects != reg->inline_rects)
+		free(reg->rects);
+	region_init(reg);
+}
+
+void region_clear(struct region *reg)
+{
+	memset(&reg->extents, 0, sizeof(reg->extents));
+	reg->num_rects = 0;
+}
+
+static int region_reserve(struct region *reg, unsigned int size)
+{
+	struct drm_clip_rect *rects;
+
+	if (size <= reg->size)
+		return 0;
+
+	size = max(size, reg->size * 2);
+
+	if (reg->rects == reg->inline_rects) {
+		rects = malloc(size * sizeof(*rects));
+		if (!rects)
+			return -ENOMEM;
+		memcpy(rects, reg->inline_rects, reg->num_rects * sizeof(*rects));
+	} else {
+		rects = realloc(reg->rects, size * sizeof(*rects));
+		if (!rects)
+			return -ENOMEM;
+	}
+
+	reg->rects = rects;
+	reg->size = size;
+
+	return 0;
+}
+
+int region_copy(struct region *dst, const struct region *src)
+{
+	int ret;
+
+	if (dst == src)
+		return 0;
+
+	ret = region_reserve(dst, src->num_rects);
+	if (ret)
+		return ret;
+
+	memcpy(dst->rects, src->rects, src->num_rects * sizeof(*src->rects));
+	dst->num_rects = src->num_rects;
+	dst->extents = src->extents;
+
+	return 0;
+}
+
+/* Hand the rectangles of @src over to @dst, @src is left empty */
+void region_move(struct region *dst, struct region *src)
+{
+	region_fini(dst);
+
+	if (src->rects == src->inline_rects) {
+		memcpy(dst->inline_rects, src->inline_rects, src->num_rects * sizeof(*src->rects));
+	} else {
+		dst->rects = src->rects;
+		dst->size = src->size;
+	}
+	dst->num_rects = src->num_rects;
+	dst->extents = src->extents;
+
+	region_init(src);
+}
+
+static void region_update_extents(struct region *reg)
+{
+	struct drm_clip_rect *rect;
+
+	if (!reg->num_rects) {
+		memset(&reg->extents, 0, sizeof(reg->extents));
+		return;
+	}
+
+	reg->extents = reg->rects[0];
+	reg->extents.y2 = reg->rects[reg->num_rects - 1].y2;
+	region_for_each_rect(reg, rect) {
+		reg->extents.x1 = min(reg->extents.x1, rect->x1);
+		reg->extents.x2 = max(reg->extents.x2, rect->x2);
+	}
+}
+
+static bool region_spans_equal(const struct drm_clip_rect *a, const struct drm_clip_rect *b, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (a[i].x1 != b[i].x1 || a[i].x2 != b[i].x2)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Coalesce vertically adjacent bands with the same spans again after the
+ * rectangles have been changed in place.
+ */
+static void region_coalesce(struct region *reg)
+{
+	struct drm_clip_rect *rects = reg->rects;
+	unsigned int i, j, k, len, n = 0, prev = 0, prev_len = 0;
+
+	for (i = 0; i < reg->num_rects; i = j) {
+		for (j = i + 1; j < reg->num_rects && rects[j].y1 == rects[i].y1; j++)
+			;
+		len = j - i;
+
+		if (prev_len == len && rects[prev].y2 == rects[i].y1 &&
+		    region_spans_equal(&rects[prev], &rects[i], len)) {
+			for (k = 0; k < len; k++)
+				rects[prev + k].y2 = rects[i + k].y2;
+			continue;
+		}
+
+		memmove(&rects[n], &rects[i], len * sizeof(*rects));
+		prev = n;
+		prev_len = len;
+		n += len;
+	}
+
+	reg->num_rects = n;
+}
+
+/* Add a span to the current band, spans must come in x1 order */
+static void region_add_span(struct region_builder *b, unsigned int x1, unsigned int x2,
+			    unsigned int y1, unsigned int y2)
+{
+	struct region *reg = b->reg;
+	struct drm_clip_rect *rect;
+
+	if (x1 >= x2)
+		return;
+
+	if (reg->num_rects > b->cur_band) {
+		rect = &reg->rects[reg->num_rects - 1];
+		if (x1 <= rect->x2) {
+			if (x2 > rect->x2)
+				rect->x2 = x2;
+			return;
+		}
+	}
+
+	if (region_reserve(reg, reg->num_rects + 1)) {
+		b->err = -ENOMEM;
+		return;
+	}
+
+	rect = &reg->rects[reg->num_rects++];
+	rect->x1 = x1;
+	rect->y1 = y1;
+	rect->x2 = x2;
+	rect->y2 = y2;
+}
+
+static void region_band_begin(struct region_builder *b)
+{
+	b->cur_band = b->reg->num_rects;
+}
+
+/* Coalesce the band with the previous one if it continues it */
+static void region_band_end(struct region_builder *b)
+{
+	struct region *reg = b->reg;
+	unsigned int i, n = reg->num_rects - b->cur_band;
+	struct drm_clip_rect *prev, *cur;
+
+	if (!n)
+		return;
+
+	if (b->cur_band && b->cur_band - b->prev_band == n) {
+		prev = &reg->rects[b->prev_band];
+		cur = &reg->rects[b->cur_band];
+
+		if (prev->y2 == cur->y1 && region_spans_equal(prev, cur, n)) {
+			for (i = 0; i < n; i++)
+				prev[i].y2 = cur[i].y2;
+			reg->num_rects -= n;
+			return;
+		}
+	}
+
+	b->prev_band = b->cur_band;
+}
+
+static const struct drm_clip_rect *region_next_band(const struct drm_clip_rect *rect,
+						    const struct drm_clip_rect *end)
+{
+	unsigned int y1 = rect->y1;
+
+	while (rect < end && rect->y1 == y1)
+		rect++;
+
+	return rect;
+}
+
+static void region_op_spans(struct region_builder *b, enum region_op op,
+			    const struct drm_clip_rect *a, const struct drm_clip_rect *a_end,
+			    const struct drm_clip_rect *r, const struct drm_clip_rect *r_end,
+			    unsigned int y1, unsigned int y2)
+{
+	unsigned int x1;
+
+	region_band_begin(b);
+
+	switch (op) {
+	case REGION_OP_UNION:
+		while (a < a_end || r < r_end) {
+			if (r == r_end || (a < a_end && a->x1 <= r->x1)) {
+				region_add_span(b, a->x1, a->x2, y1, y2);
+				a++;
+			} else {
+				region_add_span(b, r->x1, r->x2, y1, y2);
+				r++;
+			}
+		}
+		break;
+	case REGION_OP_INTERSECT:
+		while (a < a_end && r < r_end) {
+			region_add_span(b, max(a->x1, r->x1), min(a->x2, r->x2), y1, y2);
+			if (a->x2 < r->x2)
+				a++;
+			else
+				r++;
+		}
+		break;
+	case REGION_OP_SUBTRACT:
+		if (a == a_end)
+			break;
+		x1 = a->x1;
+		while (a < a_end) {
+			if (r == r_end || r->x1 >= a->x2) {
+				region_add_span(b, x1, a->x2, y1, y2);
+				if (++a < a_end)
+					x1 = a->x1;
+			} else if (r->x2 <= x1) {
+				r++;
+			} else {
+				region_add_span(b, x1, r->x1, y1, y2);
+				x1 = r->x2;
+				if (x1 >= a->x2) {
+					if (++a < a_end)
+						x1 = a->x1;
+				} else {
+					r++;
+				}
+			}
+		}
+		break;
+	}
+
+	region_band_end(b);
+}
+
+/*
+ * Walk the bands of both regions top to bottom. Each vertical interval
+ * where the set of overlapping bands doesn't change is combined span wise.
+ */
+static int region_op(struct region *dst, const struct region *a, const struct region *b,
+		     enum region_op op)
+{
+	const struct drm_clip_rect *ra = a->rects, *ra_end = ra + a->num_rects;
+	const struct drm_clip_rect *rb = b->rects, *rb_end = rb + b->num_rects;
+	const struct drm_clip_rect *ra_band, *rb_band;
+	unsigned int y = 0, top, bot, a_top, b_top;
+	struct region_builder builder = { 0 };
+	struct region tmp;
+
+	region_init(&tmp);
+	builder.reg = &tmp;
+
+	while (ra < ra_end || rb < rb_end) {
+		ra_band = ra < ra_end ? region_next_band(ra, ra_end) : ra;
+		rb_band = rb < rb_end ? region_next_band(rb, rb_end) : rb;
+		a_top = ra < ra_end ? max_t(unsigned int, ra->y1, y) : UINT_MAX;
+		b_top = rb < rb_end ? max_t(unsigned int, rb->y1, y) : UINT_MAX;
+		top = min(a_top, b_top);
+
+		if (a_top == top && b_top == top) {
+			bot = min_t(unsigned int, ra->y2, rb->y2);
+			region_op_spans(&builder, op, ra, ra_band, rb, rb_band, top, bot);
+		} else if (a_top == top) {
+			bot = min_t(unsigned int, ra->y2, b_top);
+			region_op_spans(&builder, op, ra, ra_band, rb, rb, top, bot);
+		} else {
+			bot = min_t(unsigned int, rb->y2, a_top);
+			region_op_spans(&builder, op, ra, ra, rb, rb_band, top, bot);
+		}
+
+		y = bot;
+		if (ra < ra_end && ra->y2 <= y)
+			ra = ra_band;
+		if (rb < rb_end && rb->y2 <= y)
+			rb = rb_band;
+	}
+
+	if (builder.err) {
+		region_fini(&tmp);
+		return builder.err;
+	}
+
+	region_update_extents(&tmp);
+	region_move(dst, &tmp);
+
+	return 0;
+}
+
+static bool region_extents_overlap(const struct region *a, const struct region *b)
+{
+	return a->extents.x1 < b->extents.x2 && b->extents.x1 < a->extents.x2 &&
+	       a->extents.y1 < b->extents.y2 && b->extents.y1 < a->extents.y2;
+}
+
+/**
+ * region_union - Union of two regions
+ * @dst: Result, can be one of the sources
+ * @a: Region
+ * @b: Region
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int region_union(struct region *dst, const struct region *a, const struct region *b)
+{
+	if (region_empty(b))
+		return region_copy(dst, a);
+	if (region_empty(a))
+		return region_copy(dst, b);
+
+	return region_op(dst, a, b, REGION_OP_UNION);
+}
+
+/**
+ * region_intersect - Intersection of two regions
+ * @dst: Result, can be one of the sources
+ * @a: Region
+ * @b: Region
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int region_intersect(struct region *dst, const struct region *a, const struct region *b)
+{
+	if (region_empty(a) || region_empty(b) || !region_extents_overlap(a, b)) {
+		region_clear(dst);
+		return 0;
+	}
+
+	return region_op(dst, a, b, REGION_OP_INTERSECT);
+}
+
+/**
+ * region_subtract - Subtract one region from another
+ * @dst: Result, can be one of the sources
+ * @a: Region to subtract from
+ * @b: Region to subtract
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int region_subtract(struct region *dst, const struct region *a, const struct region *b)
+{
+	if (region_empty(a) || region_empty(b) || !region_extents_overlap(a, b))
+		return region_copy(dst, a);
+
+	return region_op(dst, a, b, REGION_OP_SUBTRACT);
+}
+
+int region_union_rect(struct region *dst, const struct region *src, const struct drm_clip_rect *rect)
+{
+	struct region tmp;
+
+	region_init_rect(&tmp, rect);
+
+	return region_union(dst, src, &tmp);
+}
+
+int region_intersect_rect(struct region *dst, const struct region *src, const struct drm_clip_rect *rect)
+{
+	struct region tmp;
+
+	region_init_rect(&tmp, rect);
+
+	return region_intersect(dst, src, &tmp);
+}
+
+/**
+ * region_translate - Move region
+ * @reg: Region
+ * @dx: Horizontal offset
+ * @dy: Vertical offset
+ *
+ * Coordinates are clamped to the range of &drm_clip_rect, rectangles that
+ * end up empty are removed. Bands that end up with the same spans are
+ * coalesced.
+ */
+void region_translate(struct region *reg, int dx, int dy)
+{
+	struct drm_clip_rect *rect;
+	unsigned int n = 0;
+
+	region_for_each_rect(reg, rect) {
+		struct drm_clip_rect *out = &reg->rects[n];
+
+		out->x1 = clamp_t(int, rect->x1 + dx, 0, USHRT_MAX);
+		out->y1 = clamp_t(int, rect->y1 + dy, 0, USHRT_MAX);
+		out->x2 = clamp_t(int, rect->x2 + dx, 0, USHRT_MAX);
+		out->y2 = clamp_t(int, rect->y2 + dy, 0, USHRT_MAX);
+		if (out->x1 < out->x2 && out->y1 < out->y2)
+			n++;
+	}
+
+	reg->num_rects = n;
+	region_coalesce(reg);
+	region_update_extents(reg);
+}
+
+/**
+ * region_simplify - Reduce the number of rectangles
+ * @reg: Region
+ * @max_rects: Maximum number of rectangles
+ *
+ * Grows the region until it has at most @max_rects rectangles. First each
+ * band is replaced by its bounding box, then neighbouring bands are merged,
+ * picking the ones that add the least area. Bands left with the same span
+ * are coalesced so the result stays in canonical banded form.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int region_simplify(struct region *reg, unsigned int max_rects)
+{
+	struct drm_clip_rect *rects = reg->rects;
+	unsigned int i, n, best_i, added, best;
+
+	if (!max_rects)
+		return -EINVAL;
+
+	if (reg->num_rects <= max_rects)
+		return 0;
+
+	for (n = 0, i = 0; i < reg->num_rects; i++) {
+		if (n && rects[n - 1].y1 == rects[i].y1)
+			rects[n - 1].x2 = rects[i].x2;
+		else
+			rects[n++] = rects[i];
+	}
+
+	reg->num_rects = n;
+	region_coalesce(reg);
+	n = reg->num_rects;
+
+	while (n > max_rects) {
+		best = UINT_MAX;
+		best_i = 0;
+		for (i = 0; i + 1 < n; i++) {
+			struct drm_clip_rect merged = {
+				.x1 = min(rects[i].x1, rects[i + 1].x1),
+				.y1 = rects[i].y1,
+				.x2 = max(rects[i].x2, rects[i + 1].x2),
+				.y2 = rects[i + 1].y2,
+			};
+
+			added = region_area(&merged) - region_area(&rects[i]) -
+				region_area(&rects[i + 1]);
+			if (added < best) {
+				best = added;
+				best_i = i;
+			}
+		}
+
+		rects[best_i].x1 = min(rects[best_i].x1, rects[best_i + 1].x1);
+		rects[best_i].x2 = max(rects[best_i].x2, rects[best_i + 1].x2);
+		rects[best_i].y2 = rects[best_i + 1].y2;
+		n--;
+		memmove(&rects[best_i + 1], &rects[best_i + 2], (n - best_i - 1) * sizeof(*rects));
+	}
+
+	reg->num_rects = n;
+	region_coalesce(reg);
+	region_update_extents(reg);
+
+	return 0;
+}
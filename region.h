@@ -0,0 +1,67 @@
+#ifndef _REGION_H
+#define _REGION_H
+
+// drm_clip_rect
+#include <drm/drm.h>
+
+#include "base.h"
+
+/* Regions with up to this many rectangles don't allocate memory */
+#define REGION_INLINE_RECTS	16
+
+/**
+ * struct region - Set of pixels described by non-overlapping rectangles
+ * @extents: Bounding box
+ * @num_rects: Number of rectangles
+ * @size: Capacity of @rects
+ * @rects: Rectangles, points to @inline_rects or allocated memory
+ * @inline_rects: Storage for small regions
+ *
+ * The rectangles are kept in y-x banded order like pixman and X11 regions:
+ * sorted into horizontal bands where all rectangles share y1 and y2, bands
+ * don't overlap and rectangles within a band are sorted by x and don't touch.
+ * Vertically adjacent bands with the same spans are coalesced.
+ */
+struct region {
+	struct drm_clip_rect extents;
+	unsigned int num_rects;
+	unsigned int size;
+	struct drm_clip_rect *rects;
+	struct drm_clip_rect inline_rects[REGION_INLINE_RECTS];
+};
+
+void region_init(struct region *reg);
+void region_init_rect(struct region *reg, const struct drm_clip_rect *rect);
+void region_fini(struct region *reg);
+void region_clear(struct region *reg);
+int region_copy(struct region *dst, const struct region *src);
+void region_move(struct region *dst, struct region *src);
+
+int region_union(struct region *dst, const struct region *a, const struct region *b);
+int region_intersect(struct region *dst, const struct region *a, const struct region *b);
+int region_subtract(struct region *dst, const struct region *a, const struct region *b);
+int region_union_rect(struct region *dst, const struct region *src, const struct drm_clip_rect *rect);
+int region_intersect_rect(struct region *dst, const struct region *src, const struct drm_clip_rect *rect);
+
+void region_translate(struct region *reg, int dx, int dy);
+int region_simplify(struct region *reg, unsigned int max_rects);
+
+static inline bool region_empty(const struct region *reg)
+{
+	return !reg->num_rects;
+}
+
+static inline const struct drm_clip_rect *region_extents(const struct region *reg)
+{
+	return &reg->extents;
+}
+
+static inline unsigned int region_area(const struct drm_clip_rect *rect)
+{
+	return (rect->x2 - rect->x1) * (rect->y2 - rect->y1);
+}
+
+#define region_for_each_rect(reg, rect) \
+	for ((rect) = (reg)->rects; (rect) < (reg)->rects + (reg)->num_rects; (rect)++)
+
+#endif
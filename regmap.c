@@ -539,3 +539,9 @@ struct regmap *regmap_init(const struct regmap_bus *bus, void *bus_context, cons
 
 	return __regmap_init(NULL, bus, bus_context, config);
 }
+
+void regmap_exit(struct regmap *map)
+{
+	free(map->work_buf);
+	free(map);
+}
@@ -223,6 +223,7 @@ int regmap_raw_write(struct regmap *map, unsigned int reg, const void *val, size
 int regmap_raw_read(struct regmap *map, unsigned int reg, void *val, size_t val_len);
 
 struct regmap *regmap_init(const struct regmap_bus *bus, void *bus_context, const struct regmap_config *config);
+void regmap_exit(struct regmap *map);
 
 static inline enum regmap_endian regmap_get_machine_endian(void)
 {
@@ -0,0 +1,271 @@
+// memcpy
+#include <string.h>
+// clock_nanosleep
+#include <time.h>
+
+#include "gpio.h"
+#include "mipi_display.h"
+#include "regmap.h"
+#include "spi-mock.h"
+
+/**
+ * spi_mock_create - Put a mock bus under a SPI device
+ * @spi: SPI device, spi_sync() goes to the mock from now on
+ * @dc: D/C gpio
+ * @width: Panel width
+ * @height: Panel height
+ *
+ * The limits are the ones spi_add_device() defaults to, unless already set.
+ *
+ * Returns:
+ * Mock on success, error pointer on failure.
+ */
+struct spi_mock *spi_mock_create(struct spi_device *spi, struct gpio_desc *dc,
+				 unsigned int width, unsigned int height)
+{
+	struct spi_mock *mock;
+
+	mock = calloc(1, sizeof(*mock));
+	if (!mock)
+		return ERR_PTR(-ENOMEM);
+
+	mock->mem = calloc((size_t)width * height, SPI_MOCK_MAX_CPP);
+	if (!mock->mem) {
+		free(mock);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	mock->dc = dc;
+	mock->width = width;
+	mock->height = height;
+	mock->cpp = 2;
+
+	spi->fd = -1;
+	spi->mock = mock;
+	if (!spi->max_len)
+		spi->max_len = 4096;
+	if (!spi->max_dma_len)
+		spi->max_dma_len = spi->max_len;
+	if (!spi->bits_per_word_mask)
+		spi->bits_per_word_mask = SPI_BPW_MASK(8);
+
+	return mock;
+}
+
+void spi_mock_destroy(struct spi_mock *mock)
+{
+	if (!mock)
+		return;
+
+	free(mock->buf);
+	free(mock->mem);
+	free(mock);
+}
+
+/* Blank the panel memory and start a new run for the stats */
+void spi_mock_clear(struct spi_mock *mock)
+{
+	memset(mock->mem, 0, (size_t)mock->width * mock->height * SPI_MOCK_MAX_CPP);
+	mock->overruns = 0;
+	mock->messages = 0;
+	mock->transfers = 0;
+	mock->dma_transfers = 0;
+	mock->words16 = 0;
+	mock->bytes = 0;
+	mock->bus_ns = 0;
+	mock->gap_ns = 0;
+	mock->last_ns = 0;
+}
+
+static void spi_mock_command(struct spi_mock *mock, u8 cmd)
+{
+	mock->cmd = cmd;
+	mock->num_params = 0;
+	mock->num_pixel = 0;
+
+	if (cmd == MIPI_DCS_WRITE_MEMORY_START) {
+		mock->x = mock->x1;
+		mock->y = mock->y1;
+	}
+}
+
+static void spi_mock_param(struct spi_mock *mock, u8 val)
+{
+	u8 *p = mock->params;
+
+	if (mock->num_params == sizeof(mock->params))
+		return;
+
+	p[mock->num_params++] = val;
+
+	switch (mock->cmd) {
+	case MIPI_DCS_SET_COLUMN_ADDRESS:
+		if (mock->num_params == 4) {
+			mock->x1 = p[0] << 8 | p[1];
+			mock->x2 = p[2] << 8 | p[3];
+		}
+		break;
+	case MIPI_DCS_SET_PAGE_ADDRESS:
+		if (mock->num_params == 4) {
+			mock->y1 = p[0] << 8 | p[1];
+			mock->y2 = p[2] << 8 | p[3];
+		}
+		break;
+	case MIPI_DCS_SET_PIXEL_FORMAT:
+		/* DBI format in the low nibble */
+		mock->cpp = (val & 0x7) == MIPI_DCS_PIXEL_FMT_18BIT ? 3 : 2;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Store the byte, the window wraps to the next page at the last column */
+static void spi_mock_pixel_byte(struct spi_mock *mock, u8 val)
+{
+	if (mock->x > mock->x2 || mock->y > mock->y2 ||
+	    mock->x >= mock->width || mock->y >= mock->height) {
+		if (!mock->num_pixel)
+			mock->overruns++;
+	} else {
+		spi_mock_pixel(mock, mock->x, mock->y)[mock->num_pixel] = val;
+	}
+
+	if (++mock->num_pixel < mock->cpp)
+		return;
+
+	mock->num_pixel = 0;
+	if (++mock->x > mock->x2) {
+		mock->x = mock->x1;
+		mock->y++;
+	}
+}
+
+static void spi_mock_data(struct spi_mock *mock, const u8 *buf, size_t len, bool dc)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (!dc)
+			spi_mock_command(mock, buf[i]);
+		else if (mock->cmd == MIPI_DCS_WRITE_MEMORY_START ||
+			 mock->cmd == MIPI_DCS_WRITE_MEMORY_CONTINUE)
+			spi_mock_pixel_byte(mock, buf[i]);
+		else
+			spi_mock_param(mock, buf[i]);
+	}
+}
+
+static u8 *spi_mock_buf(struct spi_mock *mock, size_t len)
+{
+	void *new;
+
+	if (len > mock->buf_size) {
+		new = realloc(mock->buf, len);
+		if (!new)
+			return NULL;
+		mock->buf = new;
+		mock->buf_size = len;
+	}
+
+	return mock->buf;
+}
+
+/*
+ * What a transfer puts on the wire: memory or a dma-buf, with the bytes of
+ * each word swapped when a 16-bit word goes out MSB first from a Little
+ * Endian machine.
+ */
+static const u8 *spi_mock_tx(struct spi_mock *mock, const struct spi_ioc_transfer *tr)
+{
+	bool swap = tr->bits_per_word == 16 && regmap_get_machine_endian() == REGMAP_ENDIAN_LITTLE;
+	const u8 *tx = (const u8 *)(unsigned long)tr->tx_buf;
+	u8 *buf;
+	size_t i;
+
+	if (tx && !swap)
+		return tx;
+
+	buf = spi_mock_buf(mock, tr->len);
+	if (!buf)
+		return NULL;
+
+	if (tx) {
+		memcpy(buf, tx, tr->len);
+	} else if (pread(tr->tx_dma_fd, buf, tr->len, tr->dma_offset) != tr->len) {
+		pr_err("%s: Failed to read dma-buf: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	for (i = 0; swap && i + 1 < tr->len; i += 2)
+		swap(buf[i], buf[i + 1]);
+
+	return buf;
+}
+
+/* Hold the caller for the time the bytes take on the bus */
+static void spi_mock_bus_wait(struct spi_mock *mock, u64 start_ns, size_t len)
+{
+	struct timespec ts;
+	u64 end_ns;
+
+	if (!mock->speed_hz)
+		return;
+
+	end_ns = start_ns + (u64)len * 8 * NSEC_PER_SEC / mock->speed_hz;
+	mock->bus_ns += end_ns - start_ns;
+
+	ts.tv_sec = end_ns / NSEC_PER_SEC;
+	ts.tv_nsec = end_ns % NSEC_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/**
+ * spi_mock_sync - Send a SPI message to the mock
+ * @mock: SPI mock
+ * @msg: Transfers
+ * @num_msgs: Number of transfers
+ *
+ * Reads return zeros. With @mock->speed_hz set the call returns when the
+ * message would be done on the bus.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int spi_mock_sync(struct spi_mock *mock, struct spi_ioc_transfer *msg, unsigned int num_msgs)
+{
+	bool dc = mock->dc ? mock->dc->value : true;
+	u64 now = ktime_get_ns();
+	size_t len = 0;
+	const u8 *tx;
+	unsigned int i;
+
+	if (mock->last_ns)
+		mock->gap_ns += now - mock->last_ns;
+	mock->messages++;
+
+	for (i = 0; i < num_msgs; i++) {
+		len += msg[i].len;
+		if (msg[i].rx_buf)
+			memset((void *)(unsigned long)msg[i].rx_buf, 0, msg[i].len);
+		if (!msg[i].tx_buf && !msg[i].tx_dma_fd)
+			continue;
+
+		tx = spi_mock_tx(mock, &msg[i]);
+		if (!tx)
+			return -EIO;
+
+		spi_mock_data(mock, tx, msg[i].len, dc);
+
+		mock->transfers++;
+		mock->dma_transfers += !msg[i].tx_buf;
+		mock->words16 += msg[i].bits_per_word == 16;
+	}
+
+	mock->bytes += len;
+	spi_mock_bus_wait(mock, now, len);
+	mock->last_ns = ktime_get_ns();
+
+	return 0;
+}
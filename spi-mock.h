@@ -0,0 +1,88 @@
+#ifndef _SPI_MOCK_H
+#define _SPI_MOCK_H
+
+#include "spi.h"
+
+struct gpio_desc;
+
+/* Room for an RGB666 pixel */
+#define SPI_MOCK_MAX_CPP	3
+
+/**
+ * struct spi_mock - Userspace stand-in for spidev with a MIPI DBI controller
+ * @dc: D/C gpio, sampled at the start of each message: low for commands
+ * @speed_hz: Bus speed, messages take the time they would on the wire.
+ *            Zero to return straight away.
+ * @width: Panel width
+ * @height: Panel height
+ * @mem: Panel memory, @width * @height pixels of SPI_MOCK_MAX_CPP bytes as
+ *       they came over the wire
+ * @cpp: Bytes per pixel, set with SET_PIXEL_FORMAT
+ * @cmd: Command being received
+ * @params: Parameters of @cmd received so far
+ * @num_params: Number of @params
+ * @x1: Address window, first column
+ * @x2: Address window, last column
+ * @y1: Address window, first page
+ * @y2: Address window, last page
+ * @x: Column of the next pixel
+ * @y: Page of the next pixel
+ * @num_pixel: Bytes of the pixel being received
+ * @buf: Transfers read from a dma-buf or sent as 16-bit words are copied here
+ * @buf_size: Size of @buf
+ * @overruns: Pixels written past the address window or the panel
+ * @messages: Messages received, each one a SPI_IOC_MESSAGE ioctl on spidev
+ * @transfers: Transfers received
+ * @dma_transfers: Transfers sent from a dma-buf
+ * @words16: Transfers sent with 16 bits per word
+ * @bytes: Bytes received
+ * @bus_ns: Time the bus was busy at @speed_hz
+ * @gap_ns: Time spent outside the mock between messages, the time a real
+ *          bus would sit idle while userspace prepares the next ioctl
+ * @last_ns: When the last message was done, zero at the start of a run
+ *
+ * Plays the spidev ioctl and the controller on the other end of the bus:
+ * CASET, PASET, RAMWR, RAMWRC and SET_PIXEL_FORMAT are decoded and the
+ * pixels are stored the way they arrive. Transfers with 16 bits per word go
+ * out MSB first like on a real bus. This makes it possible to check what
+ * the driver puts on the wire without the hardware.
+ */
+struct spi_mock {
+	struct gpio_desc *dc;
+	u32 speed_hz;
+	unsigned int width;
+	unsigned int height;
+	u8 *mem;
+	unsigned int cpp;
+	u8 cmd;
+	u8 params[4];
+	unsigned int num_params;
+	unsigned int x1, x2, y1, y2;
+	unsigned int x, y;
+	unsigned int num_pixel;
+	u8 *buf;
+	size_t buf_size;
+	unsigned long overruns;
+
+	unsigned long messages;
+	unsigned long transfers;
+	unsigned long dma_transfers;
+	unsigned long words16;
+	u64 bytes;
+	u64 bus_ns;
+	u64 gap_ns;
+	u64 last_ns;
+};
+
+struct spi_mock *spi_mock_create(struct spi_device *spi, struct gpio_desc *dc,
+				 unsigned int width, unsigned int height);
+void spi_mock_destroy(struct spi_mock *mock);
+void spi_mock_clear(struct spi_mock *mock);
+int spi_mock_sync(struct spi_mock *mock, struct spi_ioc_transfer *msg, unsigned int num_msgs);
+
+static inline u8 *spi_mock_pixel(struct spi_mock *mock, unsigned int x, unsigned int y)
+{
+	return mock->mem + ((size_t)y * mock->width + x) * SPI_MOCK_MAX_CPP;
+}
+
+#endif
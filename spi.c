@@ -9,10 +9,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <poll.h>
 
+#include "convert.h"
 #include "udrm.h"
 #include "spi.h"
+#include "spi-mock.h"
 #include "regmap.h"
 
 int spi_register_driver(struct spi_driver *sdrv)
@@ -102,35 +105,15 @@ out:
 	return device;
 }
 
-int module_spi_driver_main(int argc, char const *argv[], struct spi_driver *sdrv)
+static struct spi_device *spi_driver_add_device(struct spi_driver *sdrv, const char *device, bool shared)
 {
-	struct udrm_device *udev;
 	struct spi_device *spi;
-	const char *device;
 	int ret;
 
-	if (argc > 2) {
-		pr_err("Too many arguments\n");
-		exit(1);
-	}
-
-	if (argc == 1) {
-		ret = spi_register_driver(sdrv);
-
-		printf("SPI driver registered\n");
-		device = spi_driver_event_loop(sdrv);
-		if (IS_ERR(device)) {
-			pr_err("Error initiating device %d\n", PTR_ERR(device));
-			exit(1);
-		}
-	} else {
-		device = argv[1];
-	}
-
 	spi = spi_alloc_device(device);
 	if (IS_ERR(spi)) {
 		pr_err("Failed to allocate spidev '%s'\n", device);
-		exit(1);
+		return spi;
 	}
 
 	pr_info("bus=%u, cs=%u, fname=%s\n", spi->bus_num, spi->chip_select, spi->fname);
@@ -138,20 +121,40 @@ int module_spi_driver_main(int argc, char const *argv[], struct spi_driver *sdrv
 	ret = spi_add_device(spi);
 	if (ret) {
 		pr_err("spi add error %d\n", ret);
-		return 1;
+		free(spi);
+		return ERR_PTR(ret);
 	}
 
-	DRM_INFO("spi: max_len=%u, max_dma_len=%u\n", spi->max_len, spi->max_dma_len);
+	DRM_INFO("spi: max_len=%zu, max_dma_len=%zu\n", spi->max_len, spi->max_dma_len);
+
+	/* Flush from a worker per bus so a slow panel can't hold up the others */
+	if (shared) {
+		if (!device_property_present(&spi->dev, "async-flush"))
+			device_property_set_bool(&spi->dev, "async-flush");
+		if (!device_property_present(&spi->dev, "flush-group"))
+			device_property_set_u32(&spi->dev, "flush-group", spi->bus_num);
+	}
 
 	ret = sdrv->probe(spi);
 	if (ret) {
 		pr_err("probe error %d\n", ret);
-		return 1;
+		spi_unregister_device(spi);
+		free(spi);
+		return ERR_PTR(ret);
 	}
 
-	udev = spi_get_drvdata(spi);
+	return spi;
+}
 
-	udrm_event_loop(udev);
+static void spi_print_stats(struct spi_device *spi)
+{
+	DRM_INFO("spi: messages=%lu, transfers=%lu, transfers/message=%lu\n",
+		 spi->messages, spi->transfers, spi->transfers / max(spi->messages, 1UL));
+}
+
+static void spi_driver_remove_device(struct spi_driver *sdrv, struct spi_device *spi)
+{
+	struct udrm_device *udev = spi_get_drvdata(spi);
 
 	/* close this first to signal that we're going away */
 	close(udev->fd);
@@ -160,6 +163,248 @@ int module_spi_driver_main(int argc, char const *argv[], struct spi_driver *sdrv
 
 	spi_unregister_device(spi);
 	free(spi);
+}
+
+#define SPI_DAEMON_MAX_DEVICES	16
+#define SPI_DAEMON_MAX_EVENTS	8
+
+struct spi_daemon {
+	int epfd;
+	struct spi_device *spis[SPI_DAEMON_MAX_DEVICES];
+	unsigned int num_spis;
+	unsigned long wakeups;
+	unsigned long dispatches;
+};
+
+static void spi_daemon_print_stats(struct spi_daemon *daemon)
+{
+	unsigned int i;
+
+	for (i = 0; i < daemon->num_spis; i++) {
+		udrm_print_stats(spi_get_drvdata(daemon->spis[i]));
+		spi_print_stats(daemon->spis[i]);
+	}
+
+	/* One process per device would have woken up once per dispatch */
+	DRM_INFO("daemon: devices=%u, wakeups=%lu, dispatches=%lu, wakeups saved=%lu\n",
+		 daemon->num_spis, daemon->wakeups, daemon->dispatches,
+		 daemon->dispatches - min(daemon->wakeups, daemon->dispatches));
+}
+
+static void spi_daemon_add(struct spi_daemon *daemon, struct spi_driver *sdrv, const char *device)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+	struct udrm_device *udev;
+	struct spi_device *spi;
+
+	if (daemon->num_spis == SPI_DAEMON_MAX_DEVICES) {
+		pr_err("Too many devices, ignoring '%s'\n", device);
+		return;
+	}
+
+	spi = spi_driver_add_device(sdrv, device, true);
+	if (IS_ERR(spi))
+		return;
+
+	udev = spi_get_drvdata(spi);
+	ev.data.ptr = spi;
+	if (epoll_ctl(daemon->epfd, EPOLL_CTL_ADD, udev->fd, &ev) < 0) {
+		pr_err("%s: Failed to watch '%s': %s\n", __func__, device, strerror(errno));
+		spi_driver_remove_device(sdrv, spi);
+		return;
+	}
+
+	daemon->spis[daemon->num_spis++] = spi;
+}
+
+/* The earliest paced flush decides how long to wait */
+static int spi_daemon_timeout(struct spi_daemon *daemon)
+{
+	int timeout = -1, t;
+	unsigned int i;
+
+	for (i = 0; i < daemon->num_spis; i++) {
+		t = udrm_event_timeout(spi_get_drvdata(daemon->spis[i]));
+		if (t >= 0 && (timeout < 0 || t < timeout))
+			timeout = t;
+	}
+
+	return timeout;
+}
+
+static void spi_daemon_remove(struct spi_daemon *daemon, struct spi_driver *sdrv, struct spi_device *spi)
+{
+	struct udrm_device *udev = spi_get_drvdata(spi);
+	unsigned int i;
+
+	for (i = 0; i < daemon->num_spis; i++) {
+		if (daemon->spis[i] == spi) {
+			daemon->spis[i] = daemon->spis[--daemon->num_spis];
+			break;
+		}
+	}
+
+	udrm_print_stats(udev);
+	spi_print_stats(spi);
+	epoll_ctl(daemon->epfd, EPOLL_CTL_DEL, udev->fd, NULL);
+	spi_driver_remove_device(sdrv, spi);
+}
+
+/**
+ * spi_driver_daemon - Drive all devices from one process
+ * @sdrv: Registered SPI driver
+ *
+ * Waits on the /dev/spidev registration fd and the /dev/udrm fd of every
+ * device with epoll and handles the devices as they become ready. The
+ * devices on a bus share a flush worker (async-flush, flush-group) unless
+ * the properties say otherwise.
+ *
+ * Returns:
+ * Zero on shutdown, negative error code on failure.
+ */
+int spi_driver_daemon(struct spi_driver *sdrv)
+{
+	struct epoll_event events[SPI_DAEMON_MAX_EVENTS];
+	struct spi_daemon daemon = { };
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	struct spi_device *spi;
+	char new_device[32];
+	int i, n, ret = 0;
+
+	udrm_signals_init();
+
+	daemon.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (daemon.epfd < 0) {
+		pr_err("%s: Failed to create epoll instance: %s\n", __func__, strerror(errno));
+		return -errno;
+	}
+
+	if (epoll_ctl(daemon.epfd, EPOLL_CTL_ADD, sdrv->fd, &ev) < 0) {
+		pr_err("%s: Failed to watch /dev/spidev: %s\n", __func__, strerror(errno));
+		ret = -errno;
+		goto out_close;
+	}
+
+	while (!udrm_shutdown_requested()) {
+		if (udrm_stats_requested())
+			spi_daemon_print_stats(&daemon);
+
+		n = epoll_wait(daemon.epfd, events, SPI_DAEMON_MAX_EVENTS, spi_daemon_timeout(&daemon));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("%s: Failed to wait: %s\n", __func__, strerror(errno));
+			ret = -errno;
+			break;
+		}
+
+		for (i = 0; i < daemon.num_spis; i++)
+			udrm_flush_due(spi_get_drvdata(daemon.spis[i]));
+		if (!n)
+			continue;
+
+		daemon.wakeups++;
+
+		for (i = 0; i < n; i++) {
+			spi = events[i].data.ptr;
+
+			/* New device */
+			if (!spi) {
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					pr_err("%s: /dev/spidev went away\n", __func__);
+					epoll_ctl(daemon.epfd, EPOLL_CTL_DEL, sdrv->fd, NULL);
+					continue;
+				}
+
+				ret = read(sdrv->fd, new_device, sizeof(new_device) - 1);
+				if (ret < 0) {
+					pr_err("%s: Failed to read from /dev/spidev: %s\n", __func__, strerror(errno));
+					continue;
+				}
+				new_device[ret] = '\0';
+
+				pr_info("New device: '%s'\n", new_device);
+				spi_daemon_add(&daemon, sdrv, new_device);
+				continue;
+			}
+
+			daemon.dispatches++;
+
+			ret = 0;
+			if (events[i].events & EPOLLIN)
+				ret = udrm_event_process(spi_get_drvdata(spi));
+			if (ret || (events[i].events & (EPOLLERR | EPOLLHUP)))
+				spi_daemon_remove(&daemon, sdrv, spi);
+		}
+		ret = 0;
+	}
+
+	spi_daemon_print_stats(&daemon);
+
+	while (daemon.num_spis)
+		spi_daemon_remove(&daemon, sdrv, daemon.spis[0]);
+
+out_close:
+	close(daemon.epfd);
+
+	return ret;
+}
+
+int module_spi_driver_main(int argc, char const *argv[], struct spi_driver *sdrv)
+{
+	struct udrm_device *udev;
+	struct spi_device *spi;
+	const char *device;
+	int ret;
+
+	if (argc > 2) {
+		pr_err("Too many arguments\n");
+		exit(1);
+	}
+
+	/* All devices in this process */
+	if (argc == 2 && !strcmp(argv[1], "--daemon")) {
+		ret = spi_register_driver(sdrv);
+		if (ret) {
+			pr_err("Failed to register driver %d\n", ret);
+			return 1;
+		}
+
+		printf("SPI driver registered\n");
+		ret = spi_driver_daemon(sdrv);
+		close(sdrv->fd);
+
+		return ret ? 1 : 0;
+	}
+
+	if (argc == 1) {
+		ret = spi_register_driver(sdrv);
+
+		printf("SPI driver registered\n");
+		device = spi_driver_event_loop(sdrv);
+		if (IS_ERR(device)) {
+			pr_err("Error initiating device %d\n", PTR_ERR(device));
+			exit(1);
+		}
+	} else {
+		device = argv[1];
+	}
+
+	spi = spi_driver_add_device(sdrv, device, false);
+	if (IS_ERR(spi))
+		return 1;
+
+	udev = spi_get_drvdata(spi);
+
+	udrm_event_loop(udev);
+	spi_print_stats(spi);
+
+	spi_driver_remove_device(sdrv, spi);
 
 printf("%s: exit\n", __func__);
 	return 0;
@@ -505,12 +750,14 @@ void _spi_message_dbg(struct spi_device *spi, struct spi_ioc_transfer *msg, unsi
 			pr_debug("    tr[%i]: bpw=%i,        len=%u, rx_buf(%p)=[%s%s]\n",
 				 i, tmp->bits_per_word, tmp->len, rx_buf, linebuf, tmp->len > 16 ? " ..." : "");
 		}
-		i++;
 	}
 }
 
 
 
+/* spidev takes at most this many transfers in one SPI_IOC_MESSAGE */
+#define SPI_MAX_TRANSFERS	(_IOC_SIZEMASK / sizeof(struct spi_ioc_transfer))
+
 /**
  * tinydrm_spi_transfer - SPI transfer helper
  * @spi: SPI device
@@ -519,13 +766,20 @@ void _spi_message_dbg(struct spi_device *spi, struct spi_ioc_transfer *msg, unsi
  * @bpw: Bits per word
  * @buf: Buffer to transfer
  * @len: Buffer length
- * @swap_buf: Swap buffer used on Little Endian when 16 bpw is not supported
+ * @swap_buf: Swap buffer used on Little Endian when 16 bpw is not supported,
+ *            spi->max_len bytes
  * @max_chunk: Break up buffer into chunks of this size
  *
  * This SPI transfer helper breaks up the transfer of @buf into @max_chunk
- * chunks. If the machine is Little Endian and the SPI master driver doesn't
- * support @bpw=16, it swaps the bytes using @swap_buf and does a 8-bit
- * transfer. If @header is set, it is prepended to each SPI message.
+ * chunks and sends as many of them as spidev takes in one SPI message:
+ * up to SPI_MAX_TRANSFERS transfers, and no more than spi->max_len bytes
+ * from memory since spidev copies those through its bounce buffer. A
+ * dma-buf is sent in chunks of spi->max_dma_len, and the lines of a dma-buf
+ * rectangle as a transfer each. If the machine is Little Endian and the SPI
+ * master driver doesn't support @bpw=16, the chunks of a message are
+ * swapped into @swap_buf right before it's sent with 8-bit transfers. A
+ * dma-buf is then read through its mapping, a rectangle can't be swapped.
+ * If @header is set, it is prepended to each SPI message.
  *
  * Returns:
  * Zero on success, negative error code on failure.
@@ -533,80 +787,112 @@ void _spi_message_dbg(struct spi_device *spi, struct spi_ioc_transfer *msg, unsi
 int spi_transfer(struct spi_device *spi, u32 speed_hz, struct spi_ioc_transfer *header, u8 bpw,
 		 const void *buf, size_t len, u16 *swap_buf, size_t max_chunk)
 {
-	struct spi_ioc_transfer msg[2];
-	struct spi_ioc_transfer *tr;
-	unsigned int num_msgs = 1;
+	struct spi_ioc_transfer msg[SPI_MAX_TRANSFERS];
+	struct spi_ioc_transfer tmpl = {
+		.bits_per_word = bpw,
+	};
+	unsigned int first = header ? 1 : 0, num;
 	struct dma_buf *dmabuf = NULL;
+	size_t chunk, offset = 0, step = 0, total;
+	u16 *swap_pos = NULL;
 	bool swap = false;
-	size_t chunk;
-	int ret = 0;
+	u64 start;
+	int ret;
 
 	if (bpw != 8 && bpw != 16)
 		return -EINVAL;
 
 	if (!speed_hz)
 		speed_hz = spi->max_speed_hz;
+	tmpl.speed_hz = speed_hz;
 
 	if (udrm_debug & DRM_UT_CORE)
 		pr_debug("[drm:%s] @%uMHz, bpw=%u, max_chunk=%zu, transfers:\n",
 			 __func__, speed_hz / 1000000, bpw, max_chunk);
 
-	memset(msg, 0, sizeof(msg));
-	if (header) {
-		msg[0] = *header;
-		tr = &msg[1];
-		num_msgs++;
-	} else {
-		tr = &msg[0];
-	}
-
-	tr->bits_per_word = bpw;
-	tr->speed_hz = speed_hz;
-
 	if (regmap_get_machine_endian() == REGMAP_ENDIAN_LITTLE &&
 	    bpw == 16 && !spi_bpw_supported(spi, 16)) {
 		if (!swap_buf)
 			return -EINVAL;
 
 		swap = true;
-		tr->bits_per_word = 8;
+		tmpl.bits_per_word = 8;
 	}
 
 	if (dma_buf_check((void *)buf)) {
 		dmabuf = (void *)buf;
-		tr->tx_dma_fd = dmabuf->fd;
-		max_chunk = spi->max_dma_len;
+		if (dmabuf->line_len) {
+			if (swap || dmabuf->line_len > spi->max_dma_len || len % dmabuf->line_len)
+				return -EINVAL;
+
+			max_chunk = dmabuf->line_len;
+			step = dmabuf->pitch;
+			offset = dmabuf->offset;
+			tmpl.tx_dma_fd = dmabuf->fd;
+		} else if (swap) {
+			void *vaddr = dmabuf->vaddr ? : dma_buf_vmap(dmabuf);
+
+			if (!vaddr)
+				return -ENOMEM;
+
+			buf = vaddr + dmabuf->offset;
+			dmabuf = NULL;
+		} else {
+			max_chunk = spi->max_dma_len;
+			step = max_chunk;
+			offset = dmabuf->offset;
+			tmpl.tx_dma_fd = dmabuf->fd;
+		}
 	}
 
-	while (len) {
-		chunk = min(len, max_chunk);
-
-		if (!dmabuf)
-			tr->tx_buf = (unsigned long)buf;
-		tr->len = chunk;
-
-		if (swap) {
-			const u16 *buf16 = buf;
-			unsigned int i;
+	if (header)
+		msg[0] = *header;
 
-			for (i = 0; i < chunk / 2; i++)
-				swap_buf[i] = swab16(buf16[i]);
+	while (len) {
+		total = header ? header->len : 0;
+		swap_pos = swap_buf;
+
+		for (num = first; num < SPI_MAX_TRANSFERS && len; num++) {
+			chunk = min(len, max_chunk);
+
+			if (dmabuf) {
+				msg[num] = tmpl;
+				msg[num].dma_offset = offset;
+				offset += step;
+			} else {
+				/* spidev copies the message through a buffer of max_len bytes */
+				if (num > first && total + chunk > spi->max_len)
+					break;
+
+				msg[num] = tmpl;
+				if (swap) {
+					start = udrm_latency_now();
+					convert_swab16(swap_pos, buf, chunk / 2);
+					udrm_latency_add(udrm_latency_current, UDRM_LATENCY_CONVERT, start);
+					msg[num].tx_buf = (unsigned long)swap_pos;
+					swap_pos += chunk / 2;
+				} else {
+					msg[num].tx_buf = (unsigned long)buf;
+				}
+				buf += chunk;
+			}
 
-			tr->tx_buf = (unsigned long)swap_buf;
+			msg[num].len = chunk;
+			total += chunk;
+			len -= chunk;
 		}
 
-		buf += chunk;
-		len -= chunk;
+		spi_message_dbg(spi, msg, num);
 
-		spi_message_dbg(spi, msg, num_msgs);
+		start = udrm_latency_now();
+		ret = spi_sync(spi, msg, num);
+		if (ret)
+			return ret;
+		udrm_latency_add(udrm_latency_current, UDRM_LATENCY_SPI, start);
 
-		ret = spi_sync(spi, msg, num_msgs);
-		if (ret < 0)
-			return -errno;
-
-		if (dmabuf)
-			tr->dma_offset += chunk;
-	};
+		spi->messages++;
+		spi->transfers += num - first;
+	}
 
 	return 0;
 }
@@ -615,6 +901,9 @@ int spi_sync(struct spi_device *spi, struct spi_ioc_transfer *msg, unsigned int
 {
 	int ret;
 
+	if (spi->mock)
+		return spi_mock_sync(spi->mock, msg, num_msgs);
+
 	ret = ioctl(spi->fd, SPI_IOC_MESSAGE(num_msgs), msg);
 	if (ret < 0) {
 		if (errno == ESHUTDOWN)
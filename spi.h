@@ -7,6 +7,7 @@
 #include "udrm.h"
 
 struct spi_device;
+struct spi_mock;
 
 struct spi_driver {
 	int		fd;
@@ -18,6 +19,7 @@ struct spi_driver {
 
 int spi_register_driver(struct spi_driver *sdrv);
 char *spi_driver_event_loop(struct spi_driver *sdrv);
+int spi_driver_daemon(struct spi_driver *sdrv);
 int module_spi_driver_main(int argc, char const *argv[], struct spi_driver *sdrv);
 
 #define module_spi_driver(__spi_driver)					\
@@ -42,6 +44,13 @@ struct spi_device {
 
 	size_t			max_len;
 	size_t			max_dma_len;
+
+	/* stand-in for spidev, see spi_mock_create() */
+	struct spi_mock		*mock;
+
+	/* stats */
+	unsigned long		messages;
+	unsigned long		transfers;
 };
 
 
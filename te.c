@@ -0,0 +1,375 @@
+/*
+ * Tearing effect synchronisation
+ *
+ * The panel raises the TE line when it starts vertical blanking and then
+ * scans its memory top to bottom, one refresh period per frame. A transfer
+ * that starts right after the edge and stays behind the scan position is
+ * shown in full on the next refresh. Transfers longer than a period get
+ * lapped by the scan and are split into bands by the caller.
+ *
+ * A band covering lines y1..y2 and taking d to send must not start before
+ * the scan has passed y1, or overtake the scan at y2:
+ *
+ *   start >= max(y1 * line, y2 * line - d)
+ *
+ * and it has to be done before the next refresh cycle reaches y2:
+ *
+ *   start + d <= period + y2 * line
+ *
+ * Only the first edge of a flush is waited on, later bands use edges
+ * predicted from the measured period.
+ *
+ * Panels without a TE pin can have the phase estimated from the scanline
+ * the controller reports (GET_SCANLINE). The line time and the number of
+ * lines including blanking are calibrated from a burst of samples, after
+ * that the estimate is resynced every now and then: the phase error is
+ * corrected and used to trim the period.
+ */
+
+// memset
+#include <string.h>
+
+#include "gpio.h"
+#include "te.h"
+
+void te_sync_init(struct te_sync *te, struct gpio_desc *gpio, unsigned int lines)
+{
+	memset(te, 0, sizeof(*te));
+	te->gpio = gpio;
+	te->lines = lines;
+}
+
+/**
+ * te_sync_init_scanline - Set up scanline based synchronisation
+ * @te: TE synchronisation
+ * @get_scanline: Reads the current scanline
+ * @data: Passed to @get_scanline
+ * @lines: Visible lines, see &te_sync->lines
+ * @resync_ms: How often the estimate is checked against the controller
+ */
+void te_sync_init_scanline(struct te_sync *te, int (*get_scanline)(void *data, unsigned int *scanline),
+			   void *data, unsigned int lines, unsigned int resync_ms)
+{
+	te_sync_init(te, NULL, lines);
+	te->get_scanline = get_scanline;
+	te->scanline_data = data;
+	te->resync_ns = (u64)resync_ms * NSEC_PER_MSEC;
+}
+
+static void te_sync_sleep_until(struct te_sync *te, u64 deadline)
+{
+	struct timespec ts = {
+		.tv_sec = deadline / NSEC_PER_SEC,
+		.tv_nsec = deadline % NSEC_PER_SEC,
+	};
+	u64 now = ktime_get_ns();
+
+	if (deadline <= now)
+		return;
+
+	te->wait_ns += deadline - now;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Edges are only seen when waited on, there can be missed ones in between */
+static void te_sync_update_period(struct te_sync *te, u64 edge)
+{
+	u64 delta = edge - te->edge_ns;
+	u64 cycles;
+
+	if (!te->edge_ns)
+		return;
+
+	if (!te->period_ns) {
+		te->period_ns = delta;
+	} else {
+		cycles = (delta + te->period_ns / 2) / te->period_ns;
+		if (cycles)
+			te->period_ns = (7 * te->period_ns + delta / cycles) / 8;
+	}
+
+	if (te->lines)
+		te->line_ns = te->period_ns / te->lines;
+}
+
+static int te_sync_wait_edge(struct te_sync *te)
+{
+	int timeout = TE_SYNC_TIMEOUT_MS;
+	u64 start, edge;
+	int ret;
+
+	if (te->period_ns)
+		timeout = DIV_ROUND_UP(2 * te->period_ns, NSEC_PER_MSEC);
+
+	start = ktime_get_ns();
+	do {
+		te->waits++;
+		ret = gpiod_wait_edge(te->gpio, timeout, &edge);
+		if (ret) {
+			te->timeouts++;
+			te->edge_ns = 0;
+			pr_debug("TE: Failed waiting for edge: %d\n", ret);
+			return ret;
+		}
+
+		te_sync_update_period(te, edge);
+		te->edge_ns = edge;
+	} while (!te->period_ns);
+
+	te->wait_ns += ktime_get_ns() - start;
+
+	return 0;
+}
+
+/* The sample is taken halfway through the read */
+static int te_sync_read_scanline(struct te_sync *te, unsigned int *scanline, u64 *timestamp)
+{
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = te->get_scanline(te->scanline_data, scanline);
+	*timestamp = start + (ktime_get_ns() - start) / 2;
+
+	return ret;
+}
+
+/*
+ * Sample the scanline for a couple of refresh periods. Pairs that didn't
+ * wrap give the line time, the ones that did give the number of lines per
+ * refresh.
+ */
+static int te_sync_calibrate(struct te_sync *te)
+{
+	u64 t, prev_t = 0, dt_sum = 0, ds_sum = 0, vtotal_sum = 0;
+	unsigned int s, prev_s = 0, max_s = 0, wraps = 0;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < TE_SYNC_CALIBRATE_SAMPLES; i++) {
+		ret = te_sync_read_scanline(te, &s, &t);
+		if (ret)
+			return ret;
+
+		if (i && s > prev_s) {
+			dt_sum += t - prev_t;
+			ds_sum += s - prev_s;
+		} else if (i && s < prev_s && dt_sum) {
+			/* lines to the end of the refresh, then s lines into the next one */
+			vtotal_sum += prev_s + (t - prev_t) * ds_sum / dt_sum - s;
+			wraps++;
+		}
+
+		max_s = max(max_s, s);
+		prev_s = s;
+		prev_t = t;
+		usleep(TE_SYNC_CALIBRATE_US);
+	}
+
+	if (!ds_sum) {
+		pr_err("TE: The scanline doesn't move\n");
+		return -EIO;
+	}
+
+	te->line_ns = dt_sum / ds_sum;
+	te->vtotal = wraps ? DIV_ROUND_UP(vtotal_sum, wraps) : max_s + 1;
+	te->vtotal = max(te->vtotal, te->lines);
+	te->period_ns = te->vtotal * te->line_ns;
+	te->edge_ns = prev_t - prev_s * te->line_ns;
+	te->sync_ns = prev_t;
+
+	pr_info("TE: Scanline calibrated: vtotal=%u, line=%lluns, period=%lluus\n", te->vtotal,
+		(unsigned long long)te->line_ns, (unsigned long long)(te->period_ns / NSEC_PER_USEC));
+
+	return 0;
+}
+
+/*
+ * Compare the estimate with the controller. The phase error that has built
+ * up since the last resync says how far off the period is.
+ */
+static int te_sync_resync(struct te_sync *te)
+{
+	s64 err, pos, actual, abs_err;
+	unsigned int s;
+	u64 t, cycles;
+	int ret;
+
+	ret = te_sync_read_scanline(te, &s, &t);
+	if (ret)
+		return ret;
+
+	pos = (t - te->edge_ns) % te->period_ns;
+	actual = (s64)s * te->line_ns;
+	err = actual - pos;
+	if (err > (s64)te->period_ns / 2)
+		err -= te->period_ns;
+	else if (err < -(s64)te->period_ns / 2)
+		err += te->period_ns;
+	abs_err = err < 0 ? -err : err;
+
+	te->resyncs++;
+	te->drift_ns = err;
+	te->drift_max_ns = max_t(u64, te->drift_max_ns, abs_err);
+	te->drift_sum_ns += abs_err;
+
+	/* the scan lagging behind the estimate means a longer period, apply half */
+	cycles = (t - te->sync_ns) / te->period_ns;
+	if (cycles) {
+		te->drift_ppb = -err * (s64)NSEC_PER_SEC / (s64)(t - te->sync_ns);
+		te->period_ns -= err / (s64)cycles / 2;
+		te->line_ns = te->period_ns / te->vtotal;
+	}
+
+	te->edge_ns = t - actual;
+	te->sync_ns = t;
+
+	return 0;
+}
+
+/**
+ * te_sync_begin - Synchronise with the refresh at the start of a flush
+ * @te: TE synchronisation
+ *
+ * With a TE gpio this waits for the start of vertical blanking, it waits for
+ * two edges the first time to measure the refresh period. With a scanline
+ * source the estimate is calibrated the first time and resynced when it's
+ * due, there's no waiting for blanking.
+ *
+ * Returns:
+ * Zero on success, negative error code if there's no sync. The transfer
+ * should go ahead unsynchronised in that case.
+ */
+int te_sync_begin(struct te_sync *te)
+{
+	int ret;
+
+	if (te->gpio)
+		return te_sync_wait_edge(te);
+
+	if (!te->get_scanline)
+		return 0;
+
+	if (!te->period_ns)
+		ret = te_sync_calibrate(te);
+	else if (ktime_get_ns() - te->sync_ns >= te->resync_ns)
+		ret = te_sync_resync(te);
+	else
+		return 0;
+
+	if (ret) {
+		pr_err("TE: Failed to read scanline, disabling: %d\n", ret);
+		te->get_scanline = NULL;
+		te->period_ns = 0;
+		te->edge_ns = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * te_sync_scan_line - Framebuffer line being scanned
+ * @te: TE synchronisation
+ *
+ * Returns:
+ * The line, te->lines during blanking or -1 if unknown.
+ */
+int te_sync_scan_line(struct te_sync *te)
+{
+	u64 pos;
+
+	if (!te->edge_ns || !te->period_ns || !te->line_ns || !te->lines)
+		return -1;
+
+	pos = (ktime_get_ns() - te->edge_ns) % te->period_ns;
+
+	return min_t(u64, pos / te->line_ns, te->lines);
+}
+
+/**
+ * te_sync_band_lines - Number of lines that can be sent in one band
+ * @te: TE synchronisation
+ * @lines: Lines in the transfer
+ * @duration_ns: Time it takes to send @lines
+ *
+ * Returns:
+ * Number of lines that can be sent without being lapped by the scan.
+ */
+unsigned int te_sync_band_lines(struct te_sync *te, unsigned int lines, u64 duration_ns)
+{
+	/* leave a quarter of the period for command overhead and jitter */
+	u64 budget = te->period_ns * 3 / 4;
+
+	if (!te->lines || !te->period_ns || duration_ns <= budget)
+		return lines;
+
+	return max_t(unsigned int, 1, lines * budget / duration_ns);
+}
+
+/**
+ * te_sync_band - Wait until a band can be sent behind the scan
+ * @te: TE synchronisation
+ * @y1: First line
+ * @y2: Line after the last one
+ * @duration_ns: Time it takes to send the band
+ *
+ * Bands of a window must be sent top to bottom.
+ */
+void te_sync_band(struct te_sync *te, unsigned int y1, unsigned int y2, u64 duration_ns)
+{
+	u64 line_ns = te->line_ns, earliest, latest, now, pos;
+
+	if (!te->edge_ns || !te->period_ns || !line_ns || !te->lines)
+		return;
+
+	y2 = min(y2, te->lines);
+	y1 = min(y1, y2);
+	earliest = max_t(u64, y1 * line_ns, y2 * line_ns > duration_ns ? y2 * line_ns - duration_ns : 0);
+	latest = te->period_ns + y2 * line_ns;
+	latest = latest > duration_ns ? latest - duration_ns : 0;
+
+	/* move the edge up to the current refresh cycle */
+	now = ktime_get_ns();
+	if (now >= te->edge_ns + te->period_ns)
+		te->edge_ns += (now - te->edge_ns) / te->period_ns * te->period_ns;
+	pos = now - te->edge_ns;
+
+	if (pos >= earliest && pos <= latest)
+		return;
+
+	te->deferred++;
+	if (pos > latest)
+		te->edge_ns += te->period_ns;
+
+	pr_debug("TE: Band %u-%u at %lluus, start at %lluus\n", y1, y2,
+		 (unsigned long long)(pos / NSEC_PER_USEC), (unsigned long long)(earliest / NSEC_PER_USEC));
+
+	te_sync_sleep_until(te, te->edge_ns + earliest);
+}
+
+void te_sync_print_stats(struct te_sync *te, const char *name)
+{
+	u64 drift_lines10 = 0;
+
+	if (te->gpio) {
+		pr_info("%s: TE period=%lluus, waits=%lu, timeouts=%lu, deferred=%lu, waited=%llums\n", name,
+			(unsigned long long)(te->period_ns / NSEC_PER_USEC), te->waits, te->timeouts,
+			te->deferred, (unsigned long long)(te->wait_ns / NSEC_PER_MSEC));
+		return;
+	}
+
+	if (!te->get_scanline)
+		return;
+
+	if (te->line_ns)
+		drift_lines10 = te->drift_max_ns * 10 / te->line_ns;
+
+	pr_info("%s: scanline period=%lluus, vtotal=%u, resyncs=%lu, deferred=%lu, waited=%llums\n", name,
+		(unsigned long long)(te->period_ns / NSEC_PER_USEC), te->vtotal, te->resyncs,
+		te->deferred, (unsigned long long)(te->wait_ns / NSEC_PER_MSEC));
+	pr_info("%s: scanline drift=%lldus, avg=%lluus, max=%lluus (%llu.%llu lines), period error=%lldppm\n", name,
+		(long long)(te->drift_ns / NSEC_PER_USEC),
+		te->resyncs ? (unsigned long long)(te->drift_sum_ns / te->resyncs / NSEC_PER_USEC) : 0ULL,
+		(unsigned long long)(te->drift_max_ns / NSEC_PER_USEC),
+		(unsigned long long)(drift_lines10 / 10), (unsigned long long)(drift_lines10 % 10),
+		(long long)(te->drift_ppb / 1000));
+}
@@ -0,0 +1,79 @@
+#ifndef _TE_H
+#define _TE_H
+
+#include "base.h"
+
+struct gpio_desc;
+
+/* Wait this long for the first edges, before the refresh period is known */
+#define TE_SYNC_TIMEOUT_MS	100
+
+/* Scanline samples taken to calibrate the phase estimate */
+#define TE_SYNC_CALIBRATE_SAMPLES	64
+#define TE_SYNC_CALIBRATE_US		500
+
+/**
+ * struct te_sync - Tearing effect synchronisation
+ * @gpio: TE input, rising edge at the start of vertical blanking
+ * @get_scanline: Reads the line the controller is scanning, used to
+ *                estimate the refresh phase when there's no TE gpio
+ * @scanline_data: Passed to @get_scanline
+ * @lines: Number of lines the panel scans top to bottom in framebuffer
+ *         coordinates, zero if the scan doesn't follow the framebuffer lines
+ *         and transfers can't be ordered behind it
+ * @vtotal: Scanlines per refresh including blanking (scanline estimate)
+ * @line_ns: Time to scan one line
+ * @edge_ns: Start of the current refresh cycle, the last edge or predicted
+ *           from it
+ * @period_ns: Refresh period, measured from the edges or scanlines
+ * @sync_ns: Last time the scanline estimate was synced
+ * @resync_ns: Resync the scanline estimate this often
+ * @waits: Number of times the edge was waited for
+ * @timeouts: Number of times the edge didn't show up
+ * @deferred: Number of transfers held back to stay behind the scan
+ * @wait_ns: Total time spent waiting for the edge and the scan
+ * @resyncs: Number of scanline resyncs
+ * @drift_ns: Phase error of the estimate at the last resync
+ * @drift_max_ns: Largest phase error seen
+ * @drift_sum_ns: Sum of the phase errors, absolute
+ * @drift_ppb: Period error at the last resync in parts per billion
+ */
+struct te_sync {
+	struct gpio_desc *gpio;
+	int (*get_scanline)(void *data, unsigned int *scanline);
+	void *scanline_data;
+	unsigned int lines;
+	unsigned int vtotal;
+	u64 line_ns;
+	u64 edge_ns;
+	u64 period_ns;
+	u64 sync_ns;
+	u64 resync_ns;
+
+	unsigned long waits;
+	unsigned long timeouts;
+	unsigned long deferred;
+	u64 wait_ns;
+	unsigned long resyncs;
+	s64 drift_ns;
+	u64 drift_max_ns;
+	u64 drift_sum_ns;
+	s64 drift_ppb;
+};
+
+void te_sync_init(struct te_sync *te, struct gpio_desc *gpio, unsigned int lines);
+void te_sync_init_scanline(struct te_sync *te, int (*get_scanline)(void *data, unsigned int *scanline),
+			   void *data, unsigned int lines, unsigned int resync_ms);
+
+static inline bool te_sync_active(const struct te_sync *te)
+{
+	return te->gpio || te->get_scanline;
+}
+
+int te_sync_begin(struct te_sync *te);
+int te_sync_scan_line(struct te_sync *te);
+unsigned int te_sync_band_lines(struct te_sync *te, unsigned int lines, u64 duration_ns);
+void te_sync_band(struct te_sync *te, unsigned int y1, unsigned int y2, u64 duration_ns);
+void te_sync_print_stats(struct te_sync *te, const char *name);
+
+#endif
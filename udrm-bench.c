@@ -0,0 +1,1976 @@
+/*
+ * Run the event loop and flush path against the local stand-in for the
+ * udrm kernel module, no hardware needed. The events are either generated
+ * or replayed from a recording made with the 'record' property.
+ */
+
+// memcpy
+#include <string.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "device.h"
+#include "gpio.h"
+#include "mipi-dbi.h"
+#include "mipi-dbi-spi.h"
+#include "region.h"
+#include "spi-mock.h"
+#include "te.h"
+#include "udrm.h"
+#include "udrm-local.h"
+#include "udrm-record.h"
+
+/**
+ * struct udrm_bench_replay - Recording being replayed
+ * @data: Mapping of the recording
+ * @size: Size of the recording
+ * @header: Recording header
+ * @pace: Speed up, 1 is the recorded pace, 0 as fast as possible
+ * @rec_ids: Recorded framebuffer ids indexed by the local slot
+ */
+struct udrm_bench_replay {
+	const void *data;
+	size_t size;
+	const struct udrm_record_header *header;
+	double pace;
+	unsigned int rec_ids[UDRM_LOCAL_MAX_FBS];
+};
+
+/**
+ * struct udrm_bench - Benchmark state
+ * @udev: udrm device
+ * @dev: Device holding the properties given on the command line
+ * @frames: Number of frames to send
+ * @width: Framebuffer width
+ * @height: Framebuffer height
+ * @damage_w: Damage width, moves across the framebuffer
+ * @damage_h: Damage height
+ * @format: Framebuffer format
+ * @speed_hz: Simulated bus speed, zero to not wait
+ * @te: Tearing effect synchronisation, driven by te-mock-hz or the
+ *      simulated scanline
+ * @scanline_hz: Refresh rate of the simulated scanline, zero for none
+ * @scanline_start_ns: Start of the first simulated refresh
+ * @cursor_us: Send a small update this long after each frame, zero for none
+ * @cursor: Area of the small update
+ * @cursor_sent_ns: When the small update that isn't on the panel yet was sent
+ * @cursor_latency: Send to on the panel latency of the small updates
+ * @num_cursor_latency: Number of entries in @cursor_latency
+ * @replay: Recording to replay instead of generating events
+ * @line: Line converted for the wire
+ * @pixels: Pixels read by the panel
+ * @checksum: Keeps the pixel reads from being optimized away
+ * @latency: Send to ack latency of each event
+ * @num_latency: Number of entries in @latency
+ * @max_latency: Size of @latency
+ * @ret: Result of the generator
+ */
+struct udrm_bench {
+	struct udrm_device udev;
+	struct device dev;
+	unsigned int frames;
+	unsigned int width;
+	unsigned int height;
+	unsigned int damage_w;
+	unsigned int damage_h;
+	u32 format;
+	u32 speed_hz;
+	struct te_sync te;
+	unsigned int scanline_hz;
+	u64 scanline_start_ns;
+	unsigned int cursor_us;
+	struct drm_clip_rect cursor;
+	_Atomic u64 cursor_sent_ns;
+	u64 *cursor_latency;
+	unsigned int num_cursor_latency;
+	struct udrm_bench_replay *replay;
+	u16 *line;
+	u64 pixels;
+	u32 checksum;
+	u64 *latency;
+	unsigned int num_latency;
+	unsigned int max_latency;
+	int ret;
+};
+
+/* Simulated scanline: lines of vertical blanking and clock error */
+#define UDRM_BENCH_SCANLINE_BLANKING	10
+#define UDRM_BENCH_SCANLINE_PPM		200
+
+/* Small update sent with -c, and how long the simulated bus goes between preemption checks */
+#define UDRM_BENCH_CURSOR_SIZE		16
+#define UDRM_BENCH_PREEMPT_SLICE_NS	(2 * NSEC_PER_MSEC)
+
+static const uint32_t udrm_bench_formats[] = {
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_XRGB8888,
+};
+
+static struct drm_mode_modeinfo udrm_bench_mode = {
+	UDRM_MODE(320, 240, 0, 0),
+};
+
+static struct udrm_bench *udrm_bench_from_udev(struct udrm_device *udev)
+{
+	return container_of(udev, struct udrm_bench, udev);
+}
+
+/* Time to send RGB565 pixels on the simulated bus */
+static u64 udrm_bench_bus_ns(struct udrm_bench *bench, u64 pixels)
+{
+	return pixels * 16 * NSEC_PER_SEC / bench->speed_hz;
+}
+
+/*
+ * A controller reporting its scanline, with some blanking lines and a clock
+ * that is a bit slow to have drift to correct.
+ */
+static int udrm_bench_get_scanline(void *data, unsigned int *scanline)
+{
+	struct udrm_bench *bench = data;
+	unsigned int vtotal = bench->height + UDRM_BENCH_SCANLINE_BLANKING;
+	u64 period = NSEC_PER_SEC / bench->scanline_hz;
+	u64 pos;
+
+	period += period * UDRM_BENCH_SCANLINE_PPM / 1000000;
+	pos = (ktime_get_ns() - bench->scanline_start_ns) % period;
+	*scanline = pos * vtotal / period;
+
+	return 0;
+}
+
+/* Take the time the bus would, in slices when the flush can be preempted */
+static void udrm_bench_bus_wait(struct udrm_bench *bench, u64 duration_ns)
+{
+	u64 slice;
+
+	while (duration_ns) {
+		slice = duration_ns;
+		if (bench->udev.preemptible)
+			slice = min_t(u64, slice, UDRM_BENCH_PREEMPT_SLICE_NS);
+		usleep(slice / NSEC_PER_USEC);
+		duration_ns -= slice;
+		if (duration_ns)
+			udrm_preempt(&bench->udev);
+	}
+}
+
+/* The small update is on the panel when a clip sent after it covers it */
+static void udrm_bench_cursor_check(struct udrm_bench *bench, const struct drm_clip_rect *clip, u64 start)
+{
+	u64 sent = atomic_load(&bench->cursor_sent_ns);
+	const struct drm_clip_rect *cursor = &bench->cursor;
+
+	if (!sent || start < sent || clip->x1 > cursor->x1 || clip->y1 > cursor->y1 ||
+	    clip->x2 < cursor->x2 || clip->y2 < cursor->y2)
+		return;
+
+	if (!atomic_compare_exchange_strong(&bench->cursor_sent_ns, &sent, 0))
+		return;
+
+	if (bench->num_cursor_latency < bench->frames)
+		bench->cursor_latency[bench->num_cursor_latency++] = ktime_get_ns() - sent;
+}
+
+/* A panel that reads the pixels and optionally takes the time a bus would */
+static int udrm_bench_dirtyfb(struct udrm_framebuffer *ufb, unsigned int flags, unsigned int color,
+			      struct drm_clip_rect *clips, unsigned int num_clips)
+{
+	struct udrm_bench *bench = udrm_bench_from_udev(ufb->udev);
+	struct dma_buf *dmabuf = udrm_fb_dma_buf(ufb);
+	unsigned int pitch = udrm_buf_pitch(ufb);
+	unsigned int cpp = udrm_buf_cpp(ufb);
+	struct drm_clip_rect full = {
+		.x2 = ufb->width,
+		.y2 = ufb->height,
+	};
+	bool xrgb8888 = ufb->dmabuf && ufb->pixel_format == DRM_FORMAT_XRGB8888;
+	unsigned int i, x, y;
+	const u8 *src;
+	u64 pixels = 0;
+
+	if (xrgb8888 && ufb->width > bench->width)
+		return -EINVAL;
+
+	if (ufb->vaddr) {
+		src = ufb->vaddr;
+	} else {
+		if (!dmabuf->vaddr && !dma_buf_vmap(dmabuf))
+			return -ENOMEM;
+		src = dmabuf->vaddr;
+	}
+
+	if (!num_clips) {
+		clips = &full;
+		num_clips = 1;
+	}
+
+	for (i = 0; i < num_clips; i++) {
+		for (y = clips[i].y1; y < clips[i].y2; y++) {
+			/* Converted for the wire like mipi_dbi does */
+			if (xrgb8888) {
+				convert_xrgb8888_to_rgb565(bench->line, (const u32 *)(src + y * pitch) + clips[i].x1,
+							   clips[i].x2 - clips[i].x1, true);
+				for (x = 0; x < clips[i].x2 - clips[i].x1; x++)
+					bench->checksum += bench->line[x];
+				continue;
+			}
+
+			for (x = clips[i].x1; x < clips[i].x2; x++)
+				bench->checksum += src[y * pitch + x * cpp];
+		}
+		pixels += (clips[i].x2 - clips[i].x1) * (clips[i].y2 - clips[i].y1);
+	}
+
+	bench->pixels += pixels;
+
+	if (!bench->speed_hz)
+		return 0;
+
+	/* Send the clips like mipi_dbi, bands behind the scan if there's TE */
+	te_sync_begin(&bench->te);
+	for (i = 0; i < num_clips; i++) {
+		struct drm_clip_rect band = clips[i];
+		unsigned int lines, width = band.x2 - band.x1;
+		u64 start = ktime_get_ns();
+
+		lines = te_sync_band_lines(&bench->te, band.y2 - band.y1,
+					   udrm_bench_bus_ns(bench, width * (band.y2 - band.y1)));
+		for (band.y1 = clips[i].y1; band.y1 < clips[i].y2; band.y1 = band.y2) {
+			band.y2 = min_t(unsigned int, band.y1 + lines, clips[i].y2);
+			te_sync_band(&bench->te, band.y1, band.y2,
+				     udrm_bench_bus_ns(bench, width * (band.y2 - band.y1)));
+			udrm_bench_bus_wait(bench, udrm_bench_bus_ns(bench, width * (band.y2 - band.y1)));
+		}
+		if (bench->cursor_latency)
+			udrm_bench_cursor_check(bench, &clips[i], start);
+	}
+
+	return 0;
+}
+
+static void udrm_bench_print_stats(struct udrm_device *udev)
+{
+	te_sync_print_stats(&udrm_bench_from_udev(udev)->te, udev->name);
+}
+
+static const struct udrm_funcs udrm_bench_funcs = {
+	.dirtyfb = udrm_bench_dirtyfb,
+	.print_stats = udrm_bench_print_stats,
+};
+
+static void udrm_bench_draw(struct udrm_local_fb *fb, const struct drm_clip_rect *clip, unsigned int frame)
+{
+	unsigned int x, y;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		for (x = clip->x1; x < clip->x2; x++) {
+			if (fb->bpp == 16)
+				((u16 *)(fb->vaddr + y * fb->pitch))[x] = frame + x;
+			else
+				((u32 *)(fb->vaddr + y * fb->pitch))[x] = (frame << 16) | (y << 8) | x;
+		}
+	}
+}
+
+/* Keep the latency of the event that was just acked */
+static int udrm_bench_sample(struct udrm_bench *bench, int ret)
+{
+	struct udrm_local *local = udrm_local_get(&bench->udev);
+
+	if (ret >= 0 && bench->num_latency < bench->max_latency)
+		bench->latency[bench->num_latency++] = local->stats.ack_last_ns;
+
+	return ret;
+}
+
+static int udrm_bench_generate(struct udrm_bench *bench)
+{
+	struct udrm_local *local = udrm_local_get(&bench->udev);
+	struct udrm_local_fb *fb;
+	struct drm_clip_rect clip;
+	unsigned int i, steps_x, steps_y;
+	int fb_id, ret;
+	u64 sent;
+
+	ret = udrm_bench_sample(bench, udrm_local_pipe_enable(local));
+	if (ret)
+		return ret;
+
+	fb_id = udrm_bench_sample(bench, udrm_local_fb_create(local, bench->width, bench->height,
+							      bench->format));
+	if (fb_id < 0)
+		return fb_id;
+
+	fb = udrm_local_fb_lookup(local, fb_id);
+
+	steps_x = bench->width - bench->damage_w + 1;
+	steps_y = bench->height - bench->damage_h + 1;
+
+	for (i = 0; i < bench->frames; i++) {
+		clip.x1 = (i * 7) % steps_x;
+		clip.y1 = (i * 5) % steps_y;
+		clip.x2 = clip.x1 + bench->damage_w;
+		clip.y2 = clip.y1 + bench->damage_h;
+
+		udrm_bench_draw(fb, &clip, i);
+		ret = udrm_bench_sample(bench, udrm_local_fb_dirty(local, fb_id, 0, 0, &clip, 1));
+		if (ret)
+			return ret;
+
+		if (!bench->cursor_us)
+			continue;
+
+		/* a small latency critical update while the frame is being flushed */
+		usleep(bench->cursor_us);
+		udrm_bench_draw(fb, &bench->cursor, i + 1);
+		/* the oldest update that isn't on the panel is the one that counts */
+		sent = 0;
+		atomic_compare_exchange_strong(&bench->cursor_sent_ns, &sent, ktime_get_ns());
+		ret = udrm_bench_sample(bench, udrm_local_fb_dirty(local, fb_id, 0, 0, &bench->cursor, 1));
+		if (ret)
+			return ret;
+		usleep(bench->cursor_us);
+	}
+
+	ret = udrm_bench_sample(bench, udrm_local_fb_destroy(local, fb_id));
+	if (ret)
+		return ret;
+
+	return udrm_bench_sample(bench, udrm_local_pipe_disable(local));
+}
+
+static int udrm_bench_replay_open(struct udrm_bench_replay *replay, const char *fname)
+{
+	const struct udrm_record_header *header;
+	struct stat st;
+	int fd, ret;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		pr_err("Failed to open %s: %s\n", fname, strerror(errno));
+		return -errno;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	if (st.st_size < sizeof(*header)) {
+		pr_err("%s: Not a recording\n", fname);
+		close(fd);
+		return -EINVAL;
+	}
+
+	replay->size = st.st_size;
+	replay->data = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (replay->data == MAP_FAILED) {
+		pr_err("Failed to mmap %s: %s\n", fname, strerror(errno));
+		return -errno;
+	}
+
+	header = replay->data;
+	if (header->magic != UDRM_RECORD_MAGIC || header->version != UDRM_RECORD_VERSION) {
+		pr_err("%s: Not a recording or wrong version\n", fname);
+		munmap((void *)replay->data, replay->size);
+		return -EINVAL;
+	}
+
+	replay->header = header;
+
+	return 0;
+}
+
+static unsigned int udrm_bench_replay_count(struct udrm_bench_replay *replay, unsigned int *frames)
+{
+	const struct udrm_record_entry *entry;
+	const struct udrm_event *ev;
+	size_t pos = sizeof(*replay->header);
+	unsigned int events = 0;
+
+	*frames = 0;
+
+	while (pos + sizeof(*entry) <= replay->size) {
+		entry = replay->data + pos;
+		pos += sizeof(*entry) + entry->event_len + entry->data_len;
+		if (pos > replay->size)
+			break;
+		ev = (const void *)(entry + 1);
+		if (ev->type == UDRM_EVENT_FB_DIRTY)
+			(*frames)++;
+		events++;
+	}
+
+	return events;
+}
+
+static int udrm_bench_replay_fb(struct udrm_bench *bench, unsigned int rec_id)
+{
+	struct udrm_bench_replay *replay = bench->replay;
+	struct udrm_local *local = udrm_local_get(&bench->udev);
+	unsigned int i;
+
+	for (i = 0; i < UDRM_LOCAL_MAX_FBS; i++) {
+		if (local->fbs[i].id && replay->rec_ids[i] == rec_id)
+			return local->fbs[i].id;
+	}
+
+	return -ENOENT;
+}
+
+static int udrm_bench_replay_create(struct udrm_bench *bench, unsigned int rec_id,
+				    const struct udrm_record_fb *rfb)
+{
+	struct udrm_local *local = udrm_local_get(&bench->udev);
+	struct udrm_local_fb *fb;
+	int fb_id;
+
+	fb_id = udrm_bench_sample(bench, udrm_local_fb_create(local, rfb->width, rfb->height,
+							      rfb->pixel_format));
+	if (fb_id < 0)
+		return fb_id;
+
+	fb = udrm_local_fb_lookup(local, fb_id);
+	bench->replay->rec_ids[fb - local->fbs] = rec_id;
+
+	return 0;
+}
+
+/* Put the recorded pixels back into the framebuffer and flush it */
+static int udrm_bench_replay_dirty(struct udrm_bench *bench, const struct udrm_event_fb_dirty *ev,
+				   const void *data, size_t len)
+{
+	const struct drm_mode_fb_dirty_cmd *cmd = &ev->fb_dirty_cmd;
+	struct udrm_local *local = udrm_local_get(&bench->udev);
+	struct drm_clip_rect full, *clips;
+	unsigned int i, y, cpp, num_clips;
+	struct udrm_local_fb *fb;
+	size_t line;
+	int fb_id;
+
+	fb_id = udrm_bench_replay_fb(bench, cmd->fb_id);
+	if (fb_id < 0)
+		return fb_id;
+
+	fb = udrm_local_fb_lookup(local, fb_id);
+	cpp = fb->bpp / 8;
+
+	full.x1 = 0;
+	full.y1 = 0;
+	full.x2 = fb->width;
+	full.y2 = fb->height;
+
+	clips = cmd->num_clips ? (struct drm_clip_rect *)ev->clips : &full;
+	num_clips = cmd->num_clips ? : 1;
+
+	for (i = 0; len && i < num_clips; i++) {
+		if (clips[i].x2 > fb->width || clips[i].y2 > fb->height || clips[i].x1 > clips[i].x2)
+			return -EINVAL;
+
+		line = (clips[i].x2 - clips[i].x1) * cpp;
+		for (y = clips[i].y1; y < clips[i].y2; y++) {
+			if (len < line)
+				return -EINVAL;
+			memcpy(fb->vaddr + y * fb->pitch + clips[i].x1 * cpp, data, line);
+			data += line;
+			len -= line;
+		}
+	}
+
+	return udrm_bench_sample(bench, udrm_local_fb_dirty(local, fb_id, cmd->flags, cmd->color,
+							    ev->clips, cmd->num_clips));
+}
+
+static void udrm_bench_replay_wait(struct udrm_bench_replay *replay, u64 start, u64 timestamp)
+{
+	struct timespec ts;
+	u64 deadline;
+
+	if (replay->pace <= 0)
+		return;
+
+	deadline = start + timestamp / replay->pace;
+	ts.tv_sec = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static int udrm_bench_replay(struct udrm_bench *bench)
+{
+	struct udrm_bench_replay *replay = bench->replay;
+	struct udrm_local *local = udrm_local_get(&bench->udev);
+	const struct udrm_record_entry *entry;
+	size_t pos = sizeof(*replay->header);
+	const struct udrm_event *ev;
+	const void *data;
+	u64 start;
+	int ret;
+
+	start = ktime_get_ns();
+
+	while (pos + sizeof(*entry) <= replay->size) {
+		entry = replay->data + pos;
+		pos += sizeof(*entry) + entry->event_len + entry->data_len;
+		if (pos > replay->size)
+			break;
+
+		ev = (const void *)(entry + 1);
+		data = (const void *)ev + entry->event_len;
+
+		udrm_bench_replay_wait(replay, start, entry->timestamp_ns);
+
+		switch (ev->type) {
+		case UDRM_EVENT_PIPE_ENABLE:
+			ret = udrm_bench_sample(bench, udrm_local_pipe_enable(local));
+			break;
+		case UDRM_EVENT_PIPE_DISABLE:
+			ret = udrm_bench_sample(bench, udrm_local_pipe_disable(local));
+			break;
+		case UDRM_EVENT_FB_CREATE:
+			if (entry->data_len < sizeof(struct udrm_record_fb))
+				ret = -EINVAL;
+			else
+				ret = udrm_bench_replay_create(bench, ((const struct udrm_event_fb *)ev)->fb_id, data);
+			break;
+		case UDRM_EVENT_FB_DESTROY:
+			ret = udrm_bench_replay_fb(bench, ((const struct udrm_event_fb *)ev)->fb_id);
+			if (ret > 0)
+				ret = udrm_bench_sample(bench, udrm_local_fb_destroy(local, ret));
+			break;
+		case UDRM_EVENT_FB_DIRTY:
+			ret = udrm_bench_replay_dirty(bench, (const void *)ev, data, entry->data_len);
+			break;
+		default:
+			ret = -ENOSYS;
+			break;
+		}
+
+		/* events that failed when recorded are expected to fail again */
+		if (ret < 0 && !entry->event_ret) {
+			pr_err("Replaying event %u failed: %d\n", ev->type, ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Plays the compositor, runs in its own thread like the kernel would */
+static void *udrm_bench_generator(void *data)
+{
+	struct udrm_bench *bench = data;
+
+	if (bench->replay)
+		bench->ret = udrm_bench_replay(bench);
+	else
+		bench->ret = udrm_bench_generate(bench);
+
+	udrm_local_close(udrm_local_get(&bench->udev));
+
+	return NULL;
+}
+
+static int udrm_bench_cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* @values must be sorted */
+static u64 udrm_bench_percentile(const u64 *values, unsigned int num, unsigned int pct)
+{
+	if (!num)
+		return 0;
+
+	return values[(num - 1) * pct / 100] / NSEC_PER_USEC;
+}
+
+static void udrm_bench_print_latency(const char *name, u64 *values, unsigned int num)
+{
+	qsort(values, num, sizeof(*values), udrm_bench_cmp_u64);
+
+	printf("%s: events=%u, p50=%lluus, p90=%lluus, p99=%lluus, max=%lluus\n", name, num,
+	       (unsigned long long)udrm_bench_percentile(values, num, 50),
+	       (unsigned long long)udrm_bench_percentile(values, num, 90),
+	       (unsigned long long)udrm_bench_percentile(values, num, 99),
+	       (unsigned long long)udrm_bench_percentile(values, num, 100));
+}
+
+/* The conversion kernels are timed on 32k pixels, 64kB of RGB565, lines of 256 pixels (-K) */
+#define UDRM_BENCH_KERNEL_CHUNK		(64 * 1024)
+#define UDRM_BENCH_KERNEL_WIDTH		256
+#define UDRM_BENCH_KERNEL_LINES		(UDRM_BENCH_KERNEL_CHUNK / 2 / UDRM_BENCH_KERNEL_WIDTH)
+
+enum udrm_bench_kernel {
+	UDRM_BENCH_KERNEL_SWAB16,
+	UDRM_BENCH_KERNEL_RGB565,
+	UDRM_BENCH_KERNEL_ORDERED,
+	UDRM_BENCH_KERNEL_FS,
+	UDRM_BENCH_KERNEL_RGB666,
+	UDRM_BENCH_NUM_KERNELS,
+};
+
+static const char * const udrm_bench_kernel_names[UDRM_BENCH_NUM_KERNELS] = {
+	[UDRM_BENCH_KERNEL_SWAB16] = "swab16",
+	[UDRM_BENCH_KERNEL_RGB565] = "xrgb8888_to_rgb565",
+	[UDRM_BENCH_KERNEL_ORDERED] = "xrgb8888_to_rgb565 ordered",
+	[UDRM_BENCH_KERNEL_FS] = "xrgb8888_to_rgb565 floyd-steinberg",
+	[UDRM_BENCH_KERNEL_RGB666] = "xrgb8888_to_rgb666",
+};
+
+/* Output bytes per pixel */
+static unsigned int udrm_bench_kernel_cpp(enum udrm_bench_kernel kernel)
+{
+	return kernel == UDRM_BENCH_KERNEL_RGB666 ? 3 : 2;
+}
+
+/* Timestamp counter ticks, close to cycles on current x86 */
+static u64 udrm_bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void udrm_bench_kernel_chunk(const struct convert_funcs *funcs, enum udrm_bench_kernel kernel,
+				    void *dst, const u32 *src, s16 *err)
+{
+	unsigned int y;
+
+	memset(err, 0, UDRM_BENCH_KERNEL_WIDTH * 4 * sizeof(*err));
+
+	for (y = 0; y < UDRM_BENCH_KERNEL_LINES; y++) {
+		switch (kernel) {
+		case UDRM_BENCH_KERNEL_SWAB16:
+			funcs->swab16_buf(dst, (const u16 *)src, UDRM_BENCH_KERNEL_WIDTH);
+			break;
+		case UDRM_BENCH_KERNEL_RGB565:
+			funcs->xrgb8888_to_rgb565(dst, src, UDRM_BENCH_KERNEL_WIDTH, true);
+			break;
+		case UDRM_BENCH_KERNEL_ORDERED:
+			funcs->xrgb8888_to_rgb565_ordered(dst, src, UDRM_BENCH_KERNEL_WIDTH, true, 0, y);
+			break;
+		case UDRM_BENCH_KERNEL_FS:
+			funcs->xrgb8888_to_rgb565_fs(dst, src, UDRM_BENCH_KERNEL_WIDTH, true, err);
+			break;
+		case UDRM_BENCH_KERNEL_RGB666:
+			funcs->xrgb8888_to_rgb666(dst, src, UDRM_BENCH_KERNEL_WIDTH);
+			break;
+		default:
+			break;
+		}
+		dst += UDRM_BENCH_KERNEL_WIDTH * udrm_bench_kernel_cpp(kernel);
+		src += UDRM_BENCH_KERNEL_WIDTH;
+	}
+}
+
+/* Software rotation is timed on full frames the size of the mi0283qt panel (-K) */
+#define UDRM_BENCH_ROTATE_WIDTH		320
+#define UDRM_BENCH_ROTATE_HEIGHT	240
+
+/* Rotate full XRGB8888 and RGB565 frames to each angle */
+static int udrm_bench_rotations(unsigned int iterations)
+{
+	const size_t pixels = UDRM_BENCH_ROTATE_WIDTH * UDRM_BENCH_ROTATE_HEIGHT;
+	const struct convert_funcs *funcs[2];
+	struct convert_transform t;
+	unsigned int i, j, rotation, cpp;
+	unsigned int width, height;
+	u64 start, cycles, elapsed;
+	void *dst[2];
+	u32 *src;
+
+	src = aligned_alloc(64, pixels * 4);
+	dst[0] = aligned_alloc(64, pixels * 4);
+	dst[1] = aligned_alloc(64, pixels * 4);
+	if (!src || !dst[0] || !dst[1])
+		return -ENOMEM;
+
+	for (i = 0; i < pixels; i++)
+		src[i] = rand();
+
+	convert_set_simd(false);
+	funcs[0] = convert_get();
+	convert_set_simd(true);
+	funcs[1] = convert_get();
+
+	for (cpp = 4; cpp >= 2; cpp -= 2) {
+		for (rotation = 0; rotation < 360; rotation += 90) {
+			convert_transform_init(&t, rotation, false, false);
+			/* the framebuffer is turned, the panel keeps its size */
+			width = t.swap_xy ? UDRM_BENCH_ROTATE_HEIGHT : UDRM_BENCH_ROTATE_WIDTH;
+			height = t.swap_xy ? UDRM_BENCH_ROTATE_WIDTH : UDRM_BENCH_ROTATE_HEIGHT;
+
+			for (j = 0; j < 2; j++) {
+				convert_set_simd(j);
+				start = ktime_get_ns();
+				cycles = udrm_bench_cycles();
+				for (i = 0; i < iterations; i++)
+					convert_transform_lines(&t, dst[j], src, width * cpp, cpp, width, height, 0, 0,
+								UDRM_BENCH_ROTATE_WIDTH, UDRM_BENCH_ROTATE_HEIGHT);
+				cycles = udrm_bench_cycles() - cycles;
+				elapsed = ktime_get_ns() - start ? : 1;
+
+				printf("rotate %s %u: %s: %llu us/frame, %llu MB/s, %llu.%02llu cycles/pixel%s\n",
+				       cpp == 4 ? "xrgb8888" : "rgb565", rotation, funcs[j]->name,
+				       (unsigned long long)(elapsed / iterations / 1000),
+				       (unsigned long long)((u64)pixels * cpp * iterations * 1000 / elapsed),
+				       (unsigned long long)(cycles / iterations / pixels),
+				       (unsigned long long)(cycles * 100 / iterations / pixels % 100),
+				       memcmp(dst[0], dst[j], pixels * cpp) ? ", MISMATCH" : "");
+			}
+		}
+	}
+
+	free(dst[1]);
+	free(dst[0]);
+	free(src);
+
+	return 0;
+}
+
+/* Region operations are timed on batches of random clips the size of a dirty event (-K) */
+#define UDRM_BENCH_REGION_RECTS		1024
+#define UDRM_BENCH_REGION_BATCH		16
+#define UDRM_BENCH_REGION_MAX_SIZE	64
+
+enum udrm_bench_region_op {
+	UDRM_BENCH_REGION_UNION,
+	UDRM_BENCH_REGION_SUBTRACT,
+	UDRM_BENCH_REGION_SIMPLIFY,
+	UDRM_BENCH_NUM_REGION_OPS,
+};
+
+static const char * const udrm_bench_region_op_names[UDRM_BENCH_NUM_REGION_OPS] = {
+	[UDRM_BENCH_REGION_UNION] = "union",
+	[UDRM_BENCH_REGION_SUBTRACT] = "subtract",
+	[UDRM_BENCH_REGION_SIMPLIFY] = "simplify",
+};
+
+/*
+ * Time one batch: the clips are added to an empty region, taken out of a
+ * full frame, or added up front and the result simplified to what a
+ * batched flush is allowed. Only the operation itself is timed.
+ */
+static int udrm_bench_region_batch(enum udrm_bench_region_op op, const struct drm_clip_rect *clips,
+				   u64 *elapsed, unsigned long *rects_out)
+{
+	struct drm_clip_rect full = {
+		.x2 = UDRM_BENCH_ROTATE_WIDTH,
+		.y2 = UDRM_BENCH_ROTATE_HEIGHT,
+	};
+	struct region reg, clip;
+	unsigned int i;
+	u64 start;
+	int ret = 0;
+
+	if (op == UDRM_BENCH_REGION_SUBTRACT)
+		region_init_rect(&reg, &full);
+	else
+		region_init(&reg);
+
+	if (op == UDRM_BENCH_REGION_SIMPLIFY) {
+		for (i = 0; i < UDRM_BENCH_REGION_BATCH && !ret; i++)
+			ret = region_union_rect(&reg, &reg, &clips[i]);
+	}
+
+	start = ktime_get_ns();
+	switch (op) {
+	case UDRM_BENCH_REGION_UNION:
+		for (i = 0; i < UDRM_BENCH_REGION_BATCH && !ret; i++)
+			ret = region_union_rect(&reg, &reg, &clips[i]);
+		break;
+	case UDRM_BENCH_REGION_SUBTRACT:
+		for (i = 0; i < UDRM_BENCH_REGION_BATCH && !ret; i++) {
+			region_init_rect(&clip, &clips[i]);
+			ret = region_subtract(&reg, &reg, &clip);
+		}
+		break;
+	case UDRM_BENCH_REGION_SIMPLIFY:
+		if (!ret)
+			ret = region_simplify(&reg, UDRM_DAMAGE_MAX_RECTS);
+		break;
+	default:
+		break;
+	}
+	*elapsed += ktime_get_ns() - start;
+	*rects_out += reg.num_rects;
+
+	region_fini(&reg);
+
+	return ret;
+}
+
+/* Union, subtract and simplify on clips scattered over the mi0283qt panel */
+static int udrm_bench_regions(unsigned int iterations)
+{
+	struct drm_clip_rect *clips;
+	enum udrm_bench_region_op op;
+	unsigned long rects_out;
+	u64 elapsed;
+	unsigned int i;
+	int ret;
+
+	clips = calloc(UDRM_BENCH_REGION_RECTS, sizeof(*clips));
+	if (!clips)
+		return -ENOMEM;
+
+	srand(1);
+	for (i = 0; i < UDRM_BENCH_REGION_RECTS; i++) {
+		clips[i].x1 = rand() % (UDRM_BENCH_ROTATE_WIDTH - UDRM_BENCH_REGION_MAX_SIZE);
+		clips[i].y1 = rand() % (UDRM_BENCH_ROTATE_HEIGHT - UDRM_BENCH_REGION_MAX_SIZE);
+		clips[i].x2 = clips[i].x1 + 1 + rand() % UDRM_BENCH_REGION_MAX_SIZE;
+		clips[i].y2 = clips[i].y1 + 1 + rand() % UDRM_BENCH_REGION_MAX_SIZE;
+	}
+
+	for (op = 0; op < UDRM_BENCH_NUM_REGION_OPS; op++) {
+		elapsed = 0;
+		rects_out = 0;
+		for (i = 0; i < iterations; i++) {
+			ret = udrm_bench_region_batch(op, clips + (i * UDRM_BENCH_REGION_BATCH) % UDRM_BENCH_REGION_RECTS,
+						      &elapsed, &rects_out);
+			if (ret) {
+				free(clips);
+				return ret;
+			}
+		}
+		elapsed = elapsed ? : 1;
+
+		printf("region %s: %u clips/batch: %llu ns/batch, %llu clips/s, %lu rects out\n",
+		       udrm_bench_region_op_names[op], UDRM_BENCH_REGION_BATCH,
+		       (unsigned long long)(elapsed / iterations),
+		       (unsigned long long)((u64)UDRM_BENCH_REGION_BATCH * iterations * NSEC_PER_SEC / elapsed),
+		       rects_out / iterations);
+	}
+
+	free(clips);
+
+	return 0;
+}
+
+/*
+ * -G draws up to UDRM_BENCH_REGION_CHECK_RECTS rectangles in a small square
+ * and moves regions by up to UDRM_BENCH_REGION_CHECK_SHIFT, both ways so
+ * clamping at zero is covered.
+ */
+#define UDRM_BENCH_REGION_CHECK_SIZE	64
+#define UDRM_BENCH_REGION_CHECK_SHIFT	24
+#define UDRM_BENCH_REGION_CHECK_PIXELS	(UDRM_BENCH_REGION_CHECK_SIZE + UDRM_BENCH_REGION_CHECK_SHIFT)
+#define UDRM_BENCH_REGION_CHECK_RECTS	8
+#define UDRM_BENCH_REGION_CHECK_MAX	4
+
+enum udrm_bench_region_check {
+	UDRM_BENCH_CHECK_UNION,
+	UDRM_BENCH_CHECK_INTERSECT,
+	UDRM_BENCH_CHECK_SUBTRACT,
+	UDRM_BENCH_CHECK_TRANSLATE,
+	UDRM_BENCH_CHECK_SIMPLIFY,
+	UDRM_BENCH_NUM_CHECKS,
+};
+
+static const char * const udrm_bench_region_check_names[UDRM_BENCH_NUM_CHECKS] = {
+	[UDRM_BENCH_CHECK_UNION] = "union",
+	[UDRM_BENCH_CHECK_INTERSECT] = "intersect",
+	[UDRM_BENCH_CHECK_SUBTRACT] = "subtract",
+	[UDRM_BENCH_CHECK_TRANSLATE] = "translate",
+	[UDRM_BENCH_CHECK_SIMPLIFY] = "simplify",
+};
+
+/* A region the slow way, one flag per pixel */
+struct udrm_bench_pixels {
+	bool px[UDRM_BENCH_REGION_CHECK_PIXELS][UDRM_BENCH_REGION_CHECK_PIXELS];
+};
+
+static void udrm_bench_pixels_fill(struct udrm_bench_pixels *pix, const struct drm_clip_rect *rect)
+{
+	unsigned int x, y;
+
+	for (y = rect->y1; y < rect->y2; y++)
+		for (x = rect->x1; x < rect->x2; x++)
+			pix->px[y][x] = true;
+}
+
+static void udrm_bench_pixels_from_region(struct udrm_bench_pixels *pix, const struct region *reg)
+{
+	const struct drm_clip_rect *rect;
+
+	memset(pix, 0, sizeof(*pix));
+	region_for_each_rect(reg, rect)
+		udrm_bench_pixels_fill(pix, rect);
+}
+
+static int udrm_bench_region_random(struct region *reg, struct udrm_bench_pixels *pix)
+{
+	struct drm_clip_rect rect;
+	unsigned int i, n;
+	int ret = 0;
+
+	region_init(reg);
+	memset(pix, 0, sizeof(*pix));
+
+	n = rand() % (UDRM_BENCH_REGION_CHECK_RECTS + 1);
+	for (i = 0; i < n && !ret; i++) {
+		rect.x1 = rand() % UDRM_BENCH_REGION_CHECK_SIZE;
+		rect.y1 = rand() % UDRM_BENCH_REGION_CHECK_SIZE;
+		rect.x2 = rect.x1 + 1 + rand() % (UDRM_BENCH_REGION_CHECK_SIZE - rect.x1);
+		rect.y2 = rect.y1 + 1 + rand() % (UDRM_BENCH_REGION_CHECK_SIZE - rect.y1);
+		udrm_bench_pixels_fill(pix, &rect);
+		ret = region_union_rect(reg, reg, &rect);
+	}
+
+	return ret;
+}
+
+/*
+ * What's wrong with the banded form documented for struct region, NULL if
+ * nothing is: empty rectangles, ragged or overlapping bands, spans out of
+ * order or touching, adjacent bands with the same spans or wrong extents.
+ */
+static const char *udrm_bench_region_invalid(const struct region *reg)
+{
+	const struct drm_clip_rect *rects = reg->rects;
+	unsigned int i, j, band = 0, prev_band = 0, prev_len = 0;
+	struct drm_clip_rect extents = { 0 };
+
+	for (i = 0; i < reg->num_rects; i++) {
+		if (rects[i].x1 >= rects[i].x2 || rects[i].y1 >= rects[i].y2)
+			return "empty rectangle";
+
+		if (i && rects[i].y1 == rects[i - 1].y1) {
+			if (rects[i].y2 != rects[i - 1].y2)
+				return "ragged band";
+			if (rects[i].x1 <= rects[i - 1].x2)
+				return "spans out of order or touching";
+		} else if (i) {
+			if (rects[i].y1 < rects[i - 1].y2)
+				return "bands out of order or overlapping";
+
+			/* The band before this one is complete */
+			if (prev_len == i - band && rects[prev_band].y2 == rects[band].y1) {
+				for (j = 0; j < prev_len; j++) {
+					if (rects[prev_band + j].x1 != rects[band + j].x1 ||
+					    rects[prev_band + j].x2 != rects[band + j].x2)
+						break;
+				}
+				if (j == prev_len)
+					return "bands not coalesced";
+			}
+			prev_band = band;
+			prev_len = i - band;
+			band = i;
+		}
+
+		if (!i) {
+			extents = rects[i];
+		} else {
+			extents.x1 = min(extents.x1, rects[i].x1);
+			extents.x2 = max(extents.x2, rects[i].x2);
+			extents.y2 = rects[i].y2;
+		}
+	}
+
+	if (reg->num_rects && prev_len == reg->num_rects - band &&
+	    rects[prev_band].y2 == rects[band].y1) {
+		for (j = 0; j < prev_len; j++) {
+			if (rects[prev_band + j].x1 != rects[band + j].x1 ||
+			    rects[prev_band + j].x2 != rects[band + j].x2)
+				break;
+		}
+		if (j == prev_len)
+			return "bands not coalesced";
+	}
+
+	if (memcmp(&extents, &reg->extents, sizeof(extents)))
+		return "wrong extents";
+
+	return NULL;
+}
+
+/*
+ * Run one operation on random regions, in place, and compare the result
+ * with the same operation done pixel by pixel. Simplify only has to cover
+ * the pixels it was given with no more than the rectangles it was allowed.
+ */
+static int udrm_bench_region_check_one(enum udrm_bench_region_check check, bool *failed)
+{
+	static struct udrm_bench_pixels pa, pb, ref, res;
+	unsigned int x, y, max_rects = 0;
+	struct region a, b;
+	const char *invalid;
+	int dx = 0, dy = 0;
+	bool bad = false;
+	int ret;
+
+	ret = udrm_bench_region_random(&a, &pa);
+	if (!ret)
+		ret = udrm_bench_region_random(&b, &pb);
+	if (ret)
+		goto out_fini;
+
+	switch (check) {
+	case UDRM_BENCH_CHECK_UNION:
+		ret = region_union(&a, &a, &b);
+		break;
+	case UDRM_BENCH_CHECK_INTERSECT:
+		ret = region_intersect(&a, &a, &b);
+		break;
+	case UDRM_BENCH_CHECK_SUBTRACT:
+		ret = region_subtract(&a, &a, &b);
+		break;
+	case UDRM_BENCH_CHECK_TRANSLATE:
+		dx = rand() % (2 * UDRM_BENCH_REGION_CHECK_SHIFT + 1) - UDRM_BENCH_REGION_CHECK_SHIFT;
+		dy = rand() % (2 * UDRM_BENCH_REGION_CHECK_SHIFT + 1) - UDRM_BENCH_REGION_CHECK_SHIFT;
+		region_translate(&a, dx, dy);
+		break;
+	case UDRM_BENCH_CHECK_SIMPLIFY:
+		max_rects = 1 + rand() % UDRM_BENCH_REGION_CHECK_MAX;
+		ret = region_simplify(&a, max_rects);
+		bad = a.num_rects > max_rects;
+		break;
+	default:
+		break;
+	}
+	if (ret)
+		goto out_fini;
+
+	memset(&ref, 0, sizeof(ref));
+	for (y = 0; y < UDRM_BENCH_REGION_CHECK_PIXELS; y++) {
+		for (x = 0; x < UDRM_BENCH_REGION_CHECK_PIXELS; x++) {
+			switch (check) {
+			case UDRM_BENCH_CHECK_UNION:
+				ref.px[y][x] = pa.px[y][x] || pb.px[y][x];
+				break;
+			case UDRM_BENCH_CHECK_INTERSECT:
+				ref.px[y][x] = pa.px[y][x] && pb.px[y][x];
+				break;
+			case UDRM_BENCH_CHECK_SUBTRACT:
+				ref.px[y][x] = pa.px[y][x] && !pb.px[y][x];
+				break;
+			case UDRM_BENCH_CHECK_TRANSLATE:
+				if ((int)x - dx >= 0 && (int)x - dx < UDRM_BENCH_REGION_CHECK_PIXELS &&
+				    (int)y - dy >= 0 && (int)y - dy < UDRM_BENCH_REGION_CHECK_PIXELS)
+					ref.px[y][x] = pa.px[y - dy][x - dx];
+				break;
+			default:
+				ref.px[y][x] = pa.px[y][x];
+				break;
+			}
+		}
+	}
+
+	udrm_bench_pixels_from_region(&res, &a);
+	for (y = 0; y < UDRM_BENCH_REGION_CHECK_PIXELS; y++) {
+		for (x = 0; x < UDRM_BENCH_REGION_CHECK_PIXELS; x++) {
+			if (check == UDRM_BENCH_CHECK_SIMPLIFY)
+				bad |= ref.px[y][x] && !res.px[y][x];
+			else
+				bad |= ref.px[y][x] != res.px[y][x];
+		}
+	}
+
+	invalid = udrm_bench_region_invalid(&a);
+	if (invalid || bad) {
+		pr_err("region check %s: %s, %u rects\n", udrm_bench_region_check_names[check],
+		       invalid ? : "wrong pixels", a.num_rects);
+		*failed = true;
+	}
+
+out_fini:
+	region_fini(&a);
+	region_fini(&b);
+
+	return ret;
+}
+
+/* Check the region operations against a per-pixel reference */
+static int udrm_bench_region_check(unsigned int iterations)
+{
+	enum udrm_bench_region_check check;
+	unsigned int i, failed, total = 0;
+	bool bad;
+	int ret;
+
+	srand(1);
+	for (check = 0; check < UDRM_BENCH_NUM_CHECKS; check++) {
+		failed = 0;
+		for (i = 0; i < iterations; i++) {
+			bad = false;
+			ret = udrm_bench_region_check_one(check, &bad);
+			if (ret)
+				return ret;
+			failed += bad;
+		}
+
+		printf("region check %s: runs=%u, failed=%u\n", udrm_bench_region_check_names[check],
+		       iterations, failed);
+		total += failed;
+	}
+
+	return total ? -EIO : 0;
+}
+
+/*
+ * Time the byte swapping, conversion and dithering kernels, the scalar
+ * versions against the ones the CPU gets, the software rotation and the
+ * region operations.
+ */
+static int udrm_bench_kernels(unsigned int iterations)
+{
+	const struct convert_funcs *funcs[2];
+	enum udrm_bench_kernel kernel;
+	u64 start, cycles, elapsed;
+	unsigned int i, j;
+	size_t bytes;
+	void *dst[2];
+	s16 *err;
+	u32 *src;
+	int ret;
+
+	src = aligned_alloc(64, UDRM_BENCH_KERNEL_CHUNK * 2);
+	/* RGB666 is 3 bytes per pixel */
+	dst[0] = aligned_alloc(64, UDRM_BENCH_KERNEL_CHUNK / 2 * 3);
+	dst[1] = aligned_alloc(64, UDRM_BENCH_KERNEL_CHUNK / 2 * 3);
+	err = calloc(UDRM_BENCH_KERNEL_WIDTH * 4, sizeof(*err));
+	if (!src || !dst[0] || !dst[1] || !err)
+		return -ENOMEM;
+
+	for (i = 0; i < UDRM_BENCH_KERNEL_CHUNK / 2; i++)
+		src[i] = rand();
+
+	convert_set_simd(false);
+	funcs[0] = convert_get();
+	convert_set_simd(true);
+	funcs[1] = convert_get();
+
+	for (kernel = 0; kernel < UDRM_BENCH_NUM_KERNELS; kernel++) {
+		bytes = UDRM_BENCH_KERNEL_CHUNK / 2 * udrm_bench_kernel_cpp(kernel);
+		for (j = 0; j < 2; j++) {
+			start = ktime_get_ns();
+			cycles = udrm_bench_cycles();
+			for (i = 0; i < iterations; i++)
+				udrm_bench_kernel_chunk(funcs[j], kernel, dst[j], src, err);
+			cycles = udrm_bench_cycles() - cycles;
+			elapsed = ktime_get_ns() - start ? : 1;
+
+			printf("%s: %s: %llu ns/chunk, %llu MB/s, %llu.%02llu cycles/pixel%s\n",
+			       udrm_bench_kernel_names[kernel], funcs[j]->name,
+			       (unsigned long long)(elapsed / iterations),
+			       (unsigned long long)((u64)bytes * iterations * 1000 / elapsed),
+			       (unsigned long long)(cycles / iterations / (UDRM_BENCH_KERNEL_CHUNK / 2)),
+			       (unsigned long long)(cycles * 100 / iterations / (UDRM_BENCH_KERNEL_CHUNK / 2) % 100),
+			       memcmp(dst[0], dst[j], bytes) ? ", MISMATCH" : "");
+		}
+	}
+
+	free(err);
+	free(dst[1]);
+	free(dst[0]);
+	free(src);
+
+	ret = udrm_bench_rotations(iterations);
+	if (ret)
+		return ret;
+
+	return udrm_bench_regions(iterations);
+}
+
+/* Damage patterns for -m, on a 320x240 display and scaled to the display size */
+#define UDRM_BENCH_PATTERN_WIDTH	320
+#define UDRM_BENCH_PATTERN_HEIGHT	240
+#define UDRM_BENCH_PATTERN_MAX_CLIPS	12
+
+struct udrm_bench_pattern {
+	const char *name;
+	unsigned int num_clips;
+	struct drm_clip_rect clips[UDRM_BENCH_PATTERN_MAX_CLIPS];
+};
+
+static const struct udrm_bench_pattern udrm_bench_patterns[] = {
+	{ "cursor", 1, {
+		{ 152, 112, 168, 128 } } },
+	{ "two cursors", 2, {
+		{ 8, 8, 24, 24 }, { 296, 216, 312, 232 } } },
+	{ "status bar and clock", 2, {
+		{ 0, 0, 320, 12 }, { 260, 200, 316, 224 } } },
+	{ "text lines", 8, {
+		{ 16, 40, 216, 50 }, { 16, 54, 216, 64 }, { 16, 68, 216, 78 }, { 16, 82, 216, 92 },
+		{ 16, 96, 216, 106 }, { 16, 110, 216, 120 }, { 16, 124, 216, 134 }, { 16, 138, 216, 148 } } },
+	{ "words", 8, {
+		{ 16, 40, 56, 50 }, { 60, 40, 100, 50 }, { 106, 40, 130, 50 }, { 136, 40, 190, 50 },
+		{ 16, 54, 40, 64 }, { 46, 54, 110, 64 }, { 116, 54, 150, 64 }, { 156, 54, 176, 64 } } },
+	{ "scattered", 12, {
+		{ 30, 30, 38, 38 }, { 110, 30, 118, 38 }, { 190, 30, 198, 38 }, { 270, 30, 278, 38 },
+		{ 30, 110, 38, 118 }, { 110, 110, 118, 118 }, { 190, 110, 198, 118 }, { 270, 110, 278, 118 },
+		{ 30, 190, 38, 198 }, { 110, 190, 118, 198 }, { 190, 190, 198, 198 }, { 270, 190, 278, 198 } } },
+	{ "diagonal", 8, {
+		{ 0, 0, 32, 16 }, { 36, 28, 68, 44 }, { 72, 56, 104, 72 }, { 108, 84, 140, 100 },
+		{ 144, 112, 176, 128 }, { 180, 140, 212, 156 }, { 216, 168, 248, 184 }, { 252, 196, 284, 212 } } },
+	{ "side bars", 2, {
+		{ 0, 0, 20, 240 }, { 300, 0, 320, 240 } } },
+	{ "overlapping windows", 2, {
+		{ 40, 40, 200, 160 }, { 120, 100, 280, 220 } } },
+	{ "full frame", 1, {
+		{ 0, 0, 320, 240 } } },
+};
+
+static const struct udrm_bench_pattern *udrm_bench_pattern_find(const char *name)
+{
+	const struct udrm_bench_pattern *pattern;
+
+	for (pattern = udrm_bench_patterns; pattern < udrm_bench_patterns + ARRAY_SIZE(udrm_bench_patterns); pattern++)
+		if (!strcmp(pattern->name, name))
+			return pattern;
+
+	return NULL;
+}
+
+/*
+ * The pattern clips scaled to the display in @clips, and as a region like
+ * dirtyfb makes of them
+ */
+static int udrm_bench_pattern_region(const struct udrm_bench_pattern *pattern, struct drm_clip_rect *clips,
+				     struct region *damage, unsigned int width, unsigned int height)
+{
+	unsigned int i;
+	int ret = 0;
+
+	region_init(damage);
+	for (i = 0; i < pattern->num_clips && !ret; i++) {
+		clips[i].x1 = pattern->clips[i].x1 * width / UDRM_BENCH_PATTERN_WIDTH;
+		clips[i].x2 = pattern->clips[i].x2 * width / UDRM_BENCH_PATTERN_WIDTH;
+		clips[i].y1 = pattern->clips[i].y1 * height / UDRM_BENCH_PATTERN_HEIGHT;
+		clips[i].y2 = pattern->clips[i].y2 * height / UDRM_BENCH_PATTERN_HEIGHT;
+		ret = region_union_rect(damage, damage, &clips[i]);
+	}
+
+	return ret;
+}
+
+enum udrm_bench_merge {
+	UDRM_BENCH_MERGE_NONE,
+	UDRM_BENCH_MERGE_BOUNDING_BOX,
+	UDRM_BENCH_MERGE_COST_MODEL,
+	UDRM_BENCH_NUM_MERGES,
+};
+
+static const char * const udrm_bench_merge_names[UDRM_BENCH_NUM_MERGES] = {
+	[UDRM_BENCH_MERGE_NONE] = "separate",
+	[UDRM_BENCH_MERGE_BOUNDING_BOX] = "bounding box",
+	[UDRM_BENCH_MERGE_COST_MODEL] = "cost model",
+};
+
+/*
+ * Run the damage patterns through the flush cost model and print what each
+ * way of grouping the rectangles into address windows puts on the wire:
+ * every rectangle its own window, their bounding box, or what
+ * mipi_dbi_merge_clips() picks.
+ */
+static int udrm_bench_merge(unsigned int width, unsigned int height, u32 speed_hz,
+			    const struct udrm_bench_pattern *only)
+{
+	struct drm_clip_rect clips[UDRM_BENCH_PATTERN_MAX_CLIPS], *windows;
+	const struct udrm_bench_pattern *pattern;
+	enum udrm_bench_merge merge;
+	struct mipi_dbi_cost cost;
+	unsigned int i, num_windows;
+	struct region damage;
+	size_t bytes;
+	u64 ns;
+	int ret;
+
+	mipi_dbi_cost_init(&cost, speed_hz);
+	printf("RGB565 at %uMHz, %llu ns per command\n", (speed_hz ? : 32000000) / 1000000,
+	       (unsigned long long)cost.cmd_ns);
+
+	for (pattern = udrm_bench_patterns; pattern < udrm_bench_patterns + ARRAY_SIZE(udrm_bench_patterns); pattern++) {
+		if (only && pattern != only)
+			continue;
+
+		ret = udrm_bench_pattern_region(pattern, clips, &damage, width, height);
+		windows = calloc(damage.num_rects, sizeof(*windows));
+		if (ret || !windows) {
+			region_fini(&damage);
+			return ret ? : -ENOMEM;
+		}
+
+		for (merge = 0; merge < UDRM_BENCH_NUM_MERGES; merge++) {
+			memcpy(windows, damage.rects, damage.num_rects * sizeof(*windows));
+			num_windows = damage.num_rects;
+			if (merge == UDRM_BENCH_MERGE_BOUNDING_BOX) {
+				windows[0] = *region_extents(&damage);
+				num_windows = 1;
+			} else if (merge == UDRM_BENCH_MERGE_COST_MODEL) {
+				num_windows = mipi_dbi_merge_clips(&cost, windows, num_windows);
+			}
+
+			bytes = 0;
+			ns = 0;
+			for (i = 0; i < num_windows; i++) {
+				bytes += MIPI_DBI_WINDOW_CMD_BYTES + region_area(&windows[i]) * cost.cpp;
+				ns += mipi_dbi_window_cost(&cost, &windows[i]);
+			}
+
+			printf("%s: %s: clips=%u, rects=%u, windows=%u, commands=%u, bytes=%zu, estimate=%lluus\n",
+			       pattern->name, udrm_bench_merge_names[merge], pattern->num_clips, damage.num_rects,
+			       num_windows, num_windows * MIPI_DBI_WINDOW_CMDS, bytes,
+			       (unsigned long long)(ns / NSEC_PER_USEC));
+		}
+
+		free(windows);
+		region_fini(&damage);
+	}
+
+	return 0;
+}
+
+/* The TE signal of the -D panels, fast enough for the bands not to hold things up */
+#define UDRM_BENCH_DBI_TE_HZ		200
+
+/**
+ * struct udrm_bench_dbi_case - Panel setup for -D
+ * @name: Name
+ * @format: Framebuffer format
+ * @rotation: Rotation, done in software
+ * @big_endian: The controller takes RGB565 big endian
+ * @bpw16: The SPI controller can send 16 bits per word
+ * @pad: Bytes added to the framebuffer pitch
+ * @wire_format: wire-format property (optional)
+ * @te: Tearing effect signal from a mock gpio
+ * @preempt: Flushes can be preempted, the windows are sent in slices
+ * @pipe_bufs: pipeline-buffers property
+ */
+struct udrm_bench_dbi_case {
+	const char *name;
+	u32 format;
+	unsigned int rotation;
+	bool big_endian;
+	bool bpw16;
+	unsigned int pad;
+	const char *wire_format;
+	bool te;
+	bool preempt;
+	u32 pipe_bufs;
+};
+
+static const struct udrm_bench_dbi_case udrm_bench_dbi_cases[] = {
+	{ .name = "rgb565", .format = DRM_FORMAT_RGB565 },
+	{ .name = "rgb565 padded pitch", .format = DRM_FORMAT_RGB565, .pad = 64 },
+	{ .name = "rgb565 big endian", .format = DRM_FORMAT_RGB565, .big_endian = true },
+	{ .name = "rgb565 big endian 16-bit spi", .format = DRM_FORMAT_RGB565, .big_endian = true, .bpw16 = true },
+	{ .name = "rgb565 big endian padded pitch", .format = DRM_FORMAT_RGB565, .big_endian = true, .pad = 64 },
+	{ .name = "xrgb8888", .format = DRM_FORMAT_XRGB8888 },
+	{ .name = "xrgb8888 rgb666", .format = DRM_FORMAT_XRGB8888, .wire_format = "rgb666" },
+	{ .name = "rgb565 rotate 90", .format = DRM_FORMAT_RGB565, .rotation = 90 },
+	{ .name = "xrgb8888 rotate 180", .format = DRM_FORMAT_XRGB8888, .rotation = 180 },
+	{ .name = "rgb565 big endian rotate 270", .format = DRM_FORMAT_RGB565, .rotation = 270, .big_endian = true },
+	{ .name = "xrgb8888 rgb666 rotate 90", .format = DRM_FORMAT_XRGB8888, .rotation = 90, .wire_format = "rgb666" },
+	{ .name = "rgb565 te", .format = DRM_FORMAT_RGB565, .te = true },
+	{ .name = "rgb565 padded pitch preempt", .format = DRM_FORMAT_RGB565, .pad = 64, .preempt = true },
+	{ .name = "xrgb8888 pipeline 2", .format = DRM_FORMAT_XRGB8888, .pipe_bufs = 2 },
+	{ .name = "xrgb8888 pipeline 4", .format = DRM_FORMAT_XRGB8888, .pipe_bufs = 4 },
+};
+
+/**
+ * struct udrm_bench_dbi - mipi_dbi on the spidev mock
+ * @dev: Device holding the properties of the case
+ * @spi: SPI device, on the mock
+ * @mipi: MIPI DBI controller
+ * @mock: The bus and the controller
+ * @dc: Mock D/C gpio
+ * @ufb: Framebuffer flushed
+ * @vaddr: Mapping of the framebuffer
+ * @damaged: Framebuffer pixels in the damage being checked
+ */
+struct udrm_bench_dbi {
+	struct device dev;
+	struct spi_device spi;
+	struct mipi_dbi mipi;
+	struct spi_mock *mock;
+	struct gpio_desc *dc;
+	struct udrm_framebuffer ufb;
+	void *vaddr;
+	bool *damaged;
+};
+
+enum udrm_bench_dbi_path {
+	UDRM_BENCH_DBI_DIRECT,
+	UDRM_BENCH_DBI_STAGED,
+	UDRM_BENCH_NUM_DBI_PATHS,
+};
+
+static const char * const udrm_bench_dbi_path_names[UDRM_BENCH_NUM_DBI_PATHS] = {
+	[UDRM_BENCH_DBI_DIRECT] = "direct",
+	[UDRM_BENCH_DBI_STAGED] = "staged",
+};
+
+static const struct udrm_funcs udrm_bench_dbi_funcs = {
+	.dirtyfb = mipi_dbi_dirtyfb,
+	.print_stats = mipi_dbi_print_stats,
+};
+
+static int udrm_bench_dbi_init(struct udrm_bench_dbi *dbi, const struct udrm_bench_dbi_case *c, u32 speed_hz)
+{
+	struct drm_mode_modeinfo mode = udrm_bench_mode;
+	struct udrm_framebuffer *ufb = &dbi->ufb;
+	struct mipi_dbi *mipi = &dbi->mipi;
+	struct spi_device *spi = &dbi->spi;
+	struct spi_mock *mock;
+	struct gpio_desc *dc;
+	size_t size, i;
+	int fd, ret;
+
+	dev_set_name(&dbi->dev, "udrm-bench-dbi");
+	device_property_set_bool(&dbi->dev, "dc-mock");
+	device_property_set_bool(&dbi->dev, "prime-import");
+	device_property_set_u32(&dbi->dev, "pipeline-buffers", c->pipe_bufs);
+	if (c->wire_format)
+		device_property_set_string(&dbi->dev, "wire-format", c->wire_format);
+	if (c->te)
+		device_property_set_u32(&dbi->dev, "te-mock-hz", UDRM_BENCH_DBI_TE_HZ);
+
+	dc = gpiod_get(&dbi->dev, "dc", GPIOD_OUT_LOW);
+	if (IS_ERR(dc))
+		return PTR_ERR(dc);
+	dbi->dc = dc;
+
+	/* The limits of the drivers */
+	spi->max_speed_hz = speed_hz ? : 32000000;
+	spi->max_dma_len = 65536 - 4096;
+	spi->bits_per_word_mask = SPI_BPW_MASK(8) | (c->bpw16 ? SPI_BPW_MASK(16) : 0);
+
+	/* The panel is the display before rotation */
+	mock = spi_mock_create(spi, dc, mode.hdisplay, mode.vdisplay);
+	if (IS_ERR(mock))
+		return PTR_ERR(mock);
+	mock->speed_hz = speed_hz;
+	dbi->mock = mock;
+
+	dbi->damaged = calloc((size_t)mode.hdisplay * mode.vdisplay, sizeof(*dbi->damaged));
+	if (!dbi->damaged)
+		return -ENOMEM;
+
+	ret = mipi_dbi_spi_init(spi, mipi, dc, true);
+	if (ret)
+		return ret;
+
+	mipi->little_endian = !c->big_endian;
+	mipi->bus_speed_hz = spi->max_speed_hz;
+	mipi->udev.backend = &udrm_local_backend;
+
+	ret = mipi_dbi_register(&dbi->dev, mipi, "udrm-bench-dbi", &udrm_bench_dbi_funcs, &mode, c->rotation);
+	if (ret)
+		return ret;
+
+	/* Not enabled by the driver, the backlight is left alone */
+	mipi->udev.enabled = true;
+
+	ufb->udev = &mipi->udev;
+	ufb->id = 1;
+	ufb->width = mode.hdisplay;
+	ufb->height = mode.vdisplay;
+	ufb->cpp = c->format == DRM_FORMAT_XRGB8888 ? 4 : 2;
+	ufb->pitch = ufb->width * ufb->cpp + c->pad;
+	ufb->pixel_format = c->format;
+	size = (size_t)ufb->pitch * ufb->height;
+
+	fd = udrm_create_dma_buf(&mipi->udev, size);
+	if (fd < 0)
+		return fd;
+
+	ufb->dmabuf = dma_buf_get(fd);
+	if (IS_ERR(ufb->dmabuf)) {
+		ret = PTR_ERR(ufb->dmabuf);
+		ufb->dmabuf = NULL;
+		close(fd);
+		return ret;
+	}
+
+	dbi->vaddr = dma_buf_vmap(ufb->dmabuf);
+	if (!dbi->vaddr)
+		return -ENOMEM;
+
+	for (i = 0; i < size / 2; i++)
+		((u16 *)dbi->vaddr)[i] = rand();
+
+	return 0;
+}
+
+static void udrm_bench_dbi_fini(struct udrm_bench_dbi *dbi)
+{
+	if (dbi->ufb.udev)
+		mipi_dbi_unregister(&dbi->mipi);
+	if (dbi->ufb.dmabuf)
+		dma_buf_put(dbi->ufb.dmabuf);
+	spi_mock_destroy(dbi->mock);
+	if (dbi->dc)
+		gpiod_put(dbi->dc);
+	free(dbi->damaged);
+}
+
+/*
+ * Count the panel pixels that differ from the framebuffer converted by the
+ * book: each pixel moved by the software transform and put on the wire
+ * format. Pixels outside the damage can be left alone or be sent along when
+ * windows are merged.
+ */
+static unsigned long udrm_bench_dbi_check(struct udrm_bench_dbi *dbi, const struct region *damage)
+{
+	const struct udrm_framebuffer *ufb = &dbi->ufb;
+	struct spi_mock *mock = dbi->mock;
+	struct mipi_dbi *mipi = &dbi->mipi;
+	const struct drm_clip_rect *rect;
+	static const u8 blank[SPI_MOCK_MAX_CPP];
+	u8 expected[SPI_MOCK_MAX_CPP];
+	unsigned long bad = mock->overruns;
+	struct drm_clip_rect pixel;
+	unsigned int x, y;
+	const void *src;
+	bool *damaged;
+	u8 *dst;
+	u16 val;
+
+	damaged = dbi->damaged;
+	memset(damaged, 0, (size_t)ufb->width * ufb->height * sizeof(*damaged));
+	region_for_each_rect(damage, rect)
+		for (y = rect->y1; y < rect->y2; y++)
+			for (x = rect->x1; x < rect->x2; x++)
+				damaged[y * ufb->width + x] = true;
+
+	for (y = 0; y < ufb->height; y++) {
+		for (x = 0; x < ufb->width; x++) {
+			pixel.x1 = x;
+			pixel.y1 = y;
+			pixel.x2 = x + 1;
+			pixel.y2 = y + 1;
+			convert_transform_clip(&mipi->transform, &pixel, ufb->width, ufb->height);
+			dst = spi_mock_pixel(mock, pixel.x1, pixel.y1);
+			src = dbi->vaddr + y * ufb->pitch + x * ufb->cpp;
+
+			memset(expected, 0, sizeof(expected));
+			if (mipi->cost.cpp == 3) {
+				convert_xrgb8888_to_rgb666(expected, src, 1);
+			} else {
+				if (ufb->pixel_format == DRM_FORMAT_XRGB8888)
+					convert_xrgb8888_to_rgb565(&val, src, 1, false);
+				else
+					val = *(const u16 *)src;
+				expected[0] = mipi->swap_bytes ? val >> 8 : val;
+				expected[1] = mipi->swap_bytes ? val : val >> 8;
+			}
+
+			if (!memcmp(dst, expected, sizeof(expected)))
+				continue;
+			if (damaged[y * ufb->width + x] || memcmp(dst, blank, sizeof(blank)))
+				bad++;
+		}
+	}
+
+	return bad;
+}
+
+/**
+ * struct udrm_bench_dbi_stats - What a path put on the bus
+ * @bad: Pixels wrong on the panel
+ * @frames: Flushes
+ * @messages: SPI messages, the ioctls spidev would have seen
+ * @transfers: SPI transfers
+ * @dma_transfers: Transfers sent from the dma-buf
+ * @words16: Transfers sent with 16 bits per word
+ * @bytes: Bytes sent
+ * @bus_ns: Time the bus was busy
+ * @gap_ns: Time between the messages of a run
+ */
+struct udrm_bench_dbi_stats {
+	unsigned long bad;
+	unsigned long frames;
+	unsigned long messages;
+	unsigned long transfers;
+	unsigned long dma_transfers;
+	unsigned long words16;
+	u64 bytes;
+	u64 bus_ns;
+	u64 gap_ns;
+};
+
+static void udrm_bench_dbi_stats_add(struct udrm_bench_dbi_stats *stats, const struct spi_mock *mock,
+				     unsigned int frames)
+{
+	stats->frames += frames;
+	stats->messages += mock->messages;
+	stats->transfers += mock->transfers;
+	stats->dma_transfers += mock->dma_transfers;
+	stats->words16 += mock->words16;
+	stats->bytes += mock->bytes;
+	stats->bus_ns += mock->bus_ns;
+	stats->gap_ns += mock->gap_ns;
+}
+
+static void udrm_bench_dbi_stats_print(const char *name, enum udrm_bench_dbi_path path,
+				       const struct udrm_bench_dbi_stats *stats)
+{
+	unsigned long frames = max(stats->frames, 1UL);
+
+	printf("%s: %s: bad=%lu, frames=%lu, per frame: messages=%lu, transfers=%lu, dma=%lu, bpw16=%lu, bytes=%llu, bus=%lluus, gaps=%lluus\n",
+	       name, udrm_bench_dbi_path_names[path], stats->bad, stats->frames,
+	       stats->messages / frames, stats->transfers / frames, stats->dma_transfers / frames,
+	       stats->words16 / frames, (unsigned long long)(stats->bytes / frames),
+	       (unsigned long long)(stats->bus_ns / frames / NSEC_PER_USEC),
+	       (unsigned long long)(stats->gap_ns / frames / NSEC_PER_USEC));
+}
+
+/*
+ * Flush the damage patterns through mipi_dbi_dirtyfb() onto the spidev mock,
+ * straight from the dma-buf and from a snapshot in memory like the flush
+ * worker takes, and count the pixels that end up wrong on the panel.
+ */
+static int udrm_bench_dbi_case(const struct udrm_bench_dbi_case *c, unsigned int repeat,
+			       u32 speed_hz, const struct udrm_bench_pattern *only)
+{
+	struct udrm_bench_dbi_stats stats[UDRM_BENCH_NUM_DBI_PATHS] = { 0 };
+	struct drm_clip_rect clips[UDRM_BENCH_PATTERN_MAX_CLIPS];
+	const struct udrm_bench_pattern *pattern;
+	enum udrm_bench_dbi_path path;
+	struct udrm_bench_dbi *dbi;
+	struct region damage;
+	unsigned int i;
+	int ret;
+
+	dbi = calloc(1, sizeof(*dbi));
+	if (!dbi)
+		return -ENOMEM;
+
+	ret = udrm_bench_dbi_init(dbi, c, speed_hz);
+	if (ret) {
+		pr_err("%s: Failed to set up: %d\n", c->name, ret);
+		goto out_fini;
+	}
+
+	for (pattern = udrm_bench_patterns; pattern < udrm_bench_patterns + ARRAY_SIZE(udrm_bench_patterns); pattern++) {
+		if (only && pattern != only)
+			continue;
+
+		ret = udrm_bench_pattern_region(pattern, clips, &damage, dbi->ufb.width, dbi->ufb.height);
+		if (ret)
+			goto out_fini;
+
+		for (path = 0; path < UDRM_BENCH_NUM_DBI_PATHS; path++) {
+			spi_mock_clear(dbi->mock);
+			dbi->ufb.vaddr = path == UDRM_BENCH_DBI_STAGED ? dbi->vaddr : NULL;
+
+			for (i = 0; i < repeat && !ret; i++) {
+				dbi->mipi.udev.preemptible = c->preempt;
+				ret = mipi_dbi_dirtyfb(&dbi->ufb, 0, 0, clips, pattern->num_clips);
+				dbi->mipi.udev.preemptible = false;
+			}
+			if (ret) {
+				pr_err("%s: %s: Failed to flush: %d\n", c->name, pattern->name, ret);
+				region_fini(&damage);
+				goto out_fini;
+			}
+
+			stats[path].bad += udrm_bench_dbi_check(dbi, &damage);
+			udrm_bench_dbi_stats_add(&stats[path], dbi->mock, repeat);
+		}
+
+		region_fini(&damage);
+	}
+
+	for (path = 0; path < UDRM_BENCH_NUM_DBI_PATHS; path++) {
+		udrm_bench_dbi_stats_print(c->name, path, &stats[path]);
+		if (stats[path].bad)
+			ret = -EIO;
+	}
+	mipi_dbi_print_stats(&dbi->mipi.udev);
+
+out_fini:
+	udrm_bench_dbi_fini(dbi);
+	free(dbi);
+
+	return ret;
+}
+
+static int udrm_bench_dbi(unsigned int repeat, u32 speed_hz, const struct udrm_bench_pattern *only)
+{
+	unsigned int i, failed = 0;
+
+	for (i = 0; i < ARRAY_SIZE(udrm_bench_dbi_cases); i++)
+		failed += !!udrm_bench_dbi_case(&udrm_bench_dbi_cases[i], repeat, speed_hz, only);
+
+	printf("cases=%zu, failed=%u\n", ARRAY_SIZE(udrm_bench_dbi_cases), failed);
+
+	return failed ? -EIO : 0;
+}
+
+static void udrm_bench_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n <frames>   Number of frames (1000)\n"
+		"  -s <WxH>      Display size (320x240)\n"
+		"  -d <WxH>      Damage size (display size)\n"
+		"  -x            XRGB8888 framebuffer (RGB565)\n"
+		"  -C            Scalar pixel conversion, no SIMD\n"
+		"  -K            Time the pixel conversion, dithering and rotation kernels and the region operations, -n times\n"
+		"  -G <runs>     Check the region operations against a per-pixel reference on random rectangles\n"
+		"  -m            Compare the clip merge strategies on typical damage, -S sets the bus speed\n"
+		"  -D <repeat>   Flush typical damage with mipi_dbi onto a spidev mock and check the panel,\n"
+		"                -S makes the mock take the time of the bus\n"
+		"  -t <pattern>  Only use this damage pattern with -m and -D\n"
+		"  -S <hz>       Simulated bus speed (no wait)\n"
+		"  -b            Batch events (batch-events)\n"
+		"  -a            Asynchronous flushing (async-flush)\n"
+		"  -q <depth>    Flush queue depth (flush-queue-depth)\n"
+		"  -F <fps>      Pace the flushing (fps)\n"
+		"  -B <frames>   Pacing burst allowance (fps-burst)\n"
+		"  -T <hz>       Tearing effect signal from a mock gpio, needs -S (te-mock-hz)\n"
+		"  -c <us>       Small update this long after each frame, needs -S\n"
+		"  -P <pixels>   Largest damage that preempts a flush (preempt-pixels)\n"
+		"  -L <hz>       Race a simulated scanline instead of TE, needs -S\n"
+		"  -p            Read the framebuffers directly, no copy\n"
+		"  -w <file>     Record the events (record)\n"
+		"  -r <file>     Replay a recording, -s/-x/-p are taken from it\n"
+		"  -R <factor>   Replay speed up, 0 is as fast as possible (1)\n"
+		"  -v            Debug output\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct udrm_bench_replay replay = {
+		.pace = 1,
+	};
+	const char *replay_fname = NULL;
+	struct udrm_bench *bench;
+	struct udrm_local *local;
+	struct gpio_desc *te;
+	u32 buf_mode = UDRM_BUF_MODE_EMUL_XRGB8888 | UDRM_BUF_MODE_SWAP_BYTES;
+	pthread_t thread;
+	u64 start, elapsed_us;
+	const struct udrm_bench_pattern *pattern = NULL;
+	bool kernels = false, merge = false;
+	unsigned int dbi = 0, region_checks = 0;
+	u32 depth;
+	int opt, ret;
+
+	bench = calloc(1, sizeof(*bench));
+	if (!bench)
+		return 1;
+
+	bench->frames = 1000;
+	bench->format = DRM_FORMAT_RGB565;
+	dev_set_name(&bench->dev, "udrm-bench");
+	udrm_debug = 0;
+	printk_level = 6;
+
+	while ((opt = getopt(argc, argv, "n:s:d:xCKG:mD:t:S:baq:F:B:T:L:c:P:pw:r:R:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			bench->frames = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (sscanf(optarg, "%hux%hu", &udrm_bench_mode.hdisplay, &udrm_bench_mode.vdisplay) != 2)
+				goto err_usage;
+			break;
+		case 'd':
+			if (sscanf(optarg, "%ux%u", &bench->damage_w, &bench->damage_h) != 2)
+				goto err_usage;
+			break;
+		case 'x':
+			bench->format = DRM_FORMAT_XRGB8888;
+			break;
+		case 'C':
+			convert_set_simd(false);
+			break;
+		case 'K':
+			kernels = true;
+			break;
+		case 'm':
+			merge = true;
+			break;
+		case 'G':
+			region_checks = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			dbi = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			pattern = udrm_bench_pattern_find(optarg);
+			if (!pattern) {
+				pr_err("Unknown damage pattern: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'S':
+			bench->speed_hz = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			device_property_set_bool(&bench->dev, "batch-events");
+			break;
+		case 'a':
+			device_property_set_bool(&bench->dev, "async-flush");
+			break;
+		case 'q':
+			depth = strtoul(optarg, NULL, 0);
+			device_property_set_u32(&bench->dev, "flush-queue-depth", depth);
+			break;
+		case 'F':
+			device_property_set_u32(&bench->dev, "fps", strtoul(optarg, NULL, 0));
+			break;
+		case 'B':
+			device_property_set_u32(&bench->dev, "fps-burst", strtoul(optarg, NULL, 0));
+			break;
+		case 'T':
+			device_property_set_u32(&bench->dev, "te-mock-hz", strtoul(optarg, NULL, 0));
+			break;
+		case 'c':
+			bench->cursor_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			device_property_set_u32(&bench->dev, "preempt-pixels", strtoul(optarg, NULL, 0));
+			break;
+		case 'L':
+			bench->scanline_hz = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			buf_mode = UDRM_BUF_MODE_NONE;
+			break;
+		case 'w':
+			device_property_set_string(&bench->dev, "record", optarg);
+			break;
+		case 'r':
+			replay_fname = optarg;
+			break;
+		case 'R':
+			replay.pace = strtod(optarg, NULL);
+			break;
+		case 'v':
+			udrm_debug = 0xff;
+			printk_level = 100;
+			break;
+		default:
+			goto err_usage;
+		}
+	}
+
+	if (kernels)
+		return udrm_bench_kernels(bench->frames) ? 1 : 0;
+
+	if (merge)
+		return udrm_bench_merge(udrm_bench_mode.hdisplay, udrm_bench_mode.vdisplay,
+					bench->speed_hz, pattern) ? 1 : 0;
+
+	if (region_checks)
+		return udrm_bench_region_check(region_checks) ? 1 : 0;
+
+	if (dbi)
+		return udrm_bench_dbi(dbi, bench->speed_hz, pattern) ? 1 : 0;
+
+	if (replay_fname) {
+		ret = udrm_bench_replay_open(&replay, replay_fname);
+		if (ret)
+			return 1;
+
+		bench->replay = &replay;
+		bench->max_latency = udrm_bench_replay_count(&replay, &bench->frames);
+		udrm_bench_mode = replay.header->mode;
+		buf_mode = replay.header->prime ? UDRM_BUF_MODE_NONE : UDRM_BUF_MODE_PLAIN_COPY;
+	} else {
+		/* pipe enable/disable, fb create/destroy */
+		bench->max_latency = (bench->cursor_us ? 2 : 1) * bench->frames + 4;
+	}
+
+	bench->latency = calloc(bench->max_latency, sizeof(*bench->latency));
+	if (!bench->latency)
+		return 1;
+
+	bench->width = udrm_bench_mode.hdisplay;
+	bench->height = udrm_bench_mode.vdisplay;
+
+	if (bench->cursor_us && !replay_fname) {
+		bench->cursor_latency = calloc(bench->frames, sizeof(*bench->cursor_latency));
+		if (!bench->cursor_latency)
+			return 1;
+		bench->cursor.x1 = bench->width / 2;
+		bench->cursor.y1 = bench->height / 2;
+		bench->cursor.x2 = min_t(unsigned int, bench->cursor.x1 + UDRM_BENCH_CURSOR_SIZE, bench->width);
+		bench->cursor.y2 = min_t(unsigned int, bench->cursor.y1 + UDRM_BENCH_CURSOR_SIZE, bench->height);
+	}
+	bench->damage_w = clamp_t(unsigned int, bench->damage_w ? : bench->width, 1, bench->width);
+	bench->damage_h = clamp_t(unsigned int, bench->damage_h ? : bench->height, 1, bench->height);
+	udrm_bench_mode.hsync_start = udrm_bench_mode.hsync_end = udrm_bench_mode.htotal = udrm_bench_mode.hdisplay;
+	udrm_bench_mode.vsync_start = udrm_bench_mode.vsync_end = udrm_bench_mode.vtotal = udrm_bench_mode.vdisplay;
+
+	bench->line = calloc(bench->width, sizeof(*bench->line));
+	if (!bench->line)
+		return 1;
+
+	te = gpiod_get_optional(&bench->dev, "te", GPIOD_IN);
+	if (IS_ERR(te))
+		return 1;
+	if (!te && bench->scanline_hz) {
+		bench->scanline_start_ns = ktime_get_ns();
+		te_sync_init_scanline(&bench->te, udrm_bench_get_scanline, bench, bench->height, 100);
+	} else {
+		te_sync_init(&bench->te, te, bench->height);
+	}
+
+	bench->udev.dev = &bench->dev;
+	bench->udev.funcs = &udrm_bench_funcs;
+	bench->udev.backend = &udrm_local_backend;
+
+	ret = udrm_register(&bench->udev, "udrm-bench", &udrm_bench_mode, udrm_bench_formats,
+			    ARRAY_SIZE(udrm_bench_formats), buf_mode);
+	if (ret) {
+		pr_err("Failed to register: %d\n", ret);
+		return 1;
+	}
+
+	local = udrm_local_get(&bench->udev);
+	start = ktime_get_ns();
+
+	ret = pthread_create(&thread, NULL, udrm_bench_generator, bench);
+	if (ret) {
+		pr_err("Failed to start generator: %d\n", ret);
+		return 1;
+	}
+
+	udrm_event_loop(&bench->udev);
+	pthread_join(thread, NULL);
+
+	elapsed_us = (ktime_get_ns() - start) / NSEC_PER_USEC;
+
+	udrm_local_print_stats(local);
+	printf("frames=%u, elapsed=%llums, %llu fps, %llu Mpixels/s, wire=%llukB, checksum=%08x, result=%d\n",
+	       bench->frames, (unsigned long long)elapsed_us / 1000,
+	       elapsed_us ? (unsigned long long)bench->frames * 1000000 / elapsed_us : 0ULL,
+	       elapsed_us ? (unsigned long long)bench->pixels / elapsed_us : 0ULL,
+	       (unsigned long long)bench->pixels * 2 / 1024, bench->checksum, bench->ret);
+	udrm_bench_print_latency("latency", bench->latency, bench->num_latency);
+	if (bench->cursor_latency)
+		udrm_bench_print_latency("small update latency", bench->cursor_latency,
+					 bench->num_cursor_latency);
+
+	udrm_unregister(&bench->udev);
+
+	return bench->ret ? 1 : 0;
+
+err_usage:
+	udrm_bench_usage(argv[0]);
+
+	return 1;
+}
@@ -0,0 +1,546 @@
+// memcpy
+#include <string.h>
+
+#include <stdio.h>
+#include <sys/eventfd.h>
+
+#include "device.h"
+#include "udrm-flush.h"
+
+/* Flush from the snapshot, straight from the dma-buf if it is one */
+static void udrm_flush_work_set_fb(struct udrm_flush_work *work, struct udrm_framebuffer *ufb)
+{
+	work->fb = *ufb;
+	region_init(&work->fb.damage);
+	region_init(&work->fb.urgent);
+	if (work->dmabuf) {
+		work->fb.vaddr = NULL;
+		work->fb.snapshot = work->dmabuf;
+	} else {
+		work->fb.vaddr = work->buf;
+	}
+}
+
+static int udrm_flush_snapshot(struct udrm_flush_work *work, struct udrm_framebuffer *ufb)
+{
+	struct dma_buf *dmabuf = udrm_fb_dma_buf(ufb);
+	unsigned int pitch = udrm_buf_pitch(ufb);
+	unsigned int cpp = udrm_buf_cpp(ufb);
+	struct drm_clip_rect *clip = &work->clip;
+	size_t offset, len;
+	unsigned int y;
+
+	if (!dmabuf->vaddr && !dma_buf_vmap(dmabuf))
+		return -ENOMEM;
+
+	len = (clip->x2 - clip->x1) * cpp;
+	offset = clip->y1 * pitch + clip->x1 * cpp;
+
+	dma_buf_begin_cpu_access(dmabuf);
+	if (work->dmabuf)
+		dma_buf_begin_cpu_access(work->dmabuf);
+
+	if (len == pitch) {
+		memcpy(work->buf + offset, dmabuf->vaddr + offset, (clip->y2 - clip->y1) * pitch);
+	} else {
+		for (y = clip->y1; y < clip->y2; y++, offset += pitch)
+			memcpy(work->buf + offset, dmabuf->vaddr + offset, len);
+	}
+
+	if (work->dmabuf)
+		dma_buf_end_cpu_access(work->dmabuf);
+	dma_buf_end_cpu_access(dmabuf);
+
+	return 0;
+}
+
+static void *udrm_flush_thread(void *data)
+{
+	struct udrm_flush_worker *worker = data;
+	struct udrm_flush_stats *stats = &worker->stats;
+	struct udrm_flush_work *work;
+	unsigned int tail;
+	eventfd_t val;
+	struct udrm_latency *lat;
+	u64 latency, start;
+	int state;
+	int ret;
+
+	while (1) {
+		tail = atomic_load_explicit(&worker->tail, memory_order_relaxed);
+		if (tail == atomic_load_explicit(&worker->head, memory_order_acquire)) {
+			if (atomic_load(&worker->stop))
+				break;
+			eventfd_read(worker->work_fd, &val);
+			continue;
+		}
+
+		work = &worker->work[tail & (UDRM_FLUSH_QUEUE_SIZE - 1)];
+
+		/* The event loop is folding new damage into it, wait for it to finish */
+		state = UDRM_FLUSH_QUEUED;
+		if (!atomic_compare_exchange_strong(&work->state, &state, UDRM_FLUSH_FLUSHING)) {
+			eventfd_read(worker->work_fd, &val);
+			continue;
+		}
+
+		lat = work->fb.udev->latency;
+		start = udrm_latency_now();
+		udrm_latency_set_current(lat);
+		atomic_store(&worker->busy, true);
+		ret = work->fb.udev->funcs->dirtyfb(&work->fb, 0, 0, &work->clip, 1);
+		atomic_store(&worker->busy, false);
+		udrm_latency_set_current(NULL);
+		udrm_latency_add(lat, UDRM_LATENCY_FLUSH, start);
+		udrm_latency_add(lat, UDRM_LATENCY_PANEL, work->event_ns);
+		if (ret)
+			DRM_ERROR("[FB:%u] Failed to flush: %d\n", work->fb.id, ret);
+
+		latency = ktime_get_ns() - work->queued_ns;
+		stats->latency_sum_ns += latency;
+		if (latency > stats->latency_max_ns)
+			stats->latency_max_ns = latency;
+		stats->flushed++;
+
+		atomic_store_explicit(&worker->tail, tail + 1, memory_order_release);
+		eventfd_write(worker->done_fd, 1);
+	}
+
+	return NULL;
+}
+
+static unsigned int udrm_flush_depth(struct udrm_flush_worker *worker)
+{
+	return atomic_load_explicit(&worker->head, memory_order_relaxed) -
+	       atomic_load_explicit(&worker->tail, memory_order_acquire);
+}
+
+static bool udrm_flush_clip_covers(const struct drm_clip_rect *a, const struct drm_clip_rect *b)
+{
+	return a->x1 <= b->x1 && a->y1 <= b->y1 && a->x2 >= b->x2 && a->y2 >= b->y2;
+}
+
+/*
+ * Fold the damage into the newest queued frame if the worker hasn't started
+ * on it. The union is snapshotted again since the part outside the old clip
+ * is not in the snapshot buffer. A shared worker can have another device or
+ * framebuffer queued last, that frame is left alone.
+ */
+static bool udrm_flush_merge(struct udrm_flush_worker *worker, struct udrm_framebuffer *ufb,
+			     const struct drm_clip_rect *clip)
+{
+	struct udrm_flush_stats *stats = &worker->stats;
+	unsigned int head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+	struct udrm_flush_work *work;
+	int state = UDRM_FLUSH_QUEUED;
+
+	work = &worker->work[(head - 1) & (UDRM_FLUSH_QUEUE_SIZE - 1)];
+	/* Only the event loop writes fb, the worker doesn't change it */
+	if (work->fb.udev != ufb->udev || work->fb.id != ufb->id)
+		return false;
+
+	if (!atomic_compare_exchange_strong(&work->state, &state, UDRM_FLUSH_MERGING))
+		return false;
+
+	if (udrm_flush_clip_covers(clip, &work->clip))
+		stats->dropped++;
+	else
+		stats->merged++;
+
+	work->clip.x1 = min(work->clip.x1, clip->x1);
+	work->clip.y1 = min(work->clip.y1, clip->y1);
+	work->clip.x2 = max(work->clip.x2, clip->x2);
+	work->clip.y2 = max(work->clip.y2, clip->y2);
+	udrm_flush_work_set_fb(work, ufb);
+	if (udrm_flush_snapshot(work, ufb))
+		DRM_ERROR("[FB:%u] Failed to snapshot damage\n", ufb->id);
+
+	atomic_store(&work->state, UDRM_FLUSH_QUEUED);
+	eventfd_write(worker->work_fd, 1);
+
+	return true;
+}
+
+/* Number of queued frames the worker hasn't started on */
+static unsigned int udrm_flush_waiting(struct udrm_flush_worker *worker)
+{
+	unsigned int tail = atomic_load_explicit(&worker->tail, memory_order_acquire);
+	unsigned int depth = udrm_flush_depth(worker);
+	struct udrm_flush_work *work = &worker->work[tail & (UDRM_FLUSH_QUEUE_SIZE - 1)];
+
+	if (depth && atomic_load(&work->state) == UDRM_FLUSH_FLUSHING)
+		depth--;
+
+	return depth;
+}
+
+/**
+ * udrm_flush_wait_idle - Wait for all queued flushes to finish
+ * @worker: Flush worker
+ *
+ * Must be called before touching the controller from the event loop.
+ */
+void udrm_flush_wait_idle(struct udrm_flush_worker *worker)
+{
+	eventfd_t val;
+
+	while (udrm_flush_depth(worker))
+		eventfd_read(worker->done_fd, &val);
+}
+
+void udrm_flush_print_stats(struct udrm_flush_worker *worker)
+{
+	struct udrm_flush_stats *stats = &worker->stats;
+	unsigned long flushed = stats->flushed;
+	char occupancy[64];
+	unsigned int i;
+	int len = 0;
+
+	for (i = 1; i <= worker->num_bufs; i++)
+		len += snprintf(occupancy + len, sizeof(occupancy) - len, "%s%lu",
+				i > 1 ? "/" : "", stats->occupancy[i]);
+
+	DRM_INFO("%s: flush queued=%lu, flushed=%lu, busy=%lu, merged=%lu, dropped=%lu, depth=%u, depth_max=%u, latency avg=%lluus, max=%lluus\n",
+		 worker->name, stats->queued, flushed, stats->busy,
+		 stats->merged, stats->dropped, udrm_flush_depth(worker), stats->depth_max,
+		 flushed ? (unsigned long long)(stats->latency_sum_ns / flushed / NSEC_PER_USEC) : 0ULL,
+		 (unsigned long long)(stats->latency_max_ns / NSEC_PER_USEC));
+	DRM_INFO("%s: flush buffers=%u%s, occupancy=%s, stalls=%lu, stalled=%llums\n",
+		 worker->name, worker->num_bufs, worker->dmabufs[0] ? " (dma-buf)" : "",
+		 occupancy, stats->stalls, (unsigned long long)(stats->stall_ns / NSEC_PER_MSEC));
+}
+
+static void udrm_flush_free_bufs(struct udrm_flush_worker *worker)
+{
+	unsigned int i;
+
+	for (i = 0; i < UDRM_FLUSH_QUEUE_SIZE; i++) {
+		if (worker->dmabufs[i])
+			dma_buf_put(worker->dmabufs[i]);
+		else
+			free(worker->bufs[i]);
+	}
+}
+
+static int udrm_flush_alloc_bufs(struct udrm_flush_worker *worker, struct udrm_device *udev,
+				 unsigned int num_dmabufs)
+{
+	struct dma_buf *dmabuf;
+	unsigned int i;
+	int fd;
+
+	if (!num_dmabufs) {
+		worker->num_bufs = UDRM_FLUSH_QUEUE_SIZE;
+		for (i = 0; i < worker->num_bufs; i++) {
+			worker->bufs[i] = malloc(worker->buf_size);
+			if (!worker->bufs[i])
+				return -ENOMEM;
+		}
+
+		return 0;
+	}
+
+	worker->num_bufs = clamp_t(unsigned int, num_dmabufs, UDRM_FLUSH_BUFS_MIN, UDRM_FLUSH_BUFS_MAX);
+	for (i = 0; i < worker->num_bufs; i++) {
+		fd = udrm_create_dma_buf(udev, worker->buf_size);
+		if (fd < 0)
+			return fd;
+
+		dmabuf = dma_buf_get(fd);
+		if (IS_ERR(dmabuf)) {
+			close(fd);
+			return PTR_ERR(dmabuf);
+		}
+		worker->dmabufs[i] = dmabuf;
+
+		worker->bufs[i] = dma_buf_vmap(dmabuf);
+		if (!worker->bufs[i])
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Workers shared by devices in the same flush group */
+static struct udrm_flush_worker *udrm_flush_workers;
+
+static struct udrm_flush_worker *udrm_flush_worker_find(int group)
+{
+	struct udrm_flush_worker *worker;
+
+	for (worker = udrm_flush_workers; worker; worker = worker->list) {
+		if (worker->group == group)
+			return worker;
+	}
+
+	return NULL;
+}
+
+/*
+ * A device joining a group can need bigger snapshots than the ones before
+ * it, and so can an imported framebuffer with a padded pitch or bigger than
+ * the mode. The new buffers are set up before the old ones are dropped so
+ * the worker keeps working if it fails.
+ */
+static int udrm_flush_worker_grow(struct udrm_flush_worker *worker, struct udrm_device *udev,
+				  size_t buf_size)
+{
+	unsigned int num_dmabufs = worker->dmabufs[0] ? worker->num_bufs : 0;
+	struct udrm_flush_worker *tmp;
+	int ret;
+
+	if (buf_size <= worker->buf_size)
+		return 0;
+
+	tmp = calloc(1, sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+
+	tmp->buf_size = buf_size;
+	ret = udrm_flush_alloc_bufs(tmp, udev, num_dmabufs);
+	if (ret) {
+		udrm_flush_free_bufs(tmp);
+		free(tmp);
+		return ret;
+	}
+
+	/* Nothing may be flushing from the old buffers */
+	udrm_flush_wait_idle(worker);
+	udrm_flush_free_bufs(worker);
+	memcpy(worker->bufs, tmp->bufs, sizeof(worker->bufs));
+	memcpy(worker->dmabufs, tmp->dmabufs, sizeof(worker->dmabufs));
+	worker->num_bufs = tmp->num_bufs;
+	worker->buf_size = buf_size;
+	free(tmp);
+
+	DRM_DEBUG_DRIVER("Flush worker %s: buffers grown to %zu bytes\n", worker->name, buf_size);
+
+	return 0;
+}
+
+/**
+ * udrm_flush_queue - Queue damage for flushing
+ * @worker: Flush worker
+ * @ufb: Framebuffer
+ * @clips: Damage clips
+ * @num_clips: Number of clips, zero means the whole framebuffer
+ *
+ * Takes a snapshot of the damaged area so the event can be acked right away.
+ * The snapshot buffers grow when @ufb doesn't fit, once the worker is idle.
+ * The clips are merged into one rectangle. If the maximum number of frames
+ * are already waiting, the damage is folded into the newest of them.
+ * Blocks if the queue is full.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int udrm_flush_queue(struct udrm_flush_worker *worker, struct udrm_framebuffer *ufb,
+		     const struct drm_clip_rect *clips, unsigned int num_clips)
+{
+	struct udrm_flush_stats *stats = &worker->stats;
+	struct udrm_flush_work *work;
+	struct drm_clip_rect clip;
+	unsigned int head, depth, i;
+	eventfd_t val;
+	u64 start;
+	int ret;
+
+	if (!num_clips) {
+		clip.x1 = 0;
+		clip.y1 = 0;
+		clip.x2 = ufb->width;
+		clip.y2 = ufb->height;
+	} else {
+		clip = clips[0];
+		for (i = 1; i < num_clips; i++) {
+			clip.x1 = min(clip.x1, clips[i].x1);
+			clip.y1 = min(clip.y1, clips[i].y1);
+			clip.x2 = max(clip.x2, clips[i].x2);
+			clip.y2 = max(clip.y2, clips[i].y2);
+		}
+	}
+
+	if (clip.x2 > ufb->width || clip.y2 > ufb->height ||
+	    clip.x1 >= clip.x2 || clip.y1 >= clip.y2)
+		return -EINVAL;
+
+	ret = udrm_flush_worker_grow(worker, ufb->udev, (size_t)udrm_buf_pitch(ufb) * ufb->height);
+	if (ret)
+		return ret;
+
+	if (atomic_load(&worker->busy))
+		stats->busy++;
+
+	if (udrm_flush_waiting(worker) >= worker->max_depth &&
+	    udrm_flush_merge(worker, ufb, &clip))
+		return 0;
+
+	/* All snapshot buffers are in use */
+	if (udrm_flush_depth(worker) == worker->num_bufs) {
+		start = ktime_get_ns();
+		while (udrm_flush_depth(worker) == worker->num_bufs)
+			eventfd_read(worker->done_fd, &val);
+		stats->stall_ns += ktime_get_ns() - start;
+		stats->stalls++;
+	}
+
+	/* There are never more than num_bufs frames in flight so this buffer is free */
+	head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+	work = &worker->work[head & (UDRM_FLUSH_QUEUE_SIZE - 1)];
+	work->buf = worker->bufs[head % worker->num_bufs];
+	work->dmabuf = worker->dmabufs[head % worker->num_bufs];
+
+	udrm_flush_work_set_fb(work, ufb);
+	work->clip = clip;
+	ret = udrm_flush_snapshot(work, ufb);
+	if (ret)
+		return ret;
+	work->queued_ns = ktime_get_ns();
+	work->event_ns = ufb->udev->event_ns;
+	atomic_store(&work->state, UDRM_FLUSH_QUEUED);
+
+	atomic_store_explicit(&worker->head, head + 1, memory_order_release);
+	eventfd_write(worker->work_fd, 1);
+
+	depth = udrm_flush_depth(worker);
+	if (depth > stats->depth_max)
+		stats->depth_max = depth;
+	stats->occupancy[min(depth, (unsigned int)UDRM_FLUSH_QUEUE_SIZE)]++;
+	stats->queued++;
+
+	return 0;
+}
+
+/**
+ * udrm_flush_worker_start - Start asynchronous flushing
+ * @udev: udrm device
+ *
+ * Device properties:
+ * flush-queue-depth: Maximum number of frames waiting to be flushed
+ * flush-buffers: Take the snapshots into a pool of this many dma-bufs (2-4)
+ *                so they can be sent without copying, default is to use
+ *                plain memory
+ * flush-group: Share the worker with the other devices in this group, the
+ *              worker is set up from the properties of the first device
+ *              and its buffers grow to fit the largest framebuffer
+ *
+ * Returns:
+ * Flush worker on success, error pointer on failure.
+ */
+struct udrm_flush_worker *udrm_flush_worker_start(struct udrm_device *udev)
+{
+	struct udrm_flush_worker *worker;
+	u32 num_dmabufs = 0;
+	u32 group;
+	int ret;
+
+	if (!udev->dmabuf || !udev->funcs || !udev->funcs->dirtyfb)
+		return ERR_PTR(-EINVAL);
+
+	if (!udev->dmabuf->vaddr && !dma_buf_vmap(udev->dmabuf))
+		return ERR_PTR(-ENOMEM);
+
+	if (udev->dev && !device_property_read_u32(udev->dev, "flush-group", &group)) {
+		worker = udrm_flush_worker_find(group);
+		if (worker) {
+			ret = udrm_flush_worker_grow(worker, udev, udev->dmabuf->size);
+			if (ret)
+				return ERR_PTR(ret);
+			worker->users++;
+			DRM_DEBUG_DRIVER("%s: Using flush worker %s\n", udev->name, worker->name);
+			return worker;
+		}
+	} else {
+		group = -1;
+	}
+
+	worker = calloc(1, sizeof(*worker));
+	if (!worker)
+		return ERR_PTR(-ENOMEM);
+
+	if ((int)group >= 0)
+		snprintf(worker->name, sizeof(worker->name), "flush-group%d", (int)group);
+	else
+		snprintf(worker->name, sizeof(worker->name), "%s", udev->name);
+	worker->group = group;
+	worker->users = 1;
+	worker->buf_size = udev->dmabuf->size;
+	worker->max_depth = UDRM_FLUSH_DEPTH_DEFAULT;
+	if (udev->dev) {
+		device_property_read_u32(udev->dev, "flush-queue-depth", &worker->max_depth);
+		device_property_read_u32(udev->dev, "flush-buffers", &num_dmabufs);
+	}
+	worker->work_fd = -1;
+	worker->done_fd = -1;
+
+	ret = udrm_flush_alloc_bufs(worker, udev, num_dmabufs);
+	if (ret)
+		goto err_free;
+
+	/* One buffer is kept for the frame being flushed */
+	worker->max_depth = clamp_t(unsigned int, worker->max_depth, 1, worker->num_bufs - 1);
+
+	worker->work_fd = eventfd(0, EFD_CLOEXEC);
+	worker->done_fd = eventfd(0, EFD_CLOEXEC);
+	if (worker->work_fd < 0 || worker->done_fd < 0) {
+		ret = -errno;
+		goto err_free;
+	}
+
+	ret = -pthread_create(&worker->thread, NULL, udrm_flush_thread, worker);
+	if (ret)
+		goto err_free;
+
+	if (worker->group >= 0) {
+		worker->list = udrm_flush_workers;
+		udrm_flush_workers = worker;
+	}
+
+	DRM_DEBUG_DRIVER("Flush worker %s started, max depth %u, %u %s buffers\n", worker->name,
+			 worker->max_depth, worker->num_bufs, num_dmabufs ? "dma-buf" : "memory");
+
+	return worker;
+
+err_free:
+	if (worker->work_fd >= 0)
+		close(worker->work_fd);
+	if (worker->done_fd >= 0)
+		close(worker->done_fd);
+	udrm_flush_free_bufs(worker);
+	free(worker);
+
+	return ERR_PTR(ret);
+}
+
+/**
+ * udrm_flush_worker_stop - Stop asynchronous flushing
+ * @worker: Flush worker
+ *
+ * Drops a reference to a shared worker, it's stopped when the last device
+ * is gone. The caller must make sure that none of its flushes are queued.
+ */
+void udrm_flush_worker_stop(struct udrm_flush_worker *worker)
+{
+	struct udrm_flush_worker **pos;
+
+	if (--worker->users)
+		return;
+
+	for (pos = &udrm_flush_workers; *pos; pos = &(*pos)->list) {
+		if (*pos == worker) {
+			*pos = worker->list;
+			break;
+		}
+	}
+
+	atomic_store(&worker->stop, true);
+	eventfd_write(worker->work_fd, 1);
+	pthread_join(worker->thread, NULL);
+
+	udrm_flush_print_stats(worker);
+
+	close(worker->work_fd);
+	close(worker->done_fd);
+	udrm_flush_free_bufs(worker);
+	free(worker);
+}
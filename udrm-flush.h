@@ -0,0 +1,135 @@
+#ifndef _UDRM_FLUSH_H
+#define _UDRM_FLUSH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "udrm.h"
+
+/* Must be a power of two */
+#define UDRM_FLUSH_QUEUE_SIZE	4
+
+/* Queued frames that haven't started flushing, one slot is left for the worker */
+#define UDRM_FLUSH_DEPTH_DEFAULT	1
+#define UDRM_FLUSH_DEPTH_MAX		(UDRM_FLUSH_QUEUE_SIZE - 1)
+
+/* Snapshot buffers when they are dma-bufs, see udrm_flush_worker_start() */
+#define UDRM_FLUSH_BUFS_MIN		2
+#define UDRM_FLUSH_BUFS_MAX		UDRM_FLUSH_QUEUE_SIZE
+
+enum udrm_flush_state {
+	UDRM_FLUSH_QUEUED,
+	UDRM_FLUSH_MERGING,
+	UDRM_FLUSH_FLUSHING,
+};
+
+/**
+ * struct udrm_flush_work - Queued flush
+ * @fb: Copy of the framebuffer with @vaddr pointing to the snapshot
+ * @clip: Damaged area
+ * @buf: Snapshot of the damaged area
+ * @dmabuf: The dma-buf @buf belongs to when using a buffer pool
+ * @queued_ns: Time of enqueue, merging keeps the oldest
+ * @event_ns: When the damage arrived, see &udrm_device.event_ns
+ * @state: &udrm_flush_state, the worker and the event loop race to claim
+ *         a queued slot
+ */
+struct udrm_flush_work {
+	struct udrm_framebuffer fb;
+	struct drm_clip_rect clip;
+	void *buf;
+	struct dma_buf *dmabuf;
+	u64 queued_ns;
+	u64 event_ns;
+	atomic_int state;
+};
+
+/**
+ * struct udrm_flush_stats - Flush worker counters
+ * @queued: Number of flushes queued
+ * @flushed: Number of flushes done (worker)
+ * @busy: Damage arrived while the worker was flushing
+ * @merged: Frames folded into a queued frame
+ * @dropped: Frames folded into a queued frame that covered all of it
+ * @depth_max: Maximum queue depth seen on enqueue
+ * @stalls: Enqueues that had to wait for a free snapshot buffer
+ * @stall_ns: Time spent waiting for a free snapshot buffer
+ * @occupancy: Histogram of snapshot buffers in use after enqueue
+ * @latency_sum_ns: Sum of enqueue to flush done latencies (worker)
+ * @latency_max_ns: Maximum enqueue to flush done latency (worker)
+ */
+struct udrm_flush_stats {
+	unsigned long queued;
+	unsigned long flushed;
+	unsigned long busy;
+	unsigned long merged;
+	unsigned long dropped;
+	unsigned int depth_max;
+	unsigned long stalls;
+	u64 stall_ns;
+	unsigned long occupancy[UDRM_FLUSH_QUEUE_SIZE + 1];
+	u64 latency_sum_ns;
+	u64 latency_max_ns;
+};
+
+/**
+ * struct udrm_flush_worker - Asynchronous flushing
+ * @name: Device name or flush group, for the stats
+ * @group: Flush group from the "flush-group" property, -1 if private
+ * @users: Number of devices using the worker
+ * @list: Entry in the list of shared workers
+ * @thread: Worker thread
+ * @work_fd: eventfd signalled when work is queued
+ * @done_fd: eventfd signalled when work is done
+ * @head: Next slot to fill, only written by the event loop
+ * @tail: Next slot to flush, only written by the worker
+ * @busy: Worker is flushing
+ * @max_depth: Maximum number of queued frames that haven't started flushing
+ * @stop: Tell the worker to exit
+ * @work: Queue slots
+ * @bufs: Snapshot buffers, frame n uses buffer n % @num_bufs
+ * @dmabufs: Pool of dma-bufs backing @bufs (optional)
+ * @num_bufs: Number of snapshot buffers, limits the queue depth
+ * @buf_size: Size of each snapshot buffer
+ * @stats: Counters
+ *
+ * Single producer, single consumer ring buffer between the event loop and
+ * the worker thread. When @max_depth frames are waiting, new damage is folded
+ * into the newest waiting frame so the panel always gets the latest content
+ * and latency stays bounded when the bus can't keep up.
+ *
+ * Devices in the same flush group share a worker, normally the devices on
+ * one bus since it can only send one frame at a time anyway.
+ *
+ * With a dma-buf pool the snapshot of frame N+1 is taken while frame N is
+ * sent from its own dma-buf without another copy.
+ */
+struct udrm_flush_worker {
+	char name[32];
+	int group;
+	unsigned int users;
+	struct udrm_flush_worker *list;
+	pthread_t thread;
+	int work_fd;
+	int done_fd;
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_bool busy;
+	unsigned int max_depth;
+	atomic_bool stop;
+	struct udrm_flush_work work[UDRM_FLUSH_QUEUE_SIZE];
+	void *bufs[UDRM_FLUSH_QUEUE_SIZE];
+	struct dma_buf *dmabufs[UDRM_FLUSH_QUEUE_SIZE];
+	unsigned int num_bufs;
+	size_t buf_size;
+	struct udrm_flush_stats stats;
+};
+
+struct udrm_flush_worker *udrm_flush_worker_start(struct udrm_device *udev);
+void udrm_flush_worker_stop(struct udrm_flush_worker *worker);
+int udrm_flush_queue(struct udrm_flush_worker *worker, struct udrm_framebuffer *ufb,
+		     const struct drm_clip_rect *clips, unsigned int num_clips);
+void udrm_flush_wait_idle(struct udrm_flush_worker *worker);
+void udrm_flush_print_stats(struct udrm_flush_worker *worker);
+
+#endif
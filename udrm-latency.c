@@ -0,0 +1,134 @@
+#include <stdio.h>
+
+#include "udrm.h"
+#include "udrm-latency.h"
+
+#ifdef CONFIG_UDRM_LATENCY
+
+static const char * const udrm_latency_stage_names[UDRM_LATENCY_NUM_STAGES] = {
+	[UDRM_LATENCY_LOOKUP] = "lookup",
+	[UDRM_LATENCY_CONVERT] = "convert",
+	[UDRM_LATENCY_SPI] = "spi",
+	[UDRM_LATENCY_FLUSH] = "flush",
+	[UDRM_LATENCY_ACK] = "ack",
+	[UDRM_LATENCY_PANEL] = "dirty-to-panel",
+};
+
+__thread struct udrm_latency *udrm_latency_current;
+
+struct udrm_latency *udrm_latency_alloc(void)
+{
+	struct udrm_latency *lat;
+
+	lat = calloc(1, sizeof(*lat));
+	if (!lat)
+		return ERR_PTR(-ENOMEM);
+
+	return lat;
+}
+
+static unsigned int udrm_latency_bucket(u64 value)
+{
+	unsigned int shift;
+
+	if (value < 2 * UDRM_LATENCY_SUB_BUCKETS)
+		return value;
+
+	/* keep the top UDRM_LATENCY_SUB_BITS + 1 bits */
+	shift = 63 - __builtin_clzll(value) - UDRM_LATENCY_SUB_BITS;
+
+	return shift * UDRM_LATENCY_SUB_BUCKETS + (value >> shift);
+}
+
+/* Largest value that ends up in @bucket */
+static u64 udrm_latency_bucket_max(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < 2 * UDRM_LATENCY_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / UDRM_LATENCY_SUB_BUCKETS - 1;
+
+	return ((u64)(bucket - shift * UDRM_LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void udrm_latency_record(struct udrm_latency *lat, enum udrm_latency_stage stage, u64 value_ns)
+{
+	struct udrm_latency_histogram *hist = &lat->stages[stage];
+
+	value_ns = min_t(u64, value_ns, UDRM_LATENCY_MAX_NS);
+	hist->buckets[udrm_latency_bucket(value_ns)]++;
+	hist->count++;
+	hist->sum_ns += value_ns;
+	if (value_ns > hist->max_ns)
+		hist->max_ns = value_ns;
+}
+
+/**
+ * udrm_latency_percentile - Get a percentile
+ * @hist: Histogram
+ * @pct: Percentile
+ *
+ * Returns:
+ * The largest value of the bucket holding the percentile, at most the
+ * largest value recorded.
+ */
+u64 udrm_latency_percentile(const struct udrm_latency_histogram *hist, unsigned int pct)
+{
+	u64 rank, seen = 0;
+	unsigned int i;
+
+	if (!hist->count)
+		return 0;
+
+	rank = max_t(u64, 1, DIV_ROUND_UP(hist->count * pct, 100));
+	for (i = 0; i < UDRM_LATENCY_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return min(udrm_latency_bucket_max(i), hist->max_ns);
+	}
+
+	return hist->max_ns;
+}
+
+/* Three significant digits are about what the buckets hold */
+static const char *udrm_latency_format(char *buf, size_t size, u64 ns)
+{
+	if (ns < NSEC_PER_USEC)
+		snprintf(buf, size, "%lluns", (unsigned long long)ns);
+	else if (ns < NSEC_PER_MSEC)
+		snprintf(buf, size, "%llu.%02lluus", (unsigned long long)(ns / NSEC_PER_USEC),
+			 (unsigned long long)(ns % NSEC_PER_USEC / 10));
+	else
+		snprintf(buf, size, "%llu.%02llums", (unsigned long long)(ns / NSEC_PER_MSEC),
+			 (unsigned long long)(ns % NSEC_PER_MSEC / 10000));
+
+	return buf;
+}
+
+void udrm_latency_print(struct udrm_latency *lat, const char *name)
+{
+	const struct udrm_latency_histogram *hist;
+	char avg[16], p50[16], p90[16], p99[16], max[16];
+	unsigned int i;
+
+	if (!lat)
+		return;
+
+	for (i = 0; i < UDRM_LATENCY_NUM_STAGES; i++) {
+		hist = &lat->stages[i];
+		if (!hist->count)
+			continue;
+
+		DRM_INFO("%s: latency %s: count=%llu, avg=%s, p50=%s, p90=%s, p99=%s, max=%s\n",
+			 name, udrm_latency_stage_names[i], (unsigned long long)hist->count,
+			 udrm_latency_format(avg, sizeof(avg), hist->sum_ns / hist->count),
+			 udrm_latency_format(p50, sizeof(p50), udrm_latency_percentile(hist, 50)),
+			 udrm_latency_format(p90, sizeof(p90), udrm_latency_percentile(hist, 90)),
+			 udrm_latency_format(p99, sizeof(p99), udrm_latency_percentile(hist, 99)),
+			 udrm_latency_format(max, sizeof(max), hist->max_ns));
+	}
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef _UDRM_LATENCY_H
+#define _UDRM_LATENCY_H
+
+#include "base.h"
+
+/*
+ * Latency histograms, enabled with: make UFLAGS=-DCONFIG_UDRM_LATENCY
+ *
+ * The values are bucketed log-linear like HdrHistogram: the first
+ * 2 * UDRM_LATENCY_SUB_BUCKETS nanoseconds have a bucket each, after that
+ * every power of two is split into UDRM_LATENCY_SUB_BUCKETS buckets. This
+ * gives about 3% precision from nanoseconds up to UDRM_LATENCY_MAX_NS.
+ */
+#define UDRM_LATENCY_SUB_BITS		5
+#define UDRM_LATENCY_SUB_BUCKETS	(1 << UDRM_LATENCY_SUB_BITS)
+#define UDRM_LATENCY_MAX_BITS		40
+#define UDRM_LATENCY_MAX_NS		((1ULL << UDRM_LATENCY_MAX_BITS) - 1)
+#define UDRM_LATENCY_BUCKETS		((UDRM_LATENCY_MAX_BITS - UDRM_LATENCY_SUB_BITS + 1) * \
+					 UDRM_LATENCY_SUB_BUCKETS)
+
+/**
+ * enum udrm_latency_stage - Measured stages
+ * @UDRM_LATENCY_LOOKUP: Event read to framebuffer looked up
+ * @UDRM_LATENCY_CONVERT: Copying/converting the pixels of a window or chunk
+ * @UDRM_LATENCY_SPI: SPI chunk submit to completion
+ * @UDRM_LATENCY_FLUSH: The dirtyfb callback
+ * @UDRM_LATENCY_ACK: Event read to ack written
+ * @UDRM_LATENCY_PANEL: Dirty event read to the pixels sent to the panel,
+ *                      includes time spent batching, pacing and queued
+ *                      for the flush worker
+ */
+enum udrm_latency_stage {
+	UDRM_LATENCY_LOOKUP,
+	UDRM_LATENCY_CONVERT,
+	UDRM_LATENCY_SPI,
+	UDRM_LATENCY_FLUSH,
+	UDRM_LATENCY_ACK,
+	UDRM_LATENCY_PANEL,
+	UDRM_LATENCY_NUM_STAGES,
+};
+
+/**
+ * struct udrm_latency_histogram - Latency histogram
+ * @count: Number of values
+ * @sum_ns: Sum of the values
+ * @max_ns: Largest value, exact
+ * @buckets: Value counts
+ */
+struct udrm_latency_histogram {
+	u64 count;
+	u64 sum_ns;
+	u64 max_ns;
+	u32 buckets[UDRM_LATENCY_BUCKETS];
+};
+
+/**
+ * struct udrm_latency - Per device latency histograms
+ * @stages: Histogram for each &udrm_latency_stage
+ *
+ * The flush worker updates the flush path stages while the event loop
+ * updates the event stages, each stage is only updated from one thread.
+ */
+struct udrm_latency {
+	struct udrm_latency_histogram stages[UDRM_LATENCY_NUM_STAGES];
+};
+
+#ifdef CONFIG_UDRM_LATENCY
+
+/* Device being flushed by this thread, for the stages below dirtyfb */
+extern __thread struct udrm_latency *udrm_latency_current;
+
+struct udrm_latency *udrm_latency_alloc(void);
+void udrm_latency_record(struct udrm_latency *lat, enum udrm_latency_stage stage, u64 value_ns);
+u64 udrm_latency_percentile(const struct udrm_latency_histogram *hist, unsigned int pct);
+void udrm_latency_print(struct udrm_latency *lat, const char *name);
+
+static inline u64 udrm_latency_now(void)
+{
+	return ktime_get_ns();
+}
+
+/* Record the time since @start_ns, a zero start means it wasn't taken */
+static inline void udrm_latency_add(struct udrm_latency *lat, enum udrm_latency_stage stage, u64 start_ns)
+{
+	if (lat && start_ns)
+		udrm_latency_record(lat, stage, ktime_get_ns() - start_ns);
+}
+
+static inline void udrm_latency_set_current(struct udrm_latency *lat)
+{
+	udrm_latency_current = lat;
+}
+
+static inline void udrm_latency_free(struct udrm_latency *lat)
+{
+	free(lat);
+}
+
+#else
+
+static inline struct udrm_latency *udrm_latency_alloc(void)
+{
+	return NULL;
+}
+
+static inline u64 udrm_latency_now(void)
+{
+	return 0;
+}
+
+static inline void udrm_latency_add(struct udrm_latency *lat, enum udrm_latency_stage stage, u64 start_ns)
+{
+}
+
+static inline void udrm_latency_set_current(struct udrm_latency *lat)
+{
+}
+
+static inline void udrm_latency_print(struct udrm_latency *lat, const char *name)
+{
+}
+
+static inline void udrm_latency_free(struct udrm_latency *lat)
+{
+}
+
+#define udrm_latency_current	((struct udrm_latency *)NULL)
+
+#endif
+
+#endif
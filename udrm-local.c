@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+
+// memset
+#include <string.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "udrm-local.h"
+
+static int udrm_local_create_buf(struct udrm_device *udev, size_t size)
+{
+	int fd;
+
+	fd = memfd_create("udrm-buf", MFD_CLOEXEC);
+	if (fd < 0) {
+		pr_err("%s: Failed to create memfd: %s\n", __func__, strerror(errno));
+		return -errno;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		pr_err("%s: Failed to size memfd: %s\n", __func__, strerror(errno));
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+static int udrm_local_dev_create(struct udrm_device *udev, struct udrm_dev_create *create)
+{
+	struct udrm_local *local;
+	int sv[2];
+	off_t size;
+
+	local = calloc(1, sizeof(*local));
+	if (!local)
+		return -ENOMEM;
+
+	local->event = malloc(UDRM_EVENT_MAX_SIZE);
+	if (!local->event)
+		goto err_free;
+
+	local->mode = create->mode;
+	local->buf_mode = create->buf_mode;
+	local->next_fb_id = 1;
+	local->buf = MAP_FAILED;
+
+	if (create->buf_fd >= 0) {
+		size = lseek(create->buf_fd, 0, SEEK_END);
+		if (size <= 0)
+			goto err_free;
+
+		local->buf_size = size;
+		local->buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, create->buf_fd, 0);
+		if (local->buf == MAP_FAILED) {
+			pr_err("%s: Failed to mmap buffer: %s\n", __func__, strerror(errno));
+			goto err_free;
+		}
+	}
+
+	/* Keeps the event boundaries like reading /dev/udrm */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		pr_err("%s: Failed to create socketpair: %s\n", __func__, strerror(errno));
+		goto err_unmap;
+	}
+
+	udev->fd = sv[0];
+	udev->control_fd = -1;
+	udev->backend_data = local;
+	local->fd = sv[1];
+
+	DRM_DEBUG("Local device '%s', %ux%u, buf_mode=0x%x\n", create->name,
+		  local->mode.hdisplay, local->mode.vdisplay, local->buf_mode);
+
+	return 0;
+
+err_unmap:
+	if (local->buf != MAP_FAILED)
+		munmap(local->buf, local->buf_size);
+err_free:
+	free(local->event);
+	free(local);
+
+	return -ENOMEM;
+}
+
+static void udrm_local_fb_free(struct udrm_local_fb *fb)
+{
+	munmap(fb->vaddr, fb->size);
+	close(fb->fd);
+	memset(fb, 0, sizeof(*fb));
+}
+
+static void udrm_local_dev_destroy(struct udrm_device *udev)
+{
+	struct udrm_local *local = udrm_local_get(udev);
+	unsigned int i;
+
+	for (i = 0; i < UDRM_LOCAL_MAX_FBS; i++) {
+		if (local->fbs[i].id)
+			udrm_local_fb_free(&local->fbs[i]);
+	}
+
+	if (local->fd >= 0)
+		close(local->fd);
+	if (local->buf != MAP_FAILED)
+		munmap(local->buf, local->buf_size);
+	free(local->event);
+	free(local);
+	udev->backend_data = NULL;
+}
+
+struct udrm_local_fb *udrm_local_fb_lookup(struct udrm_local *local, unsigned int fb_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < UDRM_LOCAL_MAX_FBS; i++) {
+		if (fb_id && local->fbs[i].id == fb_id)
+			return &local->fbs[i];
+	}
+
+	return NULL;
+}
+
+static int udrm_local_get_fb(struct udrm_device *udev, struct drm_mode_fb_cmd *info)
+{
+	struct udrm_local *local = udrm_local_get(udev);
+	struct udrm_local_fb *fb;
+
+	fb = udrm_local_fb_lookup(local, info->fb_id);
+	if (!fb)
+		return -ENOENT;
+
+	info->width = fb->width;
+	info->height = fb->height;
+	info->pitch = fb->pitch;
+	info->bpp = fb->bpp;
+	info->depth = fb->depth;
+	/* the handle is the slot */
+	info->handle = fb - local->fbs + 1;
+
+	return 0;
+}
+
+static int udrm_local_export_fb(struct udrm_device *udev, unsigned int handle)
+{
+	struct udrm_local *local = udrm_local_get(udev);
+	int fd;
+
+	if (!handle || handle > UDRM_LOCAL_MAX_FBS || !local->fbs[handle - 1].id)
+		return -ENOENT;
+
+	fd = fcntl(local->fbs[handle - 1].fd, F_DUPFD_CLOEXEC, 0);
+
+	return fd < 0 ? -errno : fd;
+}
+
+/* Userspace stand-in for the kernel module, see struct udrm_local */
+const struct udrm_backend udrm_local_backend = {
+	.name = "local",
+	.create_buf = udrm_local_create_buf,
+	.dev_create = udrm_local_dev_create,
+	.get_fb = udrm_local_get_fb,
+	.export_fb = udrm_local_export_fb,
+	.dev_destroy = udrm_local_dev_destroy,
+};
+
+/* Send an event and wait for the ack like the kernel does */
+static int udrm_local_send(struct udrm_local *local, struct udrm_event *ev)
+{
+	struct udrm_local_stats *stats = &local->stats;
+	struct pollfd pfd = {
+		.fd = local->fd,
+		.events = POLLIN,
+	};
+	int ret, event_ret;
+	u64 start, elapsed;
+
+	start = ktime_get_ns();
+
+	ret = write(local->fd, ev, ev->length);
+	if (ret < 0)
+		return -errno;
+
+	ret = poll(&pfd, 1, UDRM_LOCAL_ACK_TIMEOUT_MS);
+	if (ret < 0)
+		return -errno;
+	if (!ret) {
+		pr_err("%s: Timeout waiting for ack, event %u\n", __func__, ev->type);
+		return -ETIMEDOUT;
+	}
+
+	ret = read(local->fd, &event_ret, sizeof(event_ret));
+	if (ret != sizeof(event_ret))
+		return ret < 0 ? -errno : -EIO;
+
+	elapsed = ktime_get_ns() - start;
+	stats->ack_last_ns = elapsed;
+	stats->ack_sum_ns += elapsed;
+	if (elapsed > stats->ack_max_ns)
+		stats->ack_max_ns = elapsed;
+	stats->events++;
+	if (event_ret)
+		stats->errors++;
+
+	return event_ret;
+}
+
+static int udrm_local_send_simple(struct udrm_local *local, u32 type)
+{
+	struct udrm_event ev = {
+		.type = type,
+		.length = sizeof(ev),
+	};
+
+	return udrm_local_send(local, &ev);
+}
+
+int udrm_local_pipe_enable(struct udrm_local *local)
+{
+	return udrm_local_send_simple(local, UDRM_EVENT_PIPE_ENABLE);
+}
+
+int udrm_local_pipe_disable(struct udrm_local *local)
+{
+	return udrm_local_send_simple(local, UDRM_EVENT_PIPE_DISABLE);
+}
+
+static int udrm_local_send_fb(struct udrm_local *local, u32 type, unsigned int fb_id)
+{
+	struct udrm_event_fb ev = {
+		.base = {
+			.type = type,
+			.length = sizeof(ev),
+		},
+		.fb_id = fb_id,
+	};
+
+	return udrm_local_send(local, &ev.base);
+}
+
+/**
+ * udrm_local_fb_create - Create framebuffer
+ * @local: Local stand-in
+ * @width: Width
+ * @height: Height
+ * @format: DRM_FORMAT_RGB565 or DRM_FORMAT_XRGB8888
+ *
+ * Returns:
+ * Framebuffer id on success, negative error code on failure.
+ */
+int udrm_local_fb_create(struct udrm_local *local, unsigned int width, unsigned int height, u32 format)
+{
+	struct udrm_local_fb *fb;
+	int ret;
+
+	if (!width || !height || width > local->mode.hdisplay || height > local->mode.vdisplay)
+		return -EINVAL;
+
+	for (fb = local->fbs; fb < local->fbs + UDRM_LOCAL_MAX_FBS && fb->id; fb++)
+		;
+	if (fb == local->fbs + UDRM_LOCAL_MAX_FBS)
+		return -ENOSPC;
+
+	switch (format) {
+	case DRM_FORMAT_RGB565:
+		fb->bpp = 16;
+		fb->depth = 16;
+		break;
+	case DRM_FORMAT_XRGB8888:
+		fb->bpp = 32;
+		fb->depth = 24;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	fb->width = width;
+	fb->height = height;
+	fb->pitch = width * fb->bpp / 8;
+	fb->size = fb->pitch * height;
+
+	fb->fd = udrm_local_create_buf(NULL, fb->size);
+	if (fb->fd < 0)
+		return fb->fd;
+
+	fb->vaddr = mmap(NULL, fb->size, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+	if (fb->vaddr == MAP_FAILED) {
+		ret = -errno;
+		close(fb->fd);
+		return ret;
+	}
+
+	fb->id = local->next_fb_id++;
+
+	ret = udrm_local_send_fb(local, UDRM_EVENT_FB_CREATE, fb->id);
+	if (ret) {
+		udrm_local_fb_free(fb);
+		return ret;
+	}
+
+	return fb->id;
+}
+
+int udrm_local_fb_destroy(struct udrm_local *local, unsigned int fb_id)
+{
+	struct udrm_local_fb *fb;
+	int ret;
+
+	fb = udrm_local_fb_lookup(local, fb_id);
+	if (!fb)
+		return -ENOENT;
+
+	ret = udrm_local_send_fb(local, UDRM_EVENT_FB_DESTROY, fb_id);
+	udrm_local_fb_free(fb);
+
+	return ret;
+}
+
+/* Copy the clip into the shared buffer like the kernel module does */
+static void udrm_local_copy(struct udrm_local *local, struct udrm_local_fb *fb,
+			    const struct drm_clip_rect *clip)
+{
+	bool swap = local->buf_mode & UDRM_BUF_MODE_SWAP_BYTES;
+	unsigned int dst_pitch = fb->width * 2;
+	unsigned int x, y;
+	u16 *dst;
+	u16 val;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		dst = local->buf + y * dst_pitch;
+
+		if (fb->bpp == 16) {
+			const u16 *src = fb->vaddr + y * fb->pitch;
+
+			if (!swap) {
+				memcpy(dst + clip->x1, src + clip->x1, (clip->x2 - clip->x1) * 2);
+				continue;
+			}
+
+			for (x = clip->x1; x < clip->x2; x++)
+				dst[x] = swab16(src[x]);
+		} else {
+			const u32 *src = fb->vaddr + y * fb->pitch;
+
+			for (x = clip->x1; x < clip->x2; x++) {
+				val = ((src[x] & 0x00F80000) >> 8) |
+				      ((src[x] & 0x0000FC00) >> 5) |
+				      ((src[x] & 0x000000F8) >> 3);
+				dst[x] = swap ? swab16(val) : val;
+			}
+		}
+	}
+
+	local->stats.bytes += (clip->x2 - clip->x1) * (clip->y2 - clip->y1) * 2;
+}
+
+/**
+ * udrm_local_fb_dirty - Flush framebuffer
+ * @local: Local stand-in
+ * @fb_id: Framebuffer id
+ * @flags: DRM_MODE_FB_DIRTY_* flags
+ * @color: Fill color
+ * @clips: Damage, clipped to the framebuffer
+ * @num_clips: Number of clips, zero means the whole framebuffer
+ *
+ * Copies the damage into the shared buffer according to the buffer mode and
+ * sends the dirty event.
+ *
+ * Returns:
+ * The value the event was acked with or a negative error code.
+ */
+int udrm_local_fb_dirty(struct udrm_local *local, unsigned int fb_id, unsigned int flags, unsigned int color,
+			const struct drm_clip_rect *clips, unsigned int num_clips)
+{
+	struct udrm_event_fb_dirty *ev = (struct udrm_event_fb_dirty *)local->event;
+	struct drm_clip_rect full, *clip;
+	struct udrm_local_fb *fb;
+	unsigned int i;
+
+	fb = udrm_local_fb_lookup(local, fb_id);
+	if (!fb)
+		return -ENOENT;
+
+	if (num_clips > DRM_MODE_FB_DIRTY_MAX_CLIPS)
+		return -EINVAL;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->base.type = UDRM_EVENT_FB_DIRTY;
+	ev->base.length = sizeof(*ev) + num_clips * sizeof(*clips);
+	ev->fb_dirty_cmd.fb_id = fb_id;
+	ev->fb_dirty_cmd.flags = flags;
+	ev->fb_dirty_cmd.color = color;
+	ev->fb_dirty_cmd.num_clips = num_clips;
+
+	full.x1 = 0;
+	full.y1 = 0;
+	full.x2 = fb->width;
+	full.y2 = fb->height;
+
+	for (i = 0; i < num_clips; i++) {
+		clip = &ev->clips[i];
+		clip->x1 = min(clips[i].x1, full.x2);
+		clip->y1 = min(clips[i].y1, full.y2);
+		clip->x2 = clamp_t(unsigned short, clips[i].x2, clip->x1, full.x2);
+		clip->y2 = clamp_t(unsigned short, clips[i].y2, clip->y1, full.y2);
+	}
+
+	if (local->buf_mode & (UDRM_BUF_MODE_PLAIN_COPY | UDRM_BUF_MODE_SWAP_BYTES)) {
+		if (fb->width * fb->height * 2 > local->buf_size)
+			return -EINVAL;
+
+		if (!num_clips)
+			udrm_local_copy(local, fb, &full);
+		for (i = 0; i < num_clips; i++)
+			udrm_local_copy(local, fb, &ev->clips[i]);
+	}
+
+	local->stats.dirty++;
+
+	return udrm_local_send(local, &ev->base);
+}
+
+/* Hang up like an unplugged device, the event loop returns */
+void udrm_local_close(struct udrm_local *local)
+{
+	shutdown(local->fd, SHUT_RDWR);
+}
+
+void udrm_local_print_stats(struct udrm_local *local)
+{
+	struct udrm_local_stats *stats = &local->stats;
+
+	DRM_INFO("local: events=%lu, dirty=%lu, errors=%lu, copied=%llukB, ack avg=%lluus, max=%lluus\n",
+		 stats->events, stats->dirty, stats->errors,
+		 (unsigned long long)(stats->bytes / 1024),
+		 stats->events ? (unsigned long long)(stats->ack_sum_ns / stats->events / NSEC_PER_USEC) : 0ULL,
+		 (unsigned long long)(stats->ack_max_ns / NSEC_PER_USEC));
+}
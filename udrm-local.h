@@ -0,0 +1,100 @@
+#ifndef _UDRM_LOCAL_H
+#define _UDRM_LOCAL_H
+
+#include "udrm.h"
+
+#define UDRM_LOCAL_MAX_FBS		8
+#define UDRM_LOCAL_ACK_TIMEOUT_MS	5000
+
+/**
+ * struct udrm_local_fb - Framebuffer in the local stand-in
+ * @id: Framebuffer id, zero if the slot is free
+ * @width: Width in pixels
+ * @height: Height in pixels
+ * @pitch: Bytes per line
+ * @bpp: Bits per pixel
+ * @depth: Color depth
+ * @fd: memfd backing the framebuffer
+ * @vaddr: Mapping of @fd, draw here
+ * @size: Size of @fd
+ */
+struct udrm_local_fb {
+	unsigned int id;
+	unsigned int width;
+	unsigned int height;
+	unsigned int pitch;
+	unsigned int bpp;
+	unsigned int depth;
+	int fd;
+	void *vaddr;
+	size_t size;
+};
+
+/**
+ * struct udrm_local_stats - Local stand-in counters
+ * @events: Events sent
+ * @dirty: Dirty events sent
+ * @errors: Events acked with an error
+ * @bytes: Bytes copied into the shared buffer
+ * @ack_sum_ns: Sum of the send to ack latencies
+ * @ack_max_ns: Maximum send to ack latency
+ * @ack_last_ns: Send to ack latency of the last event
+ */
+struct udrm_local_stats {
+	unsigned long events;
+	unsigned long dirty;
+	unsigned long errors;
+	u64 bytes;
+	u64 ack_sum_ns;
+	u64 ack_max_ns;
+	u64 ack_last_ns;
+};
+
+/**
+ * struct udrm_local - Userspace stand-in for the udrm kernel module
+ * @fd: Kernel side of the event socket
+ * @mode: Display mode
+ * @buf_mode: How dirty framebuffers are copied into the shared buffer
+ * @buf: Mapping of the shared buffer
+ * @buf_size: Size of @buf
+ * @fbs: Framebuffers
+ * @next_fb_id: Id of the next framebuffer
+ * @event: Event buffer
+ * @stats: Counters
+ *
+ * Plays the kernel side of the control channel: events are sent over a
+ * socketpair and the caller blocks until the daemon has acked them, and
+ * buffers are memfds. This makes it possible to run the event loop and the
+ * flush path without the kernel module. The udrm_local_*() functions can
+ * be called from a different thread than the one running the event loop.
+ */
+struct udrm_local {
+	int fd;
+	struct drm_mode_modeinfo mode;
+	u32 buf_mode;
+	void *buf;
+	size_t buf_size;
+	struct udrm_local_fb fbs[UDRM_LOCAL_MAX_FBS];
+	unsigned int next_fb_id;
+	struct udrm_event *event;
+	struct udrm_local_stats stats;
+};
+
+extern const struct udrm_backend udrm_local_backend;
+
+static inline struct udrm_local *udrm_local_get(struct udrm_device *udev)
+{
+	return udev->backend_data;
+}
+
+int udrm_local_pipe_enable(struct udrm_local *local);
+int udrm_local_pipe_disable(struct udrm_local *local);
+int udrm_local_fb_create(struct udrm_local *local, unsigned int width, unsigned int height, u32 format);
+struct udrm_local_fb *udrm_local_fb_lookup(struct udrm_local *local, unsigned int fb_id);
+int udrm_local_fb_dirty(struct udrm_local *local, unsigned int fb_id, unsigned int flags, unsigned int color,
+			const struct drm_clip_rect *clips, unsigned int num_clips);
+int udrm_local_fb_destroy(struct udrm_local *local, unsigned int fb_id);
+void udrm_local_close(struct udrm_local *local);
+void udrm_local_print_stats(struct udrm_local *local);
+
+#endif
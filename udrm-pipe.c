@@ -0,0 +1,249 @@
+#include <stdio.h>
+
+#include "udrm.h"
+#include "udrm-latency.h"
+#include "udrm-pipe.h"
+
+static void *udrm_pipe_thread(void *data)
+{
+	struct udrm_pipe *pipe = data;
+	struct udrm_pipe_chunk chunk;
+	const void *buf;
+	u64 start;
+	int ret;
+
+	pthread_mutex_lock(&pipe->lock);
+	for (;;) {
+		while (pipe->tail == pipe->head && !pipe->stop)
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		if (pipe->tail == pipe->head)
+			break;
+
+		chunk = pipe->chunks[pipe->tail % pipe->num_bufs];
+		buf = pipe->bufs[pipe->tail % pipe->num_bufs];
+		ret = pipe->error;
+		pthread_mutex_unlock(&pipe->lock);
+
+		/* After an error the rest of the run is dropped */
+		if (!ret) {
+			udrm_latency_set_current(pipe->latency);
+			start = ktime_get_ns();
+			ret = pipe->submit(pipe->context, chunk.cmd, buf, chunk.len);
+			pipe->stats.submit_ns += ktime_get_ns() - start;
+		}
+
+		pthread_mutex_lock(&pipe->lock);
+		if (ret && !pipe->error)
+			pipe->error = ret;
+		pipe->stats.chunks++;
+		pipe->tail++;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	return NULL;
+}
+
+/**
+ * udrm_pipe_create - Start a pipeline
+ * @num_bufs: Number of staging buffers (2-4)
+ * @submit: Send a staged chunk, called from the submitter thread
+ * @context: Passed to @submit
+ *
+ * The staging buffers are allocated by udrm_pipe_reserve().
+ *
+ * Returns:
+ * Pipeline on success, error pointer on failure.
+ */
+struct udrm_pipe *udrm_pipe_create(unsigned int num_bufs,
+				   int (*submit)(void *context, unsigned int cmd, const void *buf, size_t len),
+				   void *context)
+{
+	struct udrm_pipe *pipe;
+	int ret;
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (!pipe)
+		return ERR_PTR(-ENOMEM);
+
+	pipe->num_bufs = clamp_t(unsigned int, num_bufs, UDRM_PIPE_BUFS_MIN, UDRM_PIPE_BUFS_MAX);
+	pipe->submit = submit;
+	pipe->context = context;
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+
+	ret = -pthread_create(&pipe->thread, NULL, udrm_pipe_thread, pipe);
+	if (ret) {
+		free(pipe);
+		return ERR_PTR(ret);
+	}
+
+	DRM_DEBUG_DRIVER("Pipeline started, %u buffers\n", pipe->num_bufs);
+
+	return pipe;
+}
+
+/**
+ * udrm_pipe_destroy - Stop a pipeline
+ * @pipe: Pipeline, can be NULL
+ *
+ * Chunks that have been pushed are sent before the submitter exits.
+ */
+void udrm_pipe_destroy(struct udrm_pipe *pipe)
+{
+	unsigned int i;
+
+	if (!pipe)
+		return;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->stop = true;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+	pthread_join(pipe->thread, NULL);
+
+	for (i = 0; i < pipe->num_bufs; i++)
+		free(pipe->bufs[i]);
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe);
+}
+
+/**
+ * udrm_pipe_reserve - Make sure the staging buffers are big enough
+ * @pipe: Pipeline
+ * @size: Largest chunk in the coming run
+ *
+ * Must be called between runs.
+ *
+ * Returns:
+ * False if out of memory.
+ */
+bool udrm_pipe_reserve(struct udrm_pipe *pipe, size_t size)
+{
+	unsigned int i;
+	void *new;
+
+	if (size <= pipe->buf_size)
+		return true;
+
+	for (i = 0; i < pipe->num_bufs; i++) {
+		new = realloc(pipe->bufs[i], size);
+		if (!new)
+			return false;
+		pipe->bufs[i] = new;
+	}
+	pipe->buf_size = size;
+
+	return true;
+}
+
+/**
+ * udrm_pipe_get - Get the next staging buffer
+ * @pipe: Pipeline
+ *
+ * Waits for the submitter to be done with the buffer if all of them are in
+ * use. The first call starts a run.
+ *
+ * Returns:
+ * Buffer to stage the next chunk in, pass it on with udrm_pipe_push().
+ */
+void *udrm_pipe_get(struct udrm_pipe *pipe)
+{
+	void *buf;
+
+	pthread_mutex_lock(&pipe->lock);
+	if (!pipe->running) {
+		pipe->running = true;
+		pipe->run_start_ns = ktime_get_ns();
+		pipe->latency = udrm_latency_current;
+	}
+	if (pipe->head - pipe->tail == pipe->num_bufs) {
+		pipe->stats.stalls++;
+		do {
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		} while (pipe->head - pipe->tail == pipe->num_bufs);
+	}
+	buf = pipe->bufs[pipe->head % pipe->num_bufs];
+	pthread_mutex_unlock(&pipe->lock);
+
+	pipe->stage_start_ns = ktime_get_ns();
+
+	return buf;
+}
+
+/**
+ * udrm_pipe_push - Send a staged chunk
+ * @pipe: Pipeline
+ * @cmd: Passed on to the submit callback
+ * @len: Number of bytes staged in the buffer from udrm_pipe_get()
+ *
+ * Returns:
+ * Zero on success, the error from sending an earlier chunk of the run on
+ * failure.
+ */
+int udrm_pipe_push(struct udrm_pipe *pipe, unsigned int cmd, size_t len)
+{
+	struct udrm_pipe_chunk *chunk;
+	int ret;
+
+	pipe->stats.stage_ns += ktime_get_ns() - pipe->stage_start_ns;
+
+	pthread_mutex_lock(&pipe->lock);
+	ret = pipe->error;
+	if (!ret) {
+		chunk = &pipe->chunks[pipe->head % pipe->num_bufs];
+		chunk->cmd = cmd;
+		chunk->len = len;
+		pipe->head++;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	return ret;
+}
+
+/**
+ * udrm_pipe_wait - Wait for the run to be sent
+ * @pipe: Pipeline
+ *
+ * Returns:
+ * Zero on success, the first error from sending the run on failure.
+ */
+int udrm_pipe_wait(struct udrm_pipe *pipe)
+{
+	int ret;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (pipe->tail != pipe->head)
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	if (pipe->running) {
+		pipe->stats.busy_ns += ktime_get_ns() - pipe->run_start_ns;
+		pipe->running = false;
+	}
+	ret = pipe->error;
+	pipe->error = 0;
+	pthread_mutex_unlock(&pipe->lock);
+
+	return ret;
+}
+
+/*
+ * The overlap is how much of the shorter stage was hidden behind the
+ * other one: 0% when they ran in series, 100% when the run took as long
+ * as the longer stage alone.
+ */
+void udrm_pipe_print_stats(struct udrm_pipe *pipe, const char *name)
+{
+	struct udrm_pipe_stats *stats = &pipe->stats;
+	u64 shorter = min(stats->stage_ns, stats->submit_ns);
+	u64 both = stats->stage_ns + stats->submit_ns;
+	u64 overlap = both > stats->busy_ns ? both - stats->busy_ns : 0;
+
+	DRM_INFO("%s: pipeline buffers=%u, chunks=%lu, stalls=%lu, stage=%llums, submit=%llums, busy=%llums, overlap=%llu%%\n",
+		 name, pipe->num_bufs, stats->chunks, stats->stalls,
+		 (unsigned long long)(stats->stage_ns / NSEC_PER_MSEC),
+		 (unsigned long long)(stats->submit_ns / NSEC_PER_MSEC),
+		 (unsigned long long)(stats->busy_ns / NSEC_PER_MSEC),
+		 shorter ? (unsigned long long)(min(overlap, shorter) * 100 / shorter) : 0ULL);
+}
@@ -0,0 +1,99 @@
+#ifndef _UDRM_PIPE_H
+#define _UDRM_PIPE_H
+
+#include <pthread.h>
+
+#include "base.h"
+
+struct udrm_latency;
+
+#define UDRM_PIPE_BUFS_MIN	2
+#define UDRM_PIPE_BUFS_MAX	4
+
+/**
+ * struct udrm_pipe_chunk - Staged chunk
+ * @cmd: Passed on to the submit callback
+ * @len: Number of bytes staged
+ */
+struct udrm_pipe_chunk {
+	unsigned int cmd;
+	size_t len;
+};
+
+/**
+ * struct udrm_pipe_stats - Pipeline counters
+ * @chunks: Number of chunks sent
+ * @stalls: Chunks that had to wait for a free staging buffer
+ * @stage_ns: Time spent filling the staging buffers (producer)
+ * @submit_ns: Time spent sending them (submitter)
+ * @busy_ns: Time from the first chunk to the last one sent, summed over
+ *           the runs
+ */
+struct udrm_pipe_stats {
+	unsigned long chunks;
+	unsigned long stalls;
+	u64 stage_ns;
+	u64 submit_ns;
+	u64 busy_ns;
+};
+
+/**
+ * struct udrm_pipe - Double buffered staging and sending
+ * @submit: Send @len bytes of @buf, called from the submitter thread
+ * @context: Passed to @submit
+ * @thread: Submitter thread
+ * @lock: Protects the ring
+ * @cond: Signalled when a chunk is pushed or sent
+ * @bufs: Staging buffers, chunk n uses buffer n % @num_bufs
+ * @num_bufs: Number of staging buffers, the depth of the ring
+ * @buf_size: Size of each staging buffer
+ * @chunks: Ring of chunks
+ * @head: Next chunk to stage, only written by the producer
+ * @tail: Next chunk to send, only written by the submitter, the chunk
+ *        keeps its buffer until it's been sent
+ * @error: First error from @submit, the rest of the run is dropped
+ * @stop: Tell the submitter to exit
+ * @running: A run has started and hasn't been waited for
+ * @run_start_ns: When the run started
+ * @stage_start_ns: When the producer got the buffer it's filling
+ * @latency: Latency histograms of the device being flushed
+ * @stats: Counters
+ *
+ * The producer fills chunk N+1 while the submitter thread is sending chunk
+ * N. When all the buffers are in use, the producer waits for the submitter
+ * to finish with the oldest one so at most @num_bufs chunks are staged ahead
+ * of the bus. A run ends with udrm_pipe_wait(), and nothing else may use
+ * the bus while a run is going on.
+ */
+struct udrm_pipe {
+	int (*submit)(void *context, unsigned int cmd, const void *buf, size_t len);
+	void *context;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void *bufs[UDRM_PIPE_BUFS_MAX];
+	unsigned int num_bufs;
+	size_t buf_size;
+	struct udrm_pipe_chunk chunks[UDRM_PIPE_BUFS_MAX];
+	unsigned int head;
+	unsigned int tail;
+	int error;
+	bool stop;
+	bool running;
+	u64 run_start_ns;
+	u64 stage_start_ns;
+	struct udrm_latency *latency;
+	struct udrm_pipe_stats stats;
+};
+
+struct udrm_pipe *udrm_pipe_create(unsigned int num_bufs,
+				   int (*submit)(void *context, unsigned int cmd, const void *buf, size_t len),
+				   void *context);
+void udrm_pipe_destroy(struct udrm_pipe *pipe);
+bool udrm_pipe_reserve(struct udrm_pipe *pipe, size_t size);
+void *udrm_pipe_get(struct udrm_pipe *pipe);
+int udrm_pipe_push(struct udrm_pipe *pipe, unsigned int cmd, size_t len);
+int udrm_pipe_wait(struct udrm_pipe *pipe);
+void udrm_pipe_print_stats(struct udrm_pipe *pipe, const char *name);
+
+#endif
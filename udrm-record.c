@@ -0,0 +1,161 @@
+// memset
+#include <string.h>
+
+#include "udrm-record.h"
+
+/**
+ * udrm_record_start - Start recording events
+ * @udev: udrm device
+ * @fname: File to record into, it is truncated
+ *
+ * Returns:
+ * Recorder or ERR_PTR on failure.
+ */
+struct udrm_recorder *udrm_record_start(struct udrm_device *udev, const char *fname)
+{
+	struct udrm_record_header header;
+	struct udrm_recorder *rec;
+	int ret;
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return ERR_PTR(-ENOMEM);
+
+	rec->file = fopen(fname, "w");
+	if (!rec->file) {
+		ret = -errno;
+		pr_err("%s: Failed to open %s: %s\n", __func__, fname, strerror(errno));
+		free(rec);
+		return ERR_PTR(ret);
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = UDRM_RECORD_MAGIC;
+	header.version = UDRM_RECORD_VERSION;
+	header.prime = udev->prime;
+	header.mode = *udev->mode;
+
+	if (fwrite(&header, sizeof(header), 1, rec->file) != 1) {
+		pr_err("%s: Failed to write header\n", __func__);
+		fclose(rec->file);
+		free(rec);
+		return ERR_PTR(-EIO);
+	}
+
+	rec->start_ns = ktime_get_ns();
+	DRM_INFO("Recording events to %s\n", fname);
+
+	return rec;
+}
+
+static size_t udrm_record_clip_size(struct udrm_framebuffer *ufb, struct drm_clip_rect *clip)
+{
+	return (size_t)(clip->x2 - clip->x1) * (clip->y2 - clip->y1) * udrm_buf_cpp(ufb);
+}
+
+static void udrm_record_clip(struct udrm_recorder *rec, struct udrm_framebuffer *ufb,
+			     const void *vaddr, struct drm_clip_rect *clip)
+{
+	unsigned int pitch = udrm_buf_pitch(ufb);
+	unsigned int cpp = udrm_buf_cpp(ufb);
+	size_t len = (clip->x2 - clip->x1) * cpp;
+	unsigned int y;
+
+	for (y = clip->y1; y < clip->y2; y++)
+		fwrite(vaddr + y * pitch + clip->x1 * cpp, len, 1, rec->file);
+}
+
+/**
+ * udrm_record_event - Record an event
+ * @rec: Recorder
+ * @ev: Event
+ * @ufb: Framebuffer the event refers to, NULL if none
+ * @timestamp_ns: When the event was read
+ * @event_ret: What the event is acked with
+ *
+ * Must be called before the event is acked, the kernel only keeps the
+ * pixels stable until then.
+ */
+void udrm_record_event(struct udrm_recorder *rec, struct udrm_event *ev, struct udrm_framebuffer *ufb,
+		       u64 timestamp_ns, int event_ret)
+{
+	struct udrm_event_fb_dirty *dirty = (struct udrm_event_fb_dirty *)ev;
+	struct drm_clip_rect full, *clips = NULL;
+	struct udrm_record_entry entry;
+	struct udrm_record_fb rfb;
+	unsigned int i, num_clips = 0;
+	struct dma_buf *dmabuf;
+	const void *vaddr = NULL;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.timestamp_ns = timestamp_ns - rec->start_ns;
+	entry.event_len = ev->length;
+	entry.event_ret = event_ret;
+
+	if (ufb && ev->type == UDRM_EVENT_FB_CREATE) {
+		entry.data_len = sizeof(rfb);
+		rfb.width = ufb->width;
+		rfb.height = ufb->height;
+		rfb.cpp = udrm_buf_cpp(ufb);
+		rfb.pixel_format = ufb->dmabuf ? ufb->pixel_format : DRM_FORMAT_RGB565;
+	} else if (ufb && ev->type == UDRM_EVENT_FB_DIRTY) {
+		dmabuf = ufb->dmabuf ? ufb->dmabuf : ufb->udev->dmabuf;
+		vaddr = ufb->vaddr;
+		if (!vaddr && dmabuf)
+			vaddr = dmabuf->vaddr ? : dma_buf_vmap(dmabuf);
+
+		full.x1 = 0;
+		full.y1 = 0;
+		full.x2 = ufb->width;
+		full.y2 = ufb->height;
+
+		if (dirty->fb_dirty_cmd.num_clips) {
+			clips = dirty->clips;
+			num_clips = dirty->fb_dirty_cmd.num_clips;
+		} else {
+			clips = &full;
+			num_clips = 1;
+		}
+
+		/* the kernel has clipped to the framebuffer, don't trust it blindly */
+		for (i = 0; i < num_clips; i++) {
+			if (clips[i].x2 > ufb->width || clips[i].y2 > ufb->height ||
+			    clips[i].x1 > clips[i].x2 || clips[i].y1 > clips[i].y2) {
+				vaddr = NULL;
+				break;
+			}
+		}
+
+		for (i = 0; vaddr && i < num_clips; i++)
+			entry.data_len += udrm_record_clip_size(ufb, &clips[i]);
+		if (!vaddr)
+			num_clips = 0;
+	}
+
+	fwrite(&entry, sizeof(entry), 1, rec->file);
+	fwrite(ev, ev->length, 1, rec->file);
+
+	if (ev->type == UDRM_EVENT_FB_CREATE && entry.data_len)
+		fwrite(&rfb, sizeof(rfb), 1, rec->file);
+
+	for (i = 0; i < num_clips; i++)
+		udrm_record_clip(rec, ufb, vaddr, &clips[i]);
+
+	rec->events++;
+	rec->bytes += entry.data_len;
+
+	if (ferror(rec->file)) {
+		pr_err("%s: Failed to write recording\n", __func__);
+		clearerr(rec->file);
+	}
+}
+
+void udrm_record_stop(struct udrm_recorder *rec)
+{
+	if (!rec)
+		return;
+
+	DRM_INFO("Recorded %lu events, %llukB pixels\n", rec->events, (unsigned long long)(rec->bytes / 1024));
+	fclose(rec->file);
+	free(rec);
+}
@@ -0,0 +1,80 @@
+#ifndef _UDRM_RECORD_H
+#define _UDRM_RECORD_H
+
+#include <stdio.h>
+
+#include "udrm.h"
+
+#define UDRM_RECORD_MAGIC	0x43455255	/* "UREC" */
+#define UDRM_RECORD_VERSION	1
+
+/**
+ * struct udrm_record_header - Recording file header
+ * @magic: UDRM_RECORD_MAGIC
+ * @version: UDRM_RECORD_VERSION
+ * @prime: The framebuffers were read directly, otherwise from the RGB565
+ *         shared buffer
+ * @mode: Display mode
+ */
+struct udrm_record_header {
+	u32 magic;
+	u32 version;
+	u32 prime;
+	struct drm_mode_modeinfo mode;
+};
+
+/**
+ * struct udrm_record_entry - One recorded event
+ * @timestamp_ns: When the event was read, relative to the start
+ * @event_len: Length of the event that follows
+ * @data_len: Length of the data that follows the event
+ * @event_ret: What the event was acked with
+ *
+ * The event is followed by data depending on the type:
+ * FB_CREATE: struct udrm_record_fb
+ * FB_DIRTY: The damaged pixels as the flush path saw them, clip by clip,
+ *           line by line, udrm_record_fb->cpp bytes per pixel. The whole
+ *           framebuffer if there are no clips.
+ */
+struct udrm_record_entry {
+	u64 timestamp_ns;
+	u32 event_len;
+	u32 data_len;
+	s32 event_ret;
+	u32 reserved;
+};
+
+/**
+ * struct udrm_record_fb - Recorded framebuffer
+ * @width: Width
+ * @height: Height
+ * @cpp: Bytes per pixel of the recorded pixels
+ * @pixel_format: Format of the recorded pixels
+ */
+struct udrm_record_fb {
+	u32 width;
+	u32 height;
+	u32 cpp;
+	u32 pixel_format;
+};
+
+/**
+ * struct udrm_recorder - Event stream recorder
+ * @file: Recording
+ * @start_ns: Start of the recording
+ * @events: Events recorded
+ * @bytes: Pixel bytes recorded
+ */
+struct udrm_recorder {
+	FILE *file;
+	u64 start_ns;
+	unsigned long events;
+	u64 bytes;
+};
+
+struct udrm_recorder *udrm_record_start(struct udrm_device *udev, const char *fname);
+void udrm_record_event(struct udrm_recorder *rec, struct udrm_event *ev, struct udrm_framebuffer *ufb,
+		       u64 timestamp_ns, int event_ret);
+void udrm_record_stop(struct udrm_recorder *rec);
+
+#endif
@@ -20,10 +20,12 @@
 
 #include "device.h"
 #include "udrm.h"
+#include "udrm-flush.h"
+#include "udrm-record.h"
 
 int udrm_debug = 0xff;
 
-static int udrm_create_dma_buf(size_t size)
+static int udrm_kernel_create_buf(struct udrm_device *udev, size_t size)
 {
 	struct dma_buf_dev_create create = {
 		.attrs = DMA_BUF_DEV_ATTR_WRITE_COMBINE,
@@ -52,28 +54,10 @@ out:
 	return ret;
 }
 
-int udrm_register(struct udrm_device *udev, const char *name, const struct drm_mode_modeinfo *mode,
-		  const uint32_t *formats, unsigned int num_formats, u32 buf_mode)
+static int udrm_kernel_dev_create(struct udrm_device *udev, struct udrm_dev_create *create)
 {
-	struct udrm_dev_create udev_create;
 	char ctrl_fname[PATH_MAX];
-	int ret, dmabuf_fd;
-
-	udev->name = name;
-	udev->mode = mode;
-
-	/* FIXME */
-	dmabuf_fd = udrm_create_dma_buf(320 * 240 * 2);
-	if (dmabuf_fd < 0)
-		return dmabuf_fd;
-
-	memset(&udev_create, 0, sizeof(udev_create));
-	udev_create.buf_fd = dmabuf_fd;
-	udev_create.mode = *mode;
-	udev_create.formats = (unsigned long)formats;
-	udev_create.num_formats = num_formats;
-	udev_create.buf_mode = buf_mode;
-	strncpy(udev_create.name, name, UDRM_MAX_NAME_SIZE);
+	int ret;
 
 	udev->fd = open("/dev/udrm", O_RDWR);
 	if (udev->fd < 0) {
@@ -81,15 +65,15 @@ int udrm_register(struct udrm_device *udev, const char *name, const struct drm_m
 		return -errno;
 	}
 
-	ret = ioctl(udev->fd, UDRM_DEV_CREATE, &udev_create);
+	ret = ioctl(udev->fd, UDRM_DEV_CREATE, create);
 	if (ret < 0) {
 		pr_err("%s: Failed to create device: %s\n", __func__, strerror(errno));
 		close(udev->fd);
 		return -errno;
 	}
 
-	snprintf(ctrl_fname, sizeof(ctrl_fname), "/dev/dri/controlD%d", udev_create.index + 64);
-	DRM_DEBUG("DRM index: %d, ctrl_fname=%s\n", udev_create.index, ctrl_fname);
+	snprintf(ctrl_fname, sizeof(ctrl_fname), "/dev/dri/controlD%d", create->index + 64);
+	DRM_DEBUG("DRM index: %d, ctrl_fname=%s\n", create->index, ctrl_fname);
 
 	udev->control_fd = open(ctrl_fname, O_RDWR);
 	if (udev->control_fd == -1) {
@@ -98,26 +82,230 @@ int udrm_register(struct udrm_device *udev, const char *name, const struct drm_m
 		return -errno;
 	}
 
+	return 0;
+}
+
+static int udrm_kernel_get_fb(struct udrm_device *udev, struct drm_mode_fb_cmd *info)
+{
+	if (ioctl(udev->control_fd, DRM_IOCTL_MODE_GETFB, info) == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int udrm_kernel_export_fb(struct udrm_device *udev, unsigned int handle)
+{
+	struct drm_prime_handle prime = {
+		.handle = handle,
+		.flags = DRM_CLOEXEC,
+	};
+
+	if (ioctl(udev->control_fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime) == -1)
+		return -errno;
+
+	return prime.fd;
+}
+
+/* The udrm kernel module */
+const struct udrm_backend udrm_kernel_backend = {
+	.name = "kernel",
+	.create_buf = udrm_kernel_create_buf,
+	.dev_create = udrm_kernel_dev_create,
+	.get_fb = udrm_kernel_get_fb,
+	.export_fb = udrm_kernel_export_fb,
+};
+
+/* Returns a dma-buf file descriptor or a negative error code */
+int udrm_create_dma_buf(struct udrm_device *udev, size_t size)
+{
+	return udev->backend->create_buf(udev, size);
+}
+
+static unsigned int udrm_format_cpp(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_C8:
+		return 1;
+	case DRM_FORMAT_RGB565:
+	case DRM_FORMAT_XRGB1555:
+		return 2;
+	case DRM_FORMAT_RGB888:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
+/* The shared buffer holds a full frame in the widest format the kernel copies */
+static size_t udrm_buf_size(const struct drm_mode_modeinfo *mode, const uint32_t *formats,
+			    unsigned int num_formats, u32 buf_mode)
+{
+	unsigned int i, cpp = 0;
+
+	for (i = 0; i < num_formats; i++) {
+		if (formats[i] == DRM_FORMAT_XRGB8888 && (buf_mode & UDRM_BUF_MODE_EMUL_XRGB8888))
+			cpp = max(cpp, 2U);
+		else
+			cpp = max(cpp, udrm_format_cpp(formats[i]));
+	}
+
+	return (size_t)mode->hdisplay * mode->vdisplay * cpp;
+}
+
+int udrm_register(struct udrm_device *udev, const char *name, const struct drm_mode_modeinfo *mode,
+		  const uint32_t *formats, unsigned int num_formats, u32 buf_mode)
+{
+	struct udrm_dev_create udev_create;
+	const char *record;
+	u32 fps, burst = 0, idle_ms = 0;
+	int ret, dmabuf_fd;
+	size_t size;
+
+	udev->name = name;
+	udev->mode = mode;
+	if (!udev->backend)
+		udev->backend = &udrm_kernel_backend;
+
+	udev->stats.start_ns = ktime_get_ns();
+
+	udev->latency = udrm_latency_alloc();
+	if (IS_ERR(udev->latency))
+		return PTR_ERR(udev->latency);
+
+	memset(udev->fb_table, -1, sizeof(udev->fb_table));
+	udev->fb_free = ~0U;
+	udev->fb_damaged = 0;
+	udev->fb_urgent = 0;
+
+	if (udev->dev)
+		udev->batch = device_property_read_bool(udev->dev, "batch-events");
+
+	/* small damage that may interrupt a flush, see udrm_preempt() */
+	udev->preempt_pixels = 0;
+	if (udev->dev)
+		device_property_read_u32(udev->dev, "preempt-pixels", &udev->preempt_pixels);
+
+	udev->frame_ns = 0;
+	if (udev->dev && !device_property_read_u32(udev->dev, "fps", &fps) && fps) {
+		device_property_read_u32(udev->dev, "fps-burst", &burst);
+		udev->frame_ns = NSEC_PER_SEC / fps;
+		udev->burst_ns = burst * udev->frame_ns;
+		udev->next_flush_ns = 0;
+		DRM_DEBUG("Frame pacing: %u fps, burst %u\n", fps, burst);
+	}
+
+	udev->idle_ns = 0;
+	udev->fb_idle = NULL;
+	if (udev->dev && udev->funcs && udev->funcs->idle &&
+	    !device_property_read_u32(udev->dev, "idle-ms", &idle_ms))
+		udev->idle_ns = (u64)idle_ms * NSEC_PER_MSEC;
+
+	/* Without a kernel copy the framebuffers are read directly */
+	udev->prime = !(buf_mode & (UDRM_BUF_MODE_PLAIN_COPY | UDRM_BUF_MODE_SWAP_BYTES));
+
+	size = udrm_buf_size(mode, formats, num_formats, buf_mode);
+	if (!size) {
+		ret = -EINVAL;
+		goto err_free_latency;
+	}
+
+	dmabuf_fd = udrm_create_dma_buf(udev, size);
+	if (dmabuf_fd < 0) {
+		ret = dmabuf_fd;
+		goto err_free_latency;
+	}
+
+	DRM_DEBUG("%ux%u, buffer size %zu\n", mode->hdisplay, mode->vdisplay, size);
+
+	memset(&udev_create, 0, sizeof(udev_create));
+	udev_create.buf_fd = dmabuf_fd;
+	udev_create.mode = *mode;
+	udev_create.formats = (unsigned long)formats;
+	udev_create.num_formats = num_formats;
+	udev_create.buf_mode = buf_mode;
+	strncpy(udev_create.name, name, UDRM_MAX_NAME_SIZE);
+
+	ret = udev->backend->dev_create(udev, &udev_create);
+	if (ret)
+		goto err_close_buf;
+
 	if (udev_create.buf_fd >= 0) {
+		/* the dma_buf takes over the fd */
 		udev->dmabuf = dma_buf_get(udev_create.buf_fd);
 		if (IS_ERR(udev->dmabuf)) {
-			close(udev->control_fd);
-			close(udev->fd);
-			return PTR_ERR(udev->dmabuf);
+			ret = PTR_ERR(udev->dmabuf);
+			udev->dmabuf = NULL;
+			goto err_dev_destroy;
 		}
 	}
 
 	DRM_DEBUG_KMS("buf_fd=%d\n", udev_create.buf_fd);
 
+	/* record the event stream for udrm-bench to replay */
+	if (udev->dev && !device_property_read_string(udev->dev, "record", &record)) {
+		udev->record = udrm_record_start(udev, record);
+		if (IS_ERR(udev->record)) {
+			ret = PTR_ERR(udev->record);
+			udev->record = NULL;
+			udrm_unregister(udev);
+			return ret;
+		}
+	}
+
+	if (udev->dev && device_property_read_bool(udev->dev, "async-flush")) {
+		udev->flush = udrm_flush_worker_start(udev);
+		if (IS_ERR(udev->flush)) {
+			ret = PTR_ERR(udev->flush);
+			pr_err("%s: Failed to start flush worker: %d\n", __func__, ret);
+			udev->flush = NULL;
+			udrm_unregister(udev);
+			return ret;
+		}
+	}
+
 	return 0;
+
+err_dev_destroy:
+	close(udev->control_fd);
+	close(udev->fd);
+	if (udev->backend->dev_destroy)
+		udev->backend->dev_destroy(udev);
+err_close_buf:
+	close(dmabuf_fd);
+err_free_latency:
+	udrm_latency_free(udev->latency);
+	udev->latency = NULL;
+
+	return ret;
 }
 
 void udrm_unregister(struct udrm_device *udev)
 {
+	u32 used = ~udev->fb_free;
+	int idx;
+
+	if (udev->flush) {
+		/* the worker can be shared, make sure it's done with this device */
+		udrm_flush_wait_idle(udev->flush);
+		udrm_flush_worker_stop(udev->flush);
+	}
+	udrm_record_stop(udev->record);
+	udrm_latency_free(udev->latency);
+	free(udev->event);
+	while (used) {
+		idx = __builtin_ctz(used);
+		used &= ~BIT(idx);
+		if (udev->fb_pool[idx].dmabuf)
+			dma_buf_put(udev->fb_pool[idx].dmabuf);
+		region_fini(&udev->fb_pool[idx].damage);
+		region_fini(&udev->fb_pool[idx].urgent);
+	}
 	if (udev->dmabuf)
 		dma_buf_put(udev->dmabuf);
 	close(udev->control_fd);
 	close(udev->fd);
+	if (udev->backend->dev_destroy)
+		udev->backend->dev_destroy(udev);
 }
 
 
@@ -141,6 +329,7 @@ static int udrm_disable(struct udrm_device *udev, struct udrm_event *ev)
 {
 	DRM_DEBUG("Disable\n");
 
+	udev->fb_idle = NULL;
 	if (udev->funcs && udev->funcs->disable)
 		udev->funcs->disable(udev);
 
@@ -181,104 +370,504 @@ static uint32_t drm_mode_legacy_fb_format(uint32_t bpp, uint32_t depth)
 	return fmt;
 }
 
+static unsigned int udrm_fb_hash(unsigned int fb_id)
+{
+	/* Fibonacci hashing, ids are small sequential numbers */
+	return (u32)(fb_id * 0x9e3779b1U) >> (32 - UDRM_FB_TABLE_BITS);
+}
+
+/* Returns the hash table slot for @fb_id, or the empty slot ending the probe */
+static unsigned int udrm_fb_slot(struct udrm_device *udev, unsigned int fb_id)
+{
+	unsigned int slot = udrm_fb_hash(fb_id);
+	int idx;
+
+	/* The table is larger than the pool so there's always an empty slot */
+	while ((idx = udev->fb_table[slot]) >= 0) {
+		if (udev->fb_pool[idx].id == fb_id)
+			break;
+		slot = (slot + 1) & (UDRM_FB_TABLE_SIZE - 1);
+	}
+
+	return slot;
+}
+
+/*
+ * Linear probing deletion without tombstones: move following entries of the
+ * probe sequence back into the hole if their home slot allows it.
+ */
+static void udrm_fb_table_remove(struct udrm_device *udev, unsigned int slot)
+{
+	const unsigned int mask = UDRM_FB_TABLE_SIZE - 1;
+	unsigned int next, home;
+	int idx;
+
+	udev->fb_table[slot] = -1;
+
+	for (next = (slot + 1) & mask; (idx = udev->fb_table[next]) >= 0; next = (next + 1) & mask) {
+		home = udrm_fb_hash(udev->fb_pool[idx].id);
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			udev->fb_table[slot] = idx;
+			udev->fb_table[next] = -1;
+			slot = next;
+		}
+	}
+}
+
+static struct udrm_framebuffer *udrm_fb_lookup(struct udrm_device *udev, unsigned int fb_id)
+{
+	int idx = udev->fb_table[udrm_fb_slot(udev, fb_id)];
+
+	return idx < 0 ? NULL : &udev->fb_pool[idx];
+}
+
+/* Export the GEM buffer so the flush path can read it without a kernel copy */
+static struct dma_buf *udrm_fb_export(struct udrm_device *udev, unsigned int handle)
+{
+	struct dma_buf *dmabuf;
+	int fd;
+
+	fd = udev->backend->export_fb(udev, handle);
+	if (fd < 0)
+		return ERR_PTR(fd);
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		close(fd);
+
+	return dmabuf;
+}
+
 static int udrm_fb_create(struct udrm_device *udev, struct udrm_event_fb *ev)
 {
 	struct drm_mode_fb_cmd info = {
 		.fb_id = ev->fb_id,
 	};
-	int ret;
-//	struct drm_prime_handle prime;
+	struct dma_buf *dmabuf = NULL;
 	struct udrm_framebuffer *ufb;
+	int ret;
+	unsigned int slot;
+	int idx;
 
-	ufb = calloc(1, sizeof(*ufb));
-	if (!ufb)
-		return -ENOMEM;
+	slot = udrm_fb_slot(udev, ev->fb_id);
+	if (udev->fb_table[slot] >= 0) {
+		DRM_ERROR("[FB:%u] Framebuffer already exists\n", ev->fb_id);
+		return -EEXIST;
+	}
 
-	ufb->id = info.fb_id;
+	if (!udev->fb_free) {
+		DRM_ERROR("[FB:%u] Too many framebuffers (max %u)\n", ev->fb_id, UDRM_MAX_FBS);
+		return -ENOSPC;
+	}
 
-	ret = ioctl(udev->control_fd, DRM_IOCTL_MODE_GETFB, &info);
-	if (ret == -1) {
-		DRM_ERROR("[FB:%u] Failed to get framebuffer info: %s\n", ev->fb_id, strerror(errno));
-		ret = -errno;
-		goto error;
+	ret = udev->backend->get_fb(udev, &info);
+	if (ret) {
+		DRM_ERROR("[FB:%u] Failed to get framebuffer info: %s\n", ev->fb_id, strerror(-ret));
+		return ret;
 	}
 
+	if (udev->prime) {
+		dmabuf = udrm_fb_export(udev, info.handle);
+		if (IS_ERR(dmabuf)) {
+			ret = PTR_ERR(dmabuf);
+			DRM_ERROR("[FB:%u] Failed to export framebuffer: %d\n", ev->fb_id, ret);
+			return ret;
+		}
+	}
+
+	idx = __builtin_ctz(udev->fb_free);
+	ufb = &udev->fb_pool[idx];
+	memset(ufb, 0, sizeof(*ufb));
+	region_init(&ufb->damage);
+	region_init(&ufb->urgent);
+
 	ufb->udev = udev;
+	ufb->id = info.fb_id;
 	ufb->handle = info.handle;
 	ufb->pitch = info.pitch;
 	ufb->width = info.width;
 	ufb->height = info.height;
-	//fb->bpp = info.bpp;
+	ufb->cpp = DIV_ROUND_UP(info.bpp, 8);
+	ufb->dmabuf = dmabuf;
 	//fb->depth = info.depth
 	ufb->pixel_format = drm_mode_legacy_fb_format(info.bpp, info.depth);
 
-	/* FIXME: emulation */
-	if (ufb->pixel_format == DRM_FORMAT_XRGB8888)
-		ufb->pixel_format = DRM_FORMAT_RGB565;
-
-	DRM_DEBUG("[FB:%u] Create: %ux%u, handle=%u\n", ufb->id, ufb->width, ufb->height, ufb->handle);
+	DRM_DEBUG("[FB:%u] Create: %ux%u, handle=%u, dmabuf=%d\n", ufb->id, ufb->width, ufb->height,
+		  ufb->handle, dmabuf ? dmabuf->fd : -1);
 
-	ufb->next = udev->fbs;
-	udev->fbs = ufb;
+	udev->fb_free &= ~BIT(idx);
+	udev->fb_table[slot] = idx;
 
 	return 0;
-
-error:
-	free(ufb);
-
-	return ret;
 }
 
 static int udrm_fb_destroy(struct udrm_device *udev, struct udrm_event_fb *ev)
 {
-	struct udrm_framebuffer **prev, **curr, *ufb = NULL;
+	struct udrm_framebuffer *ufb;
+	unsigned int slot;
+	int idx;
 
 	DRM_DEBUG("[FB:%u] Destroy\n", ev->fb_id);
 
-	for (prev = NULL, curr = &udev->fbs; *curr != NULL; prev = curr, curr = &(*curr)->next) {
-		//printf("(*curr)->id=%u, *curr=%p, *curr->next=%p\n", (*curr)->id, *curr, (*curr)->next);
-		if ((*curr)->id == ev->fb_id) {
-			ufb = *curr;
-			if (prev)
-				(*prev)->next = (*curr)->next;
-			else
-				(*curr) = (*curr)->next;
-			break;
-		}
-	}
-
-	if (!ufb) {
+	slot = udrm_fb_slot(udev, ev->fb_id);
+	idx = udev->fb_table[slot];
+	if (idx < 0) {
 		pr_err("%s: Failed to find framebuffer %u\n", __func__, ev->fb_id);
 		return -EINVAL;
 	}
 
-	free(ufb);
+	ufb = &udev->fb_pool[idx];
+	if (ufb->dmabuf)
+		dma_buf_put(ufb->dmabuf);
+	region_fini(&ufb->damage);
+	region_fini(&ufb->urgent);
+	ufb->id = 0;
+
+	udrm_fb_table_remove(udev, slot);
+	if (udev->fb_idle == ufb)
+		udev->fb_idle = NULL;
+	udev->fb_damaged &= ~BIT(idx);
+	udev->fb_urgent &= ~BIT(idx);
+	udev->fb_free |= BIT(idx);
 
 	return 0;
 }
 
+/*
+ * Hand the damage to the flush worker if there is one, annotated dirty calls
+ * (fill/copy) are always flushed synchronously.
+ */
+static int udrm_fb_flush(struct udrm_device *udev, struct udrm_framebuffer *ufb,
+			 unsigned int flags, unsigned int color,
+			 struct drm_clip_rect *clips, unsigned int num_clips)
+{
+	u64 start;
+	int ret;
+
+	if (!udev->funcs || !udev->funcs->dirtyfb)
+		return 0;
+
+	udev->stats.flushes++;
+
+	if (udev->idle_ns) {
+		udev->fb_idle = ufb;
+		udev->idle_due_ns = ktime_get_ns() + udev->idle_ns;
+	}
+
+	if (udev->flush) {
+		if (!flags)
+			return udrm_flush_queue(udev->flush, ufb, clips, num_clips);
+		udrm_flush_wait_idle(udev->flush);
+	}
+
+	start = udrm_latency_now();
+	udrm_latency_set_current(udev->latency);
+	ret = udev->funcs->dirtyfb(ufb, flags, color, clips, num_clips);
+	udrm_latency_set_current(NULL);
+	udrm_latency_add(udev->latency, UDRM_LATENCY_FLUSH, start);
+	udrm_latency_add(udev->latency, UDRM_LATENCY_PANEL, udev->event_ns);
+
+	return ret;
+}
+
 static int udrm_fb_dirty(struct udrm_device *udev, struct udrm_event_fb_dirty *ev)
 {
 	struct drm_mode_fb_dirty_cmd *dirty = &ev->fb_dirty_cmd;
 	struct udrm_framebuffer *ufb;
-	int ret = 0;
 
-	for (ufb = udev->fbs; ufb != NULL; ufb = ufb->next) {
-		if (ufb->id == ev->fb_dirty_cmd.fb_id)
-			break;
+	ufb = udrm_fb_lookup(udev, dirty->fb_id);
+	if (!ufb) {
+		DRM_ERROR("[FB:%u] Framebuffer not found\n", dirty->fb_id);
+		return -EINVAL;
 	}
 
+	udrm_latency_add(udev->latency, UDRM_LATENCY_LOOKUP, udev->event_ns);
+	DRM_DEBUG("[FB:%u] Dirty\n", ufb->id);
+
+	return udrm_fb_flush(udev, ufb, dirty->flags, dirty->color, ev->clips, dirty->num_clips);
+}
+
+/*
+ * Flush damage of a framebuffer, @src is ufb->damage or ufb->urgent. It's
+ * moved out of the framebuffer first so damage arriving during a
+ * preemptible flush is collected anew.
+ */
+static u64 udrm_flush_fb_damage(struct udrm_device *udev, struct udrm_framebuffer *ufb,
+				struct region *src)
+{
+	struct region damage;
+	u64 pixels = 0;
+	unsigned int i;
+	int ret;
+
+	region_init(&damage);
+	region_move(&damage, src);
+	if (region_empty(&damage))
+		return 0;
+
+	region_simplify(&damage, UDRM_DAMAGE_MAX_RECTS);
+
+	DRM_DEBUG("[FB:%u] Flush damage num_rects=%u, x1=%u, x2=%u, y1=%u, y2=%u\n",
+		  ufb->id, damage.num_rects, damage.extents.x1, damage.extents.x2,
+		  damage.extents.y1, damage.extents.y2);
+
+	for (i = 0; i < damage.num_rects; i++)
+		pixels += region_area(&damage.rects[i]);
+
+	ret = udrm_fb_flush(udev, ufb, 0, 0, damage.rects, damage.num_rects);
+	if (ret)
+		DRM_ERROR("[FB:%u] Failed to flush damage: %d\n", ufb->id, ret);
+
+	region_fini(&damage);
+
+	return pixels;
+}
+
+/*
+ * Small damage is flushed as soon as the event queue is drained, it doesn't
+ * wait for pacing. Damage that is already pending for the same framebuffer
+ * waits, it's just the latest dirty event that is small.
+ */
+static bool udrm_flush_urgent(struct udrm_device *udev)
+{
+	struct udrm_stats *stats = &udev->stats;
+	bool preemptible = udev->preemptible;
+	u64 event_ns = udev->event_ns;
+	int idx;
+
+	if (!udev->fb_urgent)
+		return false;
+
+	/* no nesting, an interrupted flush keeps its latency reference */
+	udev->preemptible = false;
+	udev->event_ns = udev->urgent_ns;
+
+	while (udev->fb_urgent) {
+		idx = __builtin_ctz(udev->fb_urgent);
+		udev->fb_urgent &= ~BIT(idx);
+		stats->urgent_pixels += udrm_flush_fb_damage(udev, &udev->fb_pool[idx],
+							     &udev->fb_pool[idx].urgent);
+		stats->urgent_flushes++;
+	}
+
+	udev->urgent_ns = 0;
+	udev->event_ns = event_ns;
+	udev->preemptible = preemptible;
+
+	return true;
+}
+
+/*
+ * Flush and clear the damage collected by udrm_fb_damage(). Only the damage
+ * that is here now is flushed, a preemptible flush can pick up more while
+ * it's going on.
+ */
+static void udrm_flush_damage(struct udrm_device *udev, bool preemptible)
+{
+	struct udrm_stats *stats = &udev->stats;
+	u32 damaged;
+	int idx;
+	u64 wait;
+
+	udrm_flush_urgent(udev);
+
+	if (udev->damage_ns) {
+		wait = ktime_get_ns() - udev->damage_ns;
+		stats->damage_wait_ns += wait;
+		stats->damage_wait_max_ns = max(stats->damage_wait_max_ns, wait);
+		stats->damage_flushes++;
+		udev->event_ns = udev->damage_ns;
+		udev->damage_ns = 0;
+	}
+
+	/* the flush worker can't read events */
+	udev->preemptible = preemptible && udev->preempt_pixels && !udev->flush;
+	damaged = udev->fb_damaged;
+	udev->fb_damaged = 0;
+	while (damaged) {
+		idx = __builtin_ctz(damaged);
+		damaged &= ~BIT(idx);
+		stats->damage_pixels += udrm_flush_fb_damage(udev, &udev->fb_pool[idx],
+							     &udev->fb_pool[idx].damage);
+	}
+	udev->preemptible = false;
+}
+
+/*
+ * Frame pacing (fps property): Damage is accumulated like in batching mode
+ * and flushed at most once per frame period. next_flush_ns advances one
+ * period per flush and stays on that grid as long as flushing keeps up,
+ * after being idle the schedule restarts. The schedule may fall
+ * fps-burst periods behind, so after being idle that many extra updates
+ * go out back to back before pacing kicks in.
+ */
+static bool udrm_pace_due(struct udrm_device *udev, u64 now)
+{
+	return now + udev->burst_ns >= udev->next_flush_ns;
+}
+
+/*
+ * Idle callback (idle-ms property): Once no damage has been flushed for
+ * idle-ms, the driver gets the framebuffer that was flushed last, for
+ * instance to send it again in a better quality. Pending damage holds it
+ * off and the flush worker is waited on first.
+ */
+static void udrm_idle_due(struct udrm_device *udev)
+{
+	struct udrm_framebuffer *ufb = udev->fb_idle;
+
+	if (!ufb || udev->fb_damaged || udev->fb_urgent ||
+	    ktime_get_ns() < udev->idle_due_ns)
+		return;
+
+	udev->fb_idle = NULL;
+	if (udev->flush)
+		udrm_flush_wait_idle(udev->flush);
+
+	udev->funcs->idle(udev, ufb);
+}
+
+/* Milliseconds until @due_ns for poll(), rounded up */
+static int udrm_timeout_ms(u64 due_ns, u64 now)
+{
+	return due_ns > now ? DIV_ROUND_UP(due_ns - now, NSEC_PER_MSEC) : 0;
+}
+
+/**
+ * udrm_flush_due - Flush paced damage that is due
+ * @udev: udrm device
+ *
+ * Event loops call this when udrm_event_timeout() expires. It also handles
+ * an event that udrm_preempt() held back and calls the idle callback.
+ */
+void udrm_flush_due(struct udrm_device *udev)
+{
+	u64 now;
+
+	if (udev->event_deferred)
+		udrm_event_process(udev);
+
+	udrm_idle_due(udev);
+
+	if (!udev->frame_ns || !udev->fb_damaged)
+		return;
+
+	now = ktime_get_ns();
+	if (!udrm_pace_due(udev, now))
+		return;
+
+	if (now > udev->next_flush_ns + udev->frame_ns)
+		udev->next_flush_ns = now;
+	udev->next_flush_ns += udev->frame_ns;
+
+	udrm_flush_damage(udev, true);
+}
+
+/**
+ * udrm_event_timeout - Time until paced damage or the idle callback is due
+ * @udev: udrm device
+ *
+ * Returns:
+ * Timeout in milliseconds for poll(), -1 if there's nothing pending.
+ * Zero if an event was held back by udrm_preempt().
+ */
+int udrm_event_timeout(struct udrm_device *udev)
+{
+	int timeout = -1;
+	u64 now;
+
+	if (udev->event_deferred)
+		return 0;
+
+	now = ktime_get_ns();
+
+	if (udev->frame_ns && udev->fb_damaged) {
+		if (udrm_pace_due(udev, now))
+			return 0;
+		timeout = udrm_timeout_ms(udev->next_flush_ns - udev->burst_ns, now);
+	}
+
+	if (udev->fb_idle && !udev->fb_damaged && !udev->fb_urgent) {
+		int idle = udrm_timeout_ms(udev->idle_due_ns, now);
+
+		if (timeout < 0 || idle < timeout)
+			timeout = idle;
+	}
+
+	return timeout;
+}
+
+/*
+ * Batching mode: Merge the clips into the framebuffer damage and defer the
+ * flush until the event queue has been drained. The event is acked before
+ * the flush so errors can't be reported back, they're only logged.
+ * Annotated dirty calls (fill/copy) are not merged.
+ */
+static int udrm_fb_damage(struct udrm_device *udev, struct udrm_event_fb_dirty *ev)
+{
+	struct drm_mode_fb_dirty_cmd *dirty = &ev->fb_dirty_cmd;
+	struct udrm_framebuffer *ufb;
+	struct region *damage;
+	unsigned int i;
+	u64 area = 0;
+	int ret;
+
+	if (dirty->flags) {
+		udrm_flush_damage(udev, false);
+		return udrm_fb_dirty(udev, ev);
+	}
+
+	ufb = udrm_fb_lookup(udev, dirty->fb_id);
 	if (!ufb) {
-		DRM_ERROR("[FB:%u] Framebuffer not found\n", ev->fb_dirty_cmd.fb_id);
+		DRM_ERROR("[FB:%u] Framebuffer not found\n", dirty->fb_id);
 		return -EINVAL;
 	}
 
-	DRM_DEBUG("[FB:%u] Dirty\n", ufb->id);
+	DRM_DEBUG("[FB:%u] Damage, num_clips=%u\n", ufb->id, dirty->num_clips);
 
-	if (udev->funcs && udev->funcs->dirtyfb)
-		ret = udev->funcs->dirtyfb(ufb, dirty->flags, dirty->color, ev->clips, dirty->num_clips);
+	if (udev->preempt_pixels) {
+		for (i = 0; i < dirty->num_clips; i++)
+			area += region_area(&ev->clips[i]);
+		if (!dirty->num_clips)
+			area = ufb->width * ufb->height;
+	}
 
-	return ret;
+	if (area && area <= udev->preempt_pixels) {
+		damage = &ufb->urgent;
+		udev->fb_urgent |= BIT(ufb - udev->fb_pool);
+	} else {
+		damage = &ufb->damage;
+		udev->fb_damaged |= BIT(ufb - udev->fb_pool);
+	}
+
+	if (!region_empty(damage))
+		udev->stats.events_merged++;
+
+	if (!dirty->num_clips) {
+		struct drm_clip_rect full = {
+			.x2 = ufb->width,
+			.y2 = ufb->height,
+		};
+
+		return region_union_rect(damage, damage, &full);
+	}
+
+	for (i = 0; i < dirty->num_clips; i++) {
+		ret = region_union_rect(damage, damage, &ev->clips[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Note when the first of the pending damage arrived */
+static void udrm_damage_arrived(struct udrm_device *udev, u64 timestamp)
+{
+	if (udev->fb_damaged && !udev->damage_ns)
+		udev->damage_ns = timestamp;
+	if (udev->fb_urgent && !udev->urgent_ns)
+		udev->urgent_ns = timestamp;
 }
 
 static int udrm_event(struct udrm_device *udev, struct udrm_event *ev)
@@ -310,74 +899,289 @@ static int udrm_event(struct udrm_device *udev, struct udrm_event *ev)
 	return ret;
 }
 
+static void udrm_event_record(struct udrm_device *udev, struct udrm_event *ev, u64 timestamp_ns,
+			      int event_ret)
+{
+	struct udrm_framebuffer *ufb = NULL;
+
+	if (ev->type == UDRM_EVENT_FB_CREATE)
+		ufb = udrm_fb_lookup(udev, ((struct udrm_event_fb *)ev)->fb_id);
+	else if (ev->type == UDRM_EVENT_FB_DIRTY)
+		ufb = udrm_fb_lookup(udev, ((struct udrm_event_fb_dirty *)ev)->fb_dirty_cmd.fb_id);
+
+	udrm_record_event(udev->record, ev, ufb, timestamp_ns, event_ret);
+}
+
 static volatile sig_atomic_t udrm_shutdown = 0;
+static volatile sig_atomic_t udrm_stats_request = 0;
 
 static void udrm_sighandler(int signum)
 {
 	udrm_shutdown = 1;
 }
 
+static void udrm_stats_sighandler(int signum)
+{
+	udrm_stats_request = 1;
+}
+
 static struct sigaction udrm_sigaction = {
 	.sa_handler = udrm_sighandler,
 };
 
-int udrm_event_loop(struct udrm_device *udev)
-{
-	struct udrm_event *ev;
-	struct pollfd pfd;
-	int ret;
+static struct sigaction udrm_stats_sigaction = {
+	.sa_handler = udrm_stats_sighandler,
+};
 
+/* SIGTERM/SIGINT stops the event loop, SIGUSR1 prints stats */
+void udrm_signals_init(void)
+{
 	sigaction(SIGTERM, &udrm_sigaction, NULL);
 	sigaction(SIGINT, &udrm_sigaction, NULL);
+	sigaction(SIGUSR1, &udrm_stats_sigaction, NULL);
+}
 
-	ev = malloc(1024);
-	if (!ev) {
-		pr_err("%s: Failed to allocate memory\n", __func__);
-		return -ENOMEM;
-	}
+bool udrm_shutdown_requested(void)
+{
+	return udrm_shutdown;
+}
 
-	pfd.fd = udev->fd;
-	pfd.events = POLLIN;
-	pfd.revents = 0;
+bool udrm_stats_requested(void)
+{
+	if (!udrm_stats_request)
+		return false;
 
-	while (!(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
-		int event_ret;
+	udrm_stats_request = 0;
 
-		if (udev->dev && udev->dev->shutdown) {
-			pr_err("Device shutdown\n");
-			ret = -ESHUTDOWN;
-			goto out;
+	return true;
+}
+
+void udrm_print_stats(struct udrm_device *udev)
+{
+	struct udrm_stats *stats = &udev->stats;
+	u64 elapsed_ms = (ktime_get_ns() - stats->start_ns) / NSEC_PER_MSEC;
+
+	DRM_INFO("%s: events read=%lu (%lu/s), merged=%lu, flushes=%lu, wakeups=%lu\n", udev->name,
+		 stats->events_read, elapsed_ms ? (unsigned long)(stats->events_read * 1000 / elapsed_ms) : 0,
+		 stats->events_merged, stats->flushes, stats->wakeups);
+	if (stats->damage_flushes)
+		DRM_INFO("%s: damage flushes=%lu (%lu.%lu/s, target %llu/s), avg=%llu pixels, wait avg=%lluus, max=%lluus\n",
+			 udev->name, stats->damage_flushes,
+			 elapsed_ms ? (unsigned long)(stats->damage_flushes * 1000 / elapsed_ms) : 0,
+			 elapsed_ms ? (unsigned long)(stats->damage_flushes * 10000 / elapsed_ms % 10) : 0,
+			 udev->frame_ns ? (unsigned long long)(NSEC_PER_SEC / udev->frame_ns) : 0ULL,
+			 (unsigned long long)(stats->damage_pixels / stats->damage_flushes),
+			 (unsigned long long)(stats->damage_wait_ns / stats->damage_flushes / NSEC_PER_USEC),
+			 (unsigned long long)(stats->damage_wait_max_ns / NSEC_PER_USEC));
+	if (stats->urgent_flushes)
+		DRM_INFO("%s: urgent flushes=%lu, avg=%llu pixels, preempting=%lu\n", udev->name,
+			 stats->urgent_flushes, (unsigned long long)(stats->urgent_pixels / stats->urgent_flushes),
+			 stats->preempt_flushes);
+	if (udev->flush)
+		udrm_flush_print_stats(udev->flush);
+	if (udev->funcs && udev->funcs->print_stats)
+		udev->funcs->print_stats(udev);
+	udrm_latency_print(udev->latency, udev->name);
+}
+
+/* Read an event into udev->event, returns zero if interrupted */
+static int udrm_event_read(struct udrm_device *udev)
+{
+	int ret;
+
+	if (!udev->event) {
+		udev->event = malloc(UDRM_EVENT_MAX_SIZE);
+		if (!udev->event) {
+			pr_err("%s: Failed to allocate memory\n", __func__);
+			return -ENOMEM;
 		}
+	}
+
+	ret = read(udev->fd, udev->event, UDRM_EVENT_MAX_SIZE);
+	if (ret < 0) {
+		/* signal, the caller checks for shutdown */
+		if (errno == EINTR)
+			return 0;
+		pr_err("%s: Failed to read from /dev/udrm: %s\n", __func__, strerror(errno));
+		return -errno;
+	}
+	if (!ret)
+		return -ESHUTDOWN;
+
+	udev->stats.events_read++;
+
+	return ret;
+}
+
+static int udrm_event_ack(struct udrm_device *udev, struct udrm_event *ev, u64 timestamp, int event_ret)
+{
+	int ret;
+
+	/* the pixels are only stable until the ack */
+	if (udev->record)
+		udrm_event_record(udev, ev, timestamp, event_ret);
+
+	ret = write(udev->fd, &event_ret, sizeof(int));
+	if (ret < 0 && !udrm_shutdown) {
+		pr_err("%s: Failed to write to /dev/udrm: %s\n", __func__, strerror(errno));
+		return -errno;
+	}
+	udrm_latency_add(udev->latency, UDRM_LATENCY_ACK, timestamp);
+
+	return 0;
+}
+
+/**
+ * udrm_preempt - Flush urgent damage in the middle of a flush
+ * @udev: udrm device
+ *
+ * Drivers that split big transfers call this between the pieces when
+ * udev->preemptible is set, which is when accumulated damage is flushed
+ * (batching, frame pacing) and the events have already been acked. Pending
+ * dirty events are read and acked, and damage covering no more than
+ * "preempt-pixels" is flushed right away. Bigger damage is left for the
+ * next flush. Any other event is held back until the interrupted flush is
+ * done, it could be about the framebuffer being flushed.
+ *
+ * Returns:
+ * True if something was flushed, the driver has to set up its window again
+ * before resuming.
+ */
+bool udrm_preempt(struct udrm_device *udev)
+{
+	struct pollfd pfd = {
+		.fd = udev->fd,
+		.events = POLLIN,
+	};
+	struct udrm_event_fb_dirty *dirty;
+	u64 timestamp;
+	int ret;
 
-		ret = read(udev->fd, ev, 1024);
-		if (udrm_shutdown) {
-			ret = 0;
+	if (!udev->preemptible || udev->event_deferred)
+		return false;
+
+	while (poll(&pfd, 1, 0) > 0) {
+		ret = udrm_event_read(udev);
+		if (ret <= 0)
+			break;
+
+		timestamp = ktime_get_ns();
+		dirty = (struct udrm_event_fb_dirty *)udev->event;
+		if (udev->event->type != UDRM_EVENT_FB_DIRTY || dirty->fb_dirty_cmd.flags) {
+			udev->event_deferred = true;
+			udev->deferred_ns = timestamp;
 			break;
 		}
-		if (ret < 0) {
-			pr_err("%s: Failed to read from /dev/udrm: %s\n", __func__, strerror(errno));
-			ret = -errno;
-			goto out;
-		}
 
+		ret = udrm_fb_damage(udev, dirty);
+		udrm_damage_arrived(udev, timestamp);
+		if (udrm_event_ack(udev, udev->event, timestamp, ret))
+			break;
+	}
+
+	if (!udrm_flush_urgent(udev))
+		return false;
+
+	udev->stats.preempt_flushes++;
+
+	return true;
+}
+
+/**
+ * udrm_event_process - Handle an event
+ * @udev: udrm device
+ *
+ * Reads, handles and acks one event, the file descriptor must be readable.
+ * In batching mode the damage is flushed when there are no more events
+ * queued. With frame pacing it is flushed when due, the caller must wait
+ * no longer than udrm_event_timeout() and then call udrm_flush_due().
+ *
+ * Returns:
+ * Zero on success, negative error code if the device is gone or broken.
+ */
+int udrm_event_process(struct udrm_device *udev)
+{
+	struct pollfd pfd = {
+		.fd = udev->fd,
+		.events = POLLIN,
+	};
+	struct udrm_event *ev;
+	int event_ret, ret;
+	u64 timestamp;
+
+	if (udev->dev && udev->dev->shutdown) {
+		pr_err("Device shutdown\n");
+		return -ESHUTDOWN;
+	}
+
+	udev->stats.wakeups++;
+
+	if (udev->event_deferred) {
+		/* held back by udrm_preempt(), it's been read already */
+		udev->event_deferred = false;
+		timestamp = udev->deferred_ns;
+	} else {
+		ret = udrm_event_read(udev);
+		if (ret <= 0)
+			return ret;
+		timestamp = ktime_get_ns();
+	}
+	ev = udev->event;
+
+	if ((udev->batch || udev->frame_ns) && ev->type == UDRM_EVENT_FB_DIRTY) {
+		event_ret = udrm_fb_damage(udev, (struct udrm_event_fb_dirty *)ev);
+		udrm_damage_arrived(udev, timestamp);
+	} else {
+		/* keep ordering with enable/disable and fb destroy */
+		udrm_flush_damage(udev, false);
+		if (udev->flush && ev->type != UDRM_EVENT_FB_DIRTY)
+			udrm_flush_wait_idle(udev->flush);
+		udev->event_ns = timestamp;
 		event_ret = udrm_event(udev, ev);
+	}
+
+	ret = udrm_event_ack(udev, ev, timestamp, event_ret);
+	if (ret)
+		return ret;
+
+	/* Batching: drain all queued events before flushing */
+	if (udev->batch && poll(&pfd, 1, 0) > 0)
+		return 0;
 
-		ret = write(udev->fd, &event_ret, sizeof(int));
-		if (udrm_shutdown) {
-			ret = 0;
+	udrm_flush_urgent(udev);
+
+	if (udev->frame_ns)
+		udrm_flush_due(udev);
+	else if (udev->batch)
+		udrm_flush_damage(udev, true);
+
+	return 0;
+}
+
+int udrm_event_loop(struct udrm_device *udev)
+{
+	struct pollfd pfd;
+	int ret = 0;
+
+	udrm_signals_init();
+
+	pfd.fd = udev->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	while (!(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+		if (udrm_stats_requested())
+			udrm_print_stats(udev);
+
+		ret = udrm_event_process(udev);
+		if (ret || udrm_shutdown)
 			break;
-		}
-		if (ret < 0) {
-			pr_err("%s: Failed to write to /dev/udrm: %s\n", __func__, strerror(errno));
-			ret = -errno;
-			goto out;
-		}
 
-		poll(&pfd, 1, -1);
+		while (!poll(&pfd, 1, udrm_event_timeout(udev)))
+			udrm_flush_due(udev);
 	}
 
-out:
-	free(ev);
+	udrm_print_stats(udev);
 
 	return ret;
 }
@@ -11,26 +11,111 @@
 
 #include "base.h"
 #include "dmabuf.h"
+#include "region.h"
+#include "udrm-latency.h"
 
 
 
 
 struct udrm_device;
+struct udrm_flush_worker;
+struct udrm_recorder;
 
 struct udrm_framebuffer {
 	struct udrm_device *udev;
 	unsigned int width;
 	unsigned int height;
 	unsigned int pitch;
+	unsigned int cpp; /* bytes per pixel */
 	uint32_t pixel_format; /* fourcc format */
 
 	unsigned int id;
 	unsigned int handle;
-	struct dma_buf *dmabuf;
+	struct dma_buf *dmabuf; /* exported framebuffer, see udrm_device.prime */
+
+	/* snapshot of the pixels, used instead of the buffers when set */
+	void *vaddr;
+	struct dma_buf *snapshot;
 
-	struct udrm_framebuffer *next;
+	/* pending damage when batching, see udrm_fb_damage() */
+	struct region damage;
+	/* small damage that is flushed ahead, see udrm_preempt() */
+	struct region urgent;
 };
 
+/* Size of the framebuffer pool, the masks in &udrm_device are 32 bits wide */
+#define UDRM_MAX_FBS		32
+
+/* fb_id hash table, twice the pool size keeps the probe sequences short */
+#define UDRM_FB_TABLE_BITS	6
+#define UDRM_FB_TABLE_SIZE	(1 << UDRM_FB_TABLE_BITS)
+
+/* Batched damage is simplified to this many rectangles before flushing */
+#define UDRM_DAMAGE_MAX_RECTS	8
+
+/*
+ * Largest possible event, a dirty event carrying the maximum number of clips
+ * the DRM core accepts for DRM_IOCTL_MODE_DIRTYFB.
+ */
+#define UDRM_EVENT_MAX_SIZE (sizeof(struct udrm_event_fb_dirty) + \
+			     DRM_MODE_FB_DIRTY_MAX_CLIPS * sizeof(struct drm_clip_rect))
+
+/**
+ * struct udrm_stats - Event loop counters
+ * @events_read: Events read from /dev/udrm
+ * @events_merged: Dirty events folded into damage that was already pending
+ * @flushes: Number of times the dirtyfb callback was called
+ * @wakeups: Number of times the event loop woke up to handle the device
+ * @damage_flushes: Accumulated damage flushes (batching, frame pacing)
+ * @damage_pixels: Area flushed by @damage_flushes
+ * @damage_wait_ns: Total time accumulated damage waited to be flushed
+ * @damage_wait_max_ns: Longest wait
+ * @urgent_flushes: Small damage flushed without waiting (preempt-pixels)
+ * @urgent_pixels: Area flushed by @urgent_flushes
+ * @preempt_flushes: Urgent flushes done in the middle of another flush
+ * @start_ns: Time of registration, used for rates
+ */
+struct udrm_stats {
+	unsigned long events_read;
+	unsigned long events_merged;
+	unsigned long flushes;
+	unsigned long wakeups;
+	unsigned long damage_flushes;
+	u64 damage_pixels;
+	u64 damage_wait_ns;
+	u64 damage_wait_max_ns;
+	unsigned long urgent_flushes;
+	u64 urgent_pixels;
+	unsigned long preempt_flushes;
+	u64 start_ns;
+};
+
+
+/**
+ * struct udrm_backend - Control channel
+ * @name: Name
+ * @create_buf: Create a buffer that can be shared with the kernel,
+ *              returns a dma-buf file descriptor
+ * @dev_create: Create the device, sets up &udrm_device.fd for the events
+ *              and &udrm_device.control_fd
+ * @get_fb: Get framebuffer info (DRM_IOCTL_MODE_GETFB)
+ * @export_fb: Export a framebuffer (DRM_IOCTL_PRIME_HANDLE_TO_FD),
+ *             returns a dma-buf file descriptor
+ * @dev_destroy: Free backend state (optional)
+ *
+ * The events are read from and acked on &udrm_device.fd the same way for
+ * all backends.
+ */
+struct udrm_backend {
+	const char *name;
+	int (*create_buf)(struct udrm_device *udev, size_t size);
+	int (*dev_create)(struct udrm_device *udev, struct udrm_dev_create *create);
+	int (*get_fb)(struct udrm_device *udev, struct drm_mode_fb_cmd *info);
+	int (*export_fb)(struct udrm_device *udev, unsigned int handle);
+	void (*dev_destroy)(struct udrm_device *udev);
+};
+
+extern const struct udrm_backend udrm_kernel_backend;
 
 struct udrm_funcs {
 	void (*enable)(struct udrm_device *udev);
@@ -40,11 +125,21 @@ struct udrm_funcs {
 		       unsigned int flags, unsigned int color,
 		       struct drm_clip_rect *clips,
 		       unsigned int num_clips);
+
+	/* optional, driver counters */
+	void (*print_stats)(struct udrm_device *udev);
+
+	/* optional, no damage for idle-ms since @ufb was flushed */
+	void (*idle)(struct udrm_device *udev, struct udrm_framebuffer *ufb);
 };
 
 struct udrm_device {
 	struct device *dev;
 
+	/* defaults to the kernel module */
+	const struct udrm_backend *backend;
+	void *backend_data;
+
 	int index;
 	int fd;
 	int control_fd;
@@ -56,17 +151,87 @@ struct udrm_device {
 	bool enabled;
 	const struct udrm_funcs *funcs;
 
-	struct udrm_framebuffer *fbs;
+	/*
+	 * Framebuffers live in a fixed pool indexed by an open addressed
+	 * fb_id hash table (-1 is an empty slot), see udrm_fb_lookup().
+	 */
+	struct udrm_framebuffer fb_pool[UDRM_MAX_FBS];
+	s8 fb_table[UDRM_FB_TABLE_SIZE];
+	u32 fb_free;		/* bitmask of unused pool entries */
+	u32 fb_damaged;		/* bitmask of entries with pending damage */
+	u64 damage_ns;		/* when the pending damage arrived */
+	u32 fb_urgent;		/* bitmask of entries with urgent damage */
+	u64 urgent_ns;		/* when the urgent damage arrived */
+	u64 event_ns;		/* when the damage being flushed arrived */
+
+	/* frame pacing, see udrm_flush_due() */
+	u64 frame_ns;		/* frame period, zero if not paced */
+	u64 burst_ns;		/* how far the schedule may fall behind */
+	u64 next_flush_ns;
+
+	/* idle callback, see udrm_flush_due() */
+	u64 idle_ns;		/* idle-ms, zero disables */
+	u64 idle_due_ns;
+	struct udrm_framebuffer *fb_idle;	/* flushed last, idle callback pending */
+
+	/* preemption, see udrm_preempt() */
+	u32 preempt_pixels;	/* largest urgent dirty event, zero disables */
+	bool preemptible;	/* acked damage is being flushed synchronously */
+	bool event_deferred;	/* udev->event has been read, not handled */
+	u64 deferred_ns;
 
 	struct dma_buf *dmabuf;
+	bool prime;		/* no kernel copy, framebuffers are exported */
+
+	bool batch;
+	struct udrm_flush_worker *flush;
+	struct udrm_stats stats;
+	struct udrm_event *event;
+	struct udrm_recorder *record;
+	struct udrm_latency *latency;	/* NULL unless CONFIG_UDRM_LATENCY */
 };
 
 
+/*
+ * Layout of the pixels the flush path reads. Imported framebuffers are read
+ * directly, otherwise the kernel copies the damaged area into the shared
+ * buffer as RGB565 (XRGB8888 is emulated) at the same position as in the
+ * framebuffer.
+ */
+static inline struct dma_buf *udrm_fb_dma_buf(const struct udrm_framebuffer *ufb)
+{
+	if (ufb->snapshot)
+		return ufb->snapshot;
+
+	return ufb->dmabuf ? ufb->dmabuf : ufb->udev->dmabuf;
+}
+
+static inline unsigned int udrm_buf_pitch(const struct udrm_framebuffer *ufb)
+{
+	return ufb->dmabuf ? ufb->pitch : ufb->width * 2;
+}
+
+static inline unsigned int udrm_buf_cpp(const struct udrm_framebuffer *ufb)
+{
+	return ufb->dmabuf ? ufb->cpp : 2;
+}
+
+
+int udrm_create_dma_buf(struct udrm_device *udev, size_t size);
 int udrm_register(struct udrm_device *udev, const char *name, const struct drm_mode_modeinfo *mode,
 		  const uint32_t *formats, unsigned int num_formats, u32 buf_mode);
 void udrm_unregister(struct udrm_device *udev);
 
+int udrm_event_process(struct udrm_device *udev);
+bool udrm_preempt(struct udrm_device *udev);
+int udrm_event_timeout(struct udrm_device *udev);
+void udrm_flush_due(struct udrm_device *udev);
 int udrm_event_loop(struct udrm_device *udev);
+void udrm_print_stats(struct udrm_device *udev);
+
+void udrm_signals_init(void);
+bool udrm_shutdown_requested(void);
+bool udrm_stats_requested(void);
 
 
 